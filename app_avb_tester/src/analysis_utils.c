@@ -1,47 +1,291 @@
+#include <string.h>
 #include "debug_print.h"
 #include "analysis_utils.h"
 #include "nettypes.h"
 #include "avb_1722_common.h"
 #include "pcapng.h"
 #include "xassert.h"
-#include "hwlock.h"
+#include "avb_tester.h"
+#include "util.h"
+#include "shaper.h"
+#include "gptp.h"
 
-#define MAX_NUM_STREAMS 16
-
-// Class A traffic should have 8k packets per second
+// Class A traffic should have 8k packets per second, and class B 4k
 #define CLASS_A_PACKETS_PER_SEC 8000
+#define CLASS_B_PACKETS_PER_SEC 4000
+
+// Preamble, SFD and inter-frame gap
+#define WIRE_OVERHEAD_BYTES 20
 
 // The standard allows for a variation of +/- 4 packets
 #define ERROR_MARGIN 4
 
-stream_state_t stream_state[MAX_NUM_STREAMS];
-hwlock_t lock;
+/*
+ * The counts of each window are updated without a lock. Each core that counts
+ * frames owns two banks of counts and updates the bank of the current epoch.
+ * check_counts() starts the next epoch, waits for any update of the last bank
+ * that was already under way and then reads and clears that bank, so the
+ * cores counting frames never wait for it.
+ */
+typedef struct {
+  unsigned int drop_count[PCAPNG_NUM_INTERFACES]; // Frames dropped on each interface
+  unsigned int untracked_count;                   // Packets of streams not in the table
+  unsigned int cost_frames;
+  unsigned int cost_max_ticks;
+  uint64_t cost_ticks;
+} counts_bank_t;
+
+typedef struct {
+  volatile unsigned sequence;      // Odd while a bank is being updated
+  counts_bank_t bank[2];
+} counts_writer_t;
+
+// Each analyser core (analyse_buffer() and analyse_cost()) then the control
+// core (analyse_dropped())
+#define WRITER_CONTROL ANALYSIS_WORKERS
+#define NUM_WRITERS    (ANALYSIS_WORKERS + 1)
+
+/*
+ * The inter-arrival times of a stream in a window (see stream_jitter_record_t).
+ */
+typedef struct {
+  unsigned int intervals;
+  uint16_t nominal_ticks;
+  uint16_t min_ticks;
+  uint16_t max_ticks;
+  uint16_t bins[JITTER_BINS];
+} stream_jitter_t;
+
+/*
+ * The sequence errors of a stream in a window (see stream_sequence_record_t).
+ * The counts of less than a packet each are saturated at 0xffff.
+ */
+typedef struct {
+  unsigned int lost;
+  uint16_t duplicates;
+  uint16_t reordered;
+  uint16_t restarts;
+  uint16_t gap_bins[SEQUENCE_GAP_BINS];
+} stream_sequence_t;
+
+/*
+ * The counts of the streams of an analyser core, banked with the other counts
+ * of that core. Only the analyser cores have them.
+ */
+typedef struct {
+  unsigned int stream_count[MAX_NUM_STREAMS];     // Packets of each stream
+  stream_jitter_t jitter[MAX_NUM_STREAMS];
+  stream_sequence_t sequence[MAX_NUM_STREAMS];
+} stream_bank_t;
+
+/*
+ * What check_counts() knows of each stream. It follows the streams in the
+ * table by the counts alone so never has to wait for the analyser.
+ */
+typedef struct {
+  stream_id_t id;
+  int tracked;
+  int active;                     // Determines whether the stream should be checked
+  unsigned int last_count;        // Packet count in the window before last
+  unsigned int snapshot;          // Packet count in the last window
+} stream_report_t;
+
+/*
+ * The streams of each analyser core are found through an open addressing hash
+ * table of the entries in stream_state, with linear probing. There are twice as
+ * many buckets as entries so the probe sequences stay short. The entries don't
+ * move, so their counts and reports stay with them, and a stream is removed by
+ * moving the later buckets of its probe sequence back over it rather than
+ * leaving a tombstone, so a lookup never has to step over removed streams.
+ */
+#define STREAM_BUCKETS (2 * MAX_NUM_STREAMS)
+
+typedef struct {
+  uint16_t bucket[STREAM_BUCKETS];        // Entry of the stream + 1, 0 if empty
+  uint16_t free_entry[MAX_NUM_STREAMS];   // Stack of the unused entries
+  unsigned int num_free;
+  unsigned int sweep;                     // The next bucket checked for an idle stream
+  unsigned int full_sweep_epoch;          // The last epoch all the buckets were checked
+} stream_table_t;
+
+// The xCORE makes the memory accesses of a core in program order, so only the
+// compiler has to be stopped from moving the updates outside of the sequence
+#define COUNTS_BARRIER() asm volatile("" ::: "memory")
 
-static void increment_count(const stream_id_t *id, unsigned int packet_num_bytes,
-    unsigned char sequence_number);
+static volatile unsigned epoch;
+static counts_writer_t writers[NUM_WRITERS];
+static stream_bank_t stream_banks[ANALYSIS_WORKERS][2];
+
+// The shapers are only modelled by the control core, so only it has these banks
+static shaper_window_t shaper_windows[2][SHAPER_NUM_INTERFACES][SHAPER_NUM_CLASSES];
+
+// The gPTP frames all go to the first analyser core, so only it has these banks
+#define GPTP_WORKER 0
+static gptp_window_t gptp_windows[2];
+
+// Each analyser core only uses its own streams
+stream_state_t stream_state[ANALYSIS_WORKERS][MAX_NUM_STREAMS];
+static stream_table_t stream_table[ANALYSIS_WORKERS];
+
+// Only used by the core calling check_counts()
+static stream_report_t stream_report[ANALYSIS_WORKERS][MAX_NUM_STREAMS];
+
+// The drop count of the receiver tile from the last Interface Statistics Block
+// of each interface, and the part of it already reported
+static volatile unsigned int receiver_drops[PCAPNG_NUM_INTERFACES];
+static unsigned int receiver_drops_reported[PCAPNG_NUM_INTERFACES];
+
+static void increment_count(unsigned worker, const stream_id_t *id,
+    const enhanced_packet_block_t *epb, unsigned char sequence_number, shaper_class_t traffic_class);
 
 void analyse_init()
 {
-  // Allocate the hardware lock that will be used to guard access to shared state
-  lock = hwlock_alloc();
+  memset(writers, 0, sizeof(writers));
+  memset(stream_banks, 0, sizeof(stream_banks));
+  memset(shaper_windows, 0, sizeof(shaper_windows));
+  shaper_init();
+  memset(gptp_windows, 0, sizeof(gptp_windows));
+  gptp_init();
+  memset(stream_state, 0, sizeof(stream_state));
+  memset(stream_report, 0, sizeof(stream_report));
+  memset(stream_table, 0, sizeof(stream_table));
+  for (unsigned int w = 0; w < ANALYSIS_WORKERS; w++) {
+    for (unsigned int i = 0; i < MAX_NUM_STREAMS; i++)
+      stream_table[w].free_entry[i] = MAX_NUM_STREAMS - 1 - i;
+    stream_table[w].num_free = MAX_NUM_STREAMS;
+    stream_table[w].full_sweep_epoch = ~0;
+  }
+  epoch = 0;
 }
 
-void analyse_buffer(const unsigned char *buffer, const unsigned int length_in_bytes)
+static counts_bank_t *counts_begin(unsigned writer_id, unsigned *current_epoch)
+{
+  counts_writer_t *writer = &writers[writer_id];
+  writer->sequence++;
+  COUNTS_BARRIER();
+  *current_epoch = epoch;
+  return &writer->bank[*current_epoch & 1];
+}
+
+static void counts_end(unsigned writer_id)
+{
+  COUNTS_BARRIER();
+  writers[writer_id].sequence++;
+}
+
+/*
+ * Start the next epoch and return when no core is still updating a bank of the
+ * last one. A core that was part way through an update when the epoch changed
+ * may have been updating either bank, so wait for it to finish.
+ */
+static unsigned counts_next_epoch()
+{
+  unsigned last_epoch = epoch;
+
+  epoch = last_epoch + 1;
+  COUNTS_BARRIER();
+  for (unsigned int i = 0; i < NUM_WRITERS; i++) {
+    unsigned sequence = writers[i].sequence;
+    if (sequence & 1) {
+      while (writers[i].sequence == sequence)
+        ;
+    }
+  }
+  COUNTS_BARRIER();
+  return last_epoch & 1;
+}
+
+static void record_receiver_drops(const interface_statistics_block_t *isb)
+{
+  unsigned int interface_id = isb->interface_id;
+
+  xassert(interface_id < PCAPNG_NUM_INTERFACES);
+  // A single word so it is never seen part written
+  receiver_drops[interface_id] = isb->isb_ifdrop_low;
+}
+
+void analyse_dropped(const unsigned char *buffer)
+{
+  enhanced_packet_block_t *epb = (enhanced_packet_block_t *)buffer;
+  unsigned current_epoch;
+
+  if (epb->block_type == PCAPNG_BLOCK_INTERFACE_STATISTICS) {
+    // The statistics are still valid even if the buffer can't be queued
+    record_receiver_drops((const interface_statistics_block_t *)buffer);
+    return;
+  }
+
+  xassert(epb->interface_id < PCAPNG_NUM_INTERFACES);
+  counts_bank_t *bank = counts_begin(WRITER_CONTROL, &current_epoch);
+  bank->drop_count[epb->interface_id]++;
+  counts_end(WRITER_CONTROL);
+}
+
+void analyse_shaper(const unsigned char *buffer)
+{
+  unsigned current_epoch;
+
+  counts_begin(WRITER_CONTROL, &current_epoch);
+  shaper_analyse(buffer, shaper_windows[current_epoch & 1]);
+  counts_end(WRITER_CONTROL);
+}
+
+unsigned analyse_worker(const unsigned char *buffer)
+{
+  const enhanced_packet_block_t *epb = (const enhanced_packet_block_t *)buffer;
+
+  if (ANALYSIS_WORKERS == 1 || epb->block_type == PCAPNG_BLOCK_INTERFACE_STATISTICS)
+    return 0;
+
+  // A runt without both MAC addresses has nothing to share it by, and the
+  // rest of the buffer is left over from an earlier frame
+  if (epb->captured_len < 12)
+    return 0;
+
+  // The gPTP messages of different ports are matched up, so are analysed in
+  // order by one core
+  const ethernet_hdr_t *hdr = (const ethernet_hdr_t *)&epb->data;
+  if (epb->captured_len >= 14 && ntoh16(hdr->ethertype) == GPTP_ETHERTYPE)
+    return GPTP_WORKER;
+
+  // The MAC addresses are the first three words of the frame. The high bits of
+  // the product depend on all the bits of the addresses.
+  const uint32_t *words = (const uint32_t *)&epb->data;
+  uint32_t hash = (words[0] ^ words[1] ^ words[2]) * 0x9e3779b1u;
+  return (hash >> 24) % ANALYSIS_WORKERS;
+}
+
+void analyse_buffer(const unsigned char *buffer, unsigned worker)
 {
   enhanced_packet_block_t *epb = (enhanced_packet_block_t *)buffer;
 
   uint16_t ethertype;
   void *payload;
 
+  if (epb->block_type == PCAPNG_BLOCK_INTERFACE_STATISTICS) {
+    record_receiver_drops((const interface_statistics_block_t *)buffer);
+    return;
+  }
+
   ethernet_hdr_t *hdr = (ethernet_hdr_t *) &(epb->data);
   ethertype = ntoh16(hdr->ethertype);
 
+  if (ethertype == GPTP_ETHERTYPE) {
+    unsigned current_epoch;
+    xassert(worker == GPTP_WORKER);
+    counts_begin(worker, &current_epoch);
+    gptp_analyse(buffer, &gptp_windows[current_epoch & 1]);
+    counts_end(worker);
+    return;
+  }
+
   // Packet must be VLAN tagged
   if (ethertype != 0x8100)
     return;
 
   tagged_ethernet_hdr_t *tagged_hdr = (tagged_ethernet_hdr_t *) &(epb->data);
   ethertype = ntoh16(tagged_hdr->ethertype);
+  unsigned int pcp = tagged_hdr->qtag.data[2] >> 5;
   payload = &(tagged_hdr->payload);
 
   if (ethertype != AVB_1722_ETHERTYPE)
@@ -56,120 +300,450 @@ void analyse_buffer(const unsigned char *buffer, const unsigned int length_in_by
 
     if (id.low != 0 || id.high != 0) {
       unsigned char sequence_number = AVBTP_SEQUENCE_NUMBER(avb_hdr);
-      increment_count(&id, epb->packet_len, sequence_number);
+      increment_count(worker, &id, epb, sequence_number, shaper_class(pcp));
     }
   }
 }
 
-void check_counts(int oversubscribed, int debug)
+void analyse_cost(unsigned ticks, unsigned worker)
 {
-  // First pass to snapshot the current counts
-  for (unsigned int i = 0; i < MAX_NUM_STREAMS; i++) {
-    stream_state_t *state = &stream_state[i];
+  unsigned current_epoch;
+  counts_bank_t *bank = counts_begin(worker, &current_epoch);
+  bank->cost_frames++;
+  bank->cost_ticks += ticks;
+  if (ticks > bank->cost_max_ticks)
+    bank->cost_max_ticks = ticks;
+  counts_end(worker);
+}
 
-    state->active = ((state->last_count != 0) && (state->count != 0));
-    state->last_count = state->snapshot;
+/*
+ * Check the packet rate of a stream in the last window. Returns 1 if it is
+ * still active.
+ */
+static int check_stream(stream_report_t *report, unsigned int packet_num_bytes,
+    shaper_class_t traffic_class, int oversubscribed, int debug)
+{
+  if (!report->tracked)
+    return 0;
 
-    // Ensure the read/modify of count is atomic
-    hwlock_acquire(lock);
-    state->snapshot = state->count;
-    state->count = 0;
-    hwlock_release(lock);
+  if (report->snapshot == 0) {
+    // The analyser frees the entry once it has no packets for an epoch
+    debug_printf("Removing stream 0x%x%x\n", report->id.high, report->id.low);
+    report->tracked = 0;
+    return 0;
   }
 
-  int num_active = 0;
-  // Second pass to do the checking and printing
-  for (unsigned int i = 0; i < MAX_NUM_STREAMS; i++) {
-    stream_state_t *state = &stream_state[i];
+  unsigned int expected_rate = (traffic_class == SHAPER_CLASS_B) ?
+                               CLASS_B_PACKETS_PER_SEC : CLASS_A_PACKETS_PER_SEC;
 
-    if (state->id.low || state->id.high) {
-      if (state->snapshot == 0) {
-        debug_printf("Removing stream 0x%x%x\n", state->id.high, state->id.low);
-        hwlock_acquire(lock);
-        state->id.high = 0;
-        state->id.low = 0;
-        hwlock_release(lock);
+  if (oversubscribed) {
+    // When the stream is oversubscribed then there will be an extra byte
+    // of bandwidth allocated per packet.
+    const unsigned int preamble_bytes = 8;
+    const unsigned int ifg_bytes = 96/8; // InterFrameGap = 96 bit-times
 
-      } else {
-        unsigned int expected_rate = CLASS_A_PACKETS_PER_SEC;
-        num_active++;
-
-        if (oversubscribed) {
-          // When the stream is oversubscribed then there will be an extra byte
-          // of bandwidth allocated per packet.
-          const unsigned int preamble_bytes = 8;
-          const unsigned int ifg_bytes = 96/8; // InterFrameGap = 96 bit-times
-
-          // The one extra byte is for the entire frame (data + preamble + IFG)
-          unsigned int num_bytes = state->packet_num_bytes +
-                                      preamble_bytes + ifg_bytes;
-          expected_rate = expected_rate * (num_bytes + 1) / num_bytes; 
-        }
-
-        // Need to check the value of last_count because otherwise there are
-        // spurious errors when the stream is stopping.
-        if (state->active &&
-            (state->last_count < (expected_rate - ERROR_MARGIN) ||
-             state->last_count > (expected_rate + ERROR_MARGIN)))
-        {
-          debug_printf("ERROR: 0x%x%x had %d packets in the last second\n", state->id.high, state->id.low,
-              state->last_count);
-        } else if (debug) {
-          debug_printf("0x%x%x %d\n", state->id.high, state->id.low,
-              state->last_count);
-        }
+    // The one extra byte is for the entire frame (data + preamble + IFG)
+    unsigned int num_bytes = packet_num_bytes + preamble_bytes + ifg_bytes;
+    expected_rate = expected_rate * (num_bytes + 1) / num_bytes;
+  }
+
+  // Need to check the value of last_count because otherwise there are
+  // spurious errors when the stream is stopping.
+  if (report->active &&
+      (report->last_count < (expected_rate - ERROR_MARGIN) ||
+       report->last_count > (expected_rate + ERROR_MARGIN)))
+  {
+    debug_printf("ERROR: 0x%x%x had %d packets in the last second\n", report->id.high, report->id.low,
+        report->last_count);
+  } else if (debug) {
+    debug_printf("0x%x%x %d\n", report->id.high, report->id.low,
+        report->last_count);
+  }
+  return 1;
+}
+
+static void send_jitter(const stream_id_t *id, const stream_jitter_t *jitter)
+{
+  stream_jitter_record_t record;
+
+  record.id_high = id->high;
+  record.id_low = id->low;
+  record.intervals = jitter->intervals;
+  record.nominal_ticks = jitter->nominal_ticks;
+  record.min_ticks = jitter->min_ticks;
+  record.max_ticks = jitter->max_ticks;
+  for (unsigned int i = 0; i < JITTER_BINS; i++)
+    record.bins[i] = jitter->bins[i];
+  xscope_bytes_c(AVB_TESTER_PROBE_JITTER, sizeof(record), (unsigned char *)&record);
+}
+
+/*
+ * The idleSlope reserved by a stream in bits per second: its frames on the wire
+ * at the rate of its class, with the margin allowed by check_stream(). When the
+ * stream is oversubscribed an extra byte is reserved for each frame.
+ */
+static unsigned int stream_idle_slope(const stream_state_t *state, int oversubscribed)
+{
+  unsigned int packets_per_sec = (state->traffic_class == SHAPER_CLASS_A) ?
+                                 CLASS_A_PACKETS_PER_SEC : CLASS_B_PACKETS_PER_SEC;
+  unsigned int num_bytes = state->packet_num_bytes + WIRE_OVERHEAD_BYTES + (oversubscribed ? 1 : 0);
+  return (packets_per_sec + ERROR_MARGIN) * num_bytes * 8;
+}
+
+static void send_sequence(const stream_id_t *id, const stream_sequence_t *sequence)
+{
+  stream_sequence_record_t record;
+
+  record.id_high = id->high;
+  record.id_low = id->low;
+  record.lost = sequence->lost;
+  record.duplicates = sequence->duplicates;
+  record.reordered = sequence->reordered;
+  record.restarts = sequence->restarts;
+  for (unsigned int i = 0; i < SEQUENCE_GAP_BINS; i++)
+    record.gap_bins[i] = sequence->gap_bins[i];
+  xscope_bytes_c(AVB_TESTER_PROBE_SEQUENCE, sizeof(record), (unsigned char *)&record);
+}
+
+void check_counts(int oversubscribed, int debug)
+{
+  unsigned int idle_slope[SHAPER_NUM_INTERFACES][SHAPER_NUM_CLASSES];
+  unsigned int drop_count[PCAPNG_NUM_INTERFACES];
+  unsigned int untracked_count = 0;
+  unsigned int cost_frames = 0;
+  unsigned int cost_max_ticks = 0;
+  uint64_t cost_ticks = 0;
+  unsigned last = counts_next_epoch();
+
+  memset(idle_slope, 0, sizeof(idle_slope));
+
+  // First pass to snapshot the counts of the last epoch
+  for (unsigned int w = 0; w < ANALYSIS_WORKERS; w++) {
+    stream_bank_t *streams = &stream_banks[w][last];
+
+    for (unsigned int i = 0; i < MAX_NUM_STREAMS; i++) {
+      stream_report_t *report = &stream_report[w][i];
+      unsigned int count = streams->stream_count[i];
+
+      if (!report->tracked && count) {
+        // The analyser can't reuse the entry while it has packets in the last
+        // epoch, so the ID is stable
+        report->id = stream_state[w][i].id;
+        report->tracked = 1;
+        report->last_count = 0;
+        report->snapshot = 0;
       }
+
+      report->active = ((report->last_count != 0) && (count != 0));
+      report->last_count = report->snapshot;
+      report->snapshot = count;
+
+      if (streams->jitter[i].intervals)
+        send_jitter(&report->id, &streams->jitter[i]);
+
+      const stream_sequence_t *sequence = &streams->sequence[i];
+      if (sequence->lost || sequence->duplicates || sequence->reordered || sequence->restarts)
+        send_sequence(&report->id, sequence);
+
+      const stream_state_t *state = &stream_state[w][i];
+      if (count && state->traffic_class != SHAPER_CLASS_NONE && state->interface_id < SHAPER_NUM_INTERFACES)
+        idle_slope[state->interface_id][state->traffic_class] += stream_idle_slope(state, oversubscribed);
+    }
+
+    // Ready for the epoch after next
+    memset(streams, 0, sizeof(*streams));
+  }
+
+  // The shapers were modelled in the last window with the idleSlope of the
+  // streams in the window before, and now take that of the streams in the last
+  shaper_send_records(AVB_TESTER_PROBE_SHAPER, shaper_windows[last]);
+  memset(shaper_windows[last], 0, sizeof(shaper_windows[last]));
+  for (unsigned int i = 0; i < SHAPER_NUM_INTERFACES; i++) {
+    for (unsigned int c = 0; c < SHAPER_NUM_CLASSES; c++)
+      shaper_set_idle_slope(i, c, idle_slope[i][c]);
+  }
+
+  gptp_send_records(AVB_TESTER_PROBE_GPTP_PORT, AVB_TESTER_PROBE_GPTP_RESIDENCE, &gptp_windows[last]);
+  memset(&gptp_windows[last], 0, sizeof(gptp_windows[last]));
+
+  for (unsigned int i = 0; i < PCAPNG_NUM_INTERFACES; i++) {
+    drop_count[i] = 0;
+
+    // The receiver drops are a running count, and the blocks may be seen out
+    // of order when some are handled by the control core
+    unsigned int drops = receiver_drops[i];
+    if ((int)(drops - receiver_drops_reported[i]) > 0) {
+      drop_count[i] = drops - receiver_drops_reported[i];
+      receiver_drops_reported[i] = drops;
+    }
+  }
+
+  for (unsigned int w = 0; w < NUM_WRITERS; w++) {
+    counts_bank_t *bank = &writers[w].bank[last];
+
+    for (unsigned int i = 0; i < PCAPNG_NUM_INTERFACES; i++)
+      drop_count[i] += bank->drop_count[i];
+
+    untracked_count += bank->untracked_count;
+    cost_frames += bank->cost_frames;
+    cost_ticks += bank->cost_ticks;
+    if (bank->cost_max_ticks > cost_max_ticks)
+      cost_max_ticks = bank->cost_max_ticks;
+
+    // Ready for the epoch after next
+    memset(bank, 0, sizeof(*bank));
+  }
+
+  int num_active = 0;
+  // Second pass to do the checking and printing
+  for (unsigned int w = 0; w < ANALYSIS_WORKERS; w++) {
+    for (unsigned int i = 0; i < MAX_NUM_STREAMS; i++) {
+      num_active += check_stream(&stream_report[w][i], stream_state[w][i].packet_num_bytes,
+          stream_state[w][i].traffic_class, oversubscribed, debug);
     }
   }
 
   if (debug && num_active == 0)
     debug_printf("No active streams found\n");
+
+  for (unsigned int i = 0; i < PCAPNG_NUM_INTERFACES; i++) {
+    if (drop_count[i])
+      debug_printf("ERROR: %d frames dropped on interface %d in the last second\n", drop_count[i], i);
+  }
+
+  if (untracked_count) {
+    debug_printf("ERROR: %d packets of streams beyond the %d per analyser core not checked in the last second\n",
+        untracked_count, MAX_NUM_STREAMS);
+  }
+
+  if (cost_frames) {
+    debug_printf("Analysis: %d frames, mean %d max %d ticks per frame\n", cost_frames,
+        (unsigned int)(cost_ticks / cost_frames), cost_max_ticks);
+  }
+}
+
+static unsigned int stream_bucket(const stream_id_t *id)
+{
+  // Stream IDs mostly differ in the low word, the end of the MAC address of the
+  // talker and its unique ID, so the high bits of the product are folded down
+  uint32_t hash = ((id->high * 0x9e3779b1u) ^ id->low) * 0x85ebca6bu;
+  hash ^= hash >> 16;
+  return hash & (STREAM_BUCKETS - 1);
 }
 
-static void increment_count(const stream_id_t *id, unsigned int packet_num_bytes,
+/*
+ * Empty a bucket. The buckets after it in the same run are moved back to fill
+ * the gap unless that would put them before the bucket their stream hashes to.
+ */
+static void remove_bucket(stream_table_t *table, unsigned int worker, unsigned int gap)
+{
+  unsigned int next = gap;
+
+  while (1) {
+    next = (next + 1) & (STREAM_BUCKETS - 1);
+    unsigned int entry = table->bucket[next];
+    if (!entry)
+      break;
+
+    unsigned int home = stream_bucket(&stream_state[worker][entry - 1].id);
+    // Leave the stream where it is if its home is cyclically in (gap, next]
+    if (((next - home) & (STREAM_BUCKETS - 1)) < ((next - gap) & (STREAM_BUCKETS - 1)))
+      continue;
+
+    table->bucket[gap] = entry;
+    gap = next;
+  }
+  table->bucket[gap] = 0;
+}
+
+/*
+ * Free the stream in the next bucket of the sweep if it has had no packets in
+ * this epoch or the last. check_counts() has then seen a window without packets
+ * and stopped following the entry, so it can be reused. Checking one bucket per
+ * packet frees the idle streams without scanning the whole table, which is
+ * only done when a new stream finds the table full.
+ */
+static void sweep_idle(stream_table_t *table, unsigned int worker, unsigned current_epoch)
+{
+  unsigned int b = table->sweep;
+  unsigned int entry = table->bucket[b];
+
+  table->sweep = (b + 1) & (STREAM_BUCKETS - 1);
+  if (entry && (current_epoch - stream_state[worker][entry - 1].last_epoch) > 1) {
+    remove_bucket(table, worker, b);
+    table->free_entry[table->num_free++] = entry - 1;
+  }
+}
+
+static unsigned int jitter_bin(uint32_t interval, unsigned int nominal_ticks)
+{
+  int deviation = (int)interval - (int)nominal_ticks;
+  unsigned int magnitude = (deviation < 0 ? -deviation : deviation) / JITTER_BIN_TICKS;
+  unsigned int octave = 0;
+
+  while (magnitude && octave < JITTER_CENTRE_BIN) {
+    magnitude >>= 1;
+    octave++;
+  }
+  return (deviation < 0) ? (JITTER_CENTRE_BIN - octave) : (JITTER_CENTRE_BIN + octave);
+}
+
+static void record_interval(stream_jitter_t *jitter, uint32_t interval, shaper_class_t traffic_class)
+{
+  uint16_t nominal_ticks = (traffic_class == SHAPER_CLASS_B) ? JITTER_NOMINAL_TICKS_B : JITTER_NOMINAL_TICKS_A;
+  uint16_t ticks = (interval > 0xffff) ? 0xffff : interval;
+  uint16_t *bin = &jitter->bins[jitter_bin(interval, nominal_ticks)];
+
+  jitter->nominal_ticks = nominal_ticks;
+  if (jitter->intervals++ == 0) {
+    jitter->min_ticks = ticks;
+    jitter->max_ticks = ticks;
+  } else if (ticks < jitter->min_ticks) {
+    jitter->min_ticks = ticks;
+  } else if (ticks > jitter->max_ticks) {
+    jitter->max_ticks = ticks;
+  }
+  if (*bin != 0xffff)
+    (*bin)++;
+}
+
+static void saturating_increment(uint16_t *count)
+{
+  if (*count != 0xffff)
+    (*count)++;
+}
+
+static unsigned int gap_bin(unsigned int gap)
+{
+  unsigned int bin = 0;
+  for (gap -= 1; gap; gap >>= 1)
+    bin++;
+  return bin;
+}
+
+/*
+ * Check the sequence number of a packet against the packets of the stream seen
+ * before. The arithmetic is 8 bit so it wraps with the sequence numbers.
+ */
+static void check_sequence(stream_state_t *state, stream_sequence_t *sequence,
     unsigned char sequence_number)
 {
-  unsigned int free_index = MAX_NUM_STREAMS;
-  hwlock_acquire(lock);
-  for (unsigned int i = 0; i < MAX_NUM_STREAMS; i++) {
-    stream_state_t *state = &stream_state[i];
+  unsigned char ahead = sequence_number - state->sequence_number;
+
+  if (ahead < 128) {
+    // The next packet, or the next after a gap
+    if (ahead) {
+      sequence->lost += ahead;
+      saturating_increment(&sequence->gap_bins[gap_bin(ahead)]);
+    }
+    if (ahead + 1 < SEQUENCE_WINDOW)
+      state->sequence_window = (state->sequence_window << (ahead + 1)) | 1;
+    else
+      state->sequence_window = 1;
+    state->sequence_number = sequence_number + 1;
+    return;
+  }
+
+  // Behind the last packet, by 0 if it is the last again
+  unsigned int late = (unsigned char)(state->sequence_number - 1 - sequence_number);
+  if (late >= SEQUENCE_WINDOW) {
+    saturating_increment(&sequence->restarts);
+    state->sequence_window = 1;
+    state->sequence_number = sequence_number + 1;
+  } else if (state->sequence_window & (1u << late)) {
+    saturating_increment(&sequence->duplicates);
+  } else {
+    // Counted as lost when the later packets arrived, unless that was in the
+    // last window
+    saturating_increment(&sequence->reordered);
+    if (sequence->lost)
+      sequence->lost--;
+    state->sequence_window |= 1u << late;
+  }
+}
+
+static void increment_count(unsigned worker, const stream_id_t *id,
+    const enhanced_packet_block_t *epb, unsigned char sequence_number, shaper_class_t traffic_class)
+{
+  unsigned int packet_num_bytes = epb->packet_len;
+  uint32_t timestamp = epb->timestamp_low;
+  unsigned current_epoch;
+  xassert(worker < ANALYSIS_WORKERS);
+  stream_table_t *table = &stream_table[worker];
+  counts_bank_t *bank = counts_begin(worker, &current_epoch);
+  stream_bank_t *streams = &stream_banks[worker][current_epoch & 1];
+
+  sweep_idle(table, worker, current_epoch);
+
+  unsigned int b = stream_bucket(id);
+  unsigned int entry;
+  while ((entry = table->bucket[b]) != 0) {
+    stream_state_t *state = &stream_state[worker][entry - 1];
 
     if ((id->low  == state->id.low) &&
         (id->high == state->id.high)) {
-      state->count++;
+      // A stream which had stopped but hasn't been swept yet starts again
+      if ((current_epoch - state->last_epoch) > 1) {
+        state->packet_num_bytes = packet_num_bytes;
+        state->sequence_number = sequence_number;
+        state->sequence_window = 0;
+        state->interface_id = epb->interface_id;
+        state->traffic_class = traffic_class;
+        debug_printf("Adding stream 0x%x%x\n", state->id.high, state->id.low);
+      } else {
+        // The timestamps are 10ns ticks so the low word wraps every 42s
+        record_interval(&streams->jitter[entry - 1], timestamp - state->last_timestamp,
+            state->traffic_class);
+      }
+      streams->stream_count[entry - 1]++;
+      state->last_epoch = current_epoch;
+      state->last_timestamp = timestamp;
 
       if (state->packet_num_bytes != packet_num_bytes) {
         debug_printf("ERROR stream 0x%x%x packet size changed from %d to %d\n",
             state->id.high, state->id.low,
             state->packet_num_bytes, packet_num_bytes);
       }
-      if (state->sequence_number != sequence_number) {
-        debug_printf("ERROR stream 0x%x%x sequence expected %d got %d\n",
-            state->id.high, state->id.low,
-            state->sequence_number, sequence_number);
-      }
-      state->sequence_number = sequence_number + 1;
+      check_sequence(state, &streams->sequence[entry - 1], sequence_number);
       goto increment_count_done;
-
-    } else if ((state->id.low  == 0) &&
-               (state->id.high == 0)) {
-      free_index = i;
     }
+    b = (b + 1) & (STREAM_BUCKETS - 1);
   }
 
-  if (free_index != MAX_NUM_STREAMS) {
-    stream_state_t *state = &stream_state[free_index];
+  if (!table->num_free && table->full_sweep_epoch != current_epoch) {
+    // Free any idle streams the sweep hasn't reached yet, at most once an epoch
+    // so a table full of active streams doesn't cost a scan per packet
+    table->full_sweep_epoch = current_epoch;
+    for (unsigned int i = 0; i < STREAM_BUCKETS; i++)
+      sweep_idle(table, worker, current_epoch);
+
+    // Streams may have moved into the empty bucket that ended the search
+    b = stream_bucket(id);
+    while (table->bucket[b])
+      b = (b + 1) & (STREAM_BUCKETS - 1);
+  }
+
+  if (table->num_free) {
+    // The empty bucket that ended the search
+    entry = table->free_entry[--table->num_free];
+    table->bucket[b] = entry + 1;
+
+    stream_state_t *state = &stream_state[worker][entry];
     state->id.low  = id->low;
     state->id.high = id->high;
-    state->count = 1;
-    state->snapshot = 0;
+    state->last_epoch = current_epoch;
     state->packet_num_bytes = packet_num_bytes;
+    state->last_timestamp = timestamp;
     state->sequence_number = sequence_number + 1;
+    state->sequence_window = 1;
+    state->interface_id = epb->interface_id;
+    state->traffic_class = traffic_class;
+    streams->stream_count[entry] = 1;
     debug_printf("Adding stream 0x%x%x\n", state->id.high, state->id.low);
   } else {
-    assert(0); // Can't track this stream - no free slots available
+    // Every entry has a stream, they are reported as not checked
+    bank->untracked_count++;
   }
 increment_count_done:
-  hwlock_release(lock);
+  counts_end(worker);
 }
-
@@ -17,13 +17,35 @@ extern "C" {
  */
 void analyse_init();
 
+/**
+ * \brief   The analyser core that a packet buffer is given to. Frames between
+ *          the same MAC addresses always go to the same one.
+ * \param   buffer            Pointer to the packet buffer.
+ */
+unsigned analyse_worker(const unsigned char *buffer);
+
 /**
  * \brief   Analyse a packet buffer. Determine if it is AVB audio data, and
  *          if it is then increment the count for that stream.
  * \param   buffer            Pointer to the packet buffer.
- * \param   length_in_bytes   Number of bytes in the buffer.
+ * \param   worker            The analyser core, from analyse_worker().
+ */
+void analyse_buffer(const unsigned char *buffer, unsigned worker);
+
+/**
+ * \brief   Model the credit-based shapers with a packet buffer (see shaper.h).
+ *          Must be called from the control core for every packet buffer, in
+ *          the order they are received, before it is given to an analyser.
+ * \param   buffer            Pointer to the packet buffer.
  */
-void analyse_buffer(const unsigned char *buffer, const unsigned int length_in_bytes);
+void analyse_shaper(const unsigned char *buffer);
+
+/**
+ * \brief   Record that a packet buffer had to be dropped because the analysis
+ *          tile ran out of buffers.
+ * \param   buffer            Pointer to the packet buffer.
+ */
+void analyse_dropped(const unsigned char *buffer);
 
 /**
  * \var     typedef steam_id_t
@@ -36,21 +58,95 @@ typedef struct {
 
 /**
  * \var     typedef stream_state_t
- * \brief   State that is tracked for each active stream.
+ * \brief   State that is tracked for each active stream by the analyser core
+ *          its frames go to. The packet counts are kept separately for each
+ *          window.
  */
 typedef struct {
   stream_id_t id;                 // Stream ID. A valid stream is non-zero
-  int active;                     // Determines whether the stream should be checked
   unsigned int packet_num_bytes;  // Used to detect invalid packets and determine
                                   // valid packet rate when stream is oversubscribed
-  unsigned int count;             // Packet count in the current window
-  unsigned int last_count;        // Packet count in the last window
-  unsigned int snapshot;          // Used to record a snapshot of the packet count
-                                  // for checking
-  unsigned char sequence_number;  // Record the sequence number of packets to check
-                                  // none go missing
+  unsigned int last_epoch;        // The window of the last packet, the entry is
+                                  // free once a whole window has no packets
+  uint32_t last_timestamp;        // Low word of the timestamp of the last packet
+  uint8_t interface_id;           // Where the stream was seen
+  uint8_t traffic_class;          // The SR class of the stream (see shaper.h)
+  unsigned char sequence_number;  // The sequence number expected next
+  uint32_t sequence_window;       // Bit i set if sequence_number - 1 - i was seen
 } stream_state_t;
 
+/*
+ * A packet up to SEQUENCE_WINDOW sequence numbers behind the last is checked
+ * against the ones seen and counted as a duplicate or as reordered (a packet
+ * counted as lost arriving late). Further behind, the stream is taken to have
+ * restarted. The sequence numbers are 8 bits, so a gap of 128 or more can't be
+ * told from a packet arriving late.
+ */
+#define SEQUENCE_WINDOW   32
+
+/*
+ * Bin 0 counts the gaps of one lost packet and bin i > 0 the gaps of
+ * [2^(i-1) + 1, 2^i] packets, up to 127.
+ */
+#define SEQUENCE_GAP_BINS 8
+
+/**
+ * \var     typedef stream_sequence_record_t
+ * \brief   The packets of a stream that were lost, duplicated or reordered in
+ *          the last window, sent to the host when there were any.
+ */
+typedef struct {
+  uint32_t id_high;
+  uint32_t id_low;
+  uint32_t lost;                  // Less those that arrived late in the window
+  uint32_t duplicates;
+  uint32_t reordered;             // Arrived late, after later packets
+  uint32_t restarts;              // Too far behind the last to be late
+  uint32_t gap_bins[SEQUENCE_GAP_BINS]; // Gaps in the sequence by their size
+} stream_sequence_record_t;
+
+/*
+ * The packets of a class A stream are expected every 125us and of a class B
+ * stream every 250us (in 10ns ticks). Streams of neither class are taken to be
+ * class A.
+ */
+#define JITTER_NOMINAL_TICKS_A 12500
+#define JITTER_NOMINAL_TICKS_B 25000
+
+/*
+ * The inter-arrival times of each stream are counted in bins of their deviation
+ * from the nominal interval of its class. Bin JITTER_CENTRE_BIN counts the intervals within
+ * 1us, bin JITTER_CENTRE_BIN + k those late by [2^(k-1), 2^k) us and bin
+ * JITTER_CENTRE_BIN - k those early by the same. The first and last bins also
+ * count everything beyond.
+ */
+#define JITTER_BINS       13
+#define JITTER_CENTRE_BIN (JITTER_BINS / 2)
+#define JITTER_BIN_TICKS  100
+
+/**
+ * \var     typedef stream_jitter_record_t
+ * \brief   The inter-arrival times of the packets of a stream in the last
+ *          window, sent to the host. The minimum and maximum are in 10ns timer
+ *          ticks, and are at most 0xffff.
+ */
+typedef struct {
+  uint32_t id_high;
+  uint32_t id_low;
+  uint32_t intervals;             // Packets after the first of the stream
+  uint32_t nominal_ticks;         // The interval of the class of the stream
+  uint32_t min_ticks;
+  uint32_t max_ticks;
+  uint32_t bins[JITTER_BINS];     // At most 0xffff
+} stream_jitter_record_t;
+
+/**
+ * \brief   Record the time taken to analyse a frame.
+ * \param   ticks             Timer ticks taken by analyse_buffer().
+ * \param   worker            The analyser core that analysed it.
+ */
+void analyse_cost(unsigned ticks, unsigned worker);
+
 /**
  * \brief   Should be called once a second to validate the counts per stream.
  */
@@ -1,6 +1,54 @@
 #ifndef __AVB_TESTER_H__
 #define __AVB_TESTER_H__
 
+/*
+ * Time the analysis of each frame and print the mean and maximum every second,
+ * to check the analysis stays within the time available per frame at line
+ * rate.
+ */
+#ifndef ANALYSIS_MEASURE_COST
+#define ANALYSIS_MEASURE_COST 0
+#endif
+
+/*
+ * The number of analyser cores the frames are shared between, and the number
+ * of frames that can be queued for each. The frames between a pair of MAC
+ * addresses, so all the frames of a stream, always go to the same analyser so
+ * the sequence numbers are checked in order.
+ */
+#ifndef ANALYSIS_WORKERS
+#define ANALYSIS_WORKERS 2
+#endif
+#ifndef ANALYSIS_WORKER_SLOTS
+#define ANALYSIS_WORKER_SLOTS 2
+#endif
+
+/*
+ * The number of streams each analyser core can check, a power of two. A stream
+ * is found in a hash table so the time taken per frame doesn't grow with the
+ * number of streams. The table and the counts and inter-arrival times of the
+ * streams use about 190 bytes per stream on each analyser core. The packets of
+ * any further streams are counted as not checked.
+ */
+#ifndef MAX_NUM_STREAMS
+#define MAX_NUM_STREAMS 64
+#endif
+#if (MAX_NUM_STREAMS & (MAX_NUM_STREAMS - 1)) || MAX_NUM_STREAMS > 16384
+#error "MAX_NUM_STREAMS must be a power of two no more than 16384"
+#endif
+
+/*
+ * The xscope probes used to send data to the host
+ */
+enum {
+  AVB_TESTER_PROBE_PACKET_DATA = 0,
+  AVB_TESTER_PROBE_JITTER,          // stream_jitter_record_t (see analysis_utils.h)
+  AVB_TESTER_PROBE_SHAPER,          // shaper_record_t (see shaper.h)
+  AVB_TESTER_PROBE_SEQUENCE,        // stream_sequence_record_t (see analysis_utils.h)
+  AVB_TESTER_PROBE_GPTP_PORT,       // gptp_port_record_t (see gptp.h)
+  AVB_TESTER_PROBE_GPTP_RESIDENCE,  // gptp_residence_record_t (see gptp.h)
+};
+
 typedef enum {
   AVB_TESTER_EXPECT_NORMAL,
   AVB_TESTER_EXPECT_OVERSUBSCRIBED,
@@ -0,0 +1,345 @@
+/*
+ * The gPTP messages are matched up by what the tap can see of them. Only the
+ * first CAPTURE_BYTES of each frame are captured, which holds the header and
+ * the timestamps of the Sync and Follow_Up, but only the start of the
+ * requestingPortIdentity of a Pdelay_Resp, so a response is matched to the
+ * outstanding request with its sequenceId and as much of the identity as was
+ * captured.
+ *
+ * A Sync is matched across the interfaces by its preciseOriginTimestamp (from
+ * the Follow_Up of a two-step Sync), which each bridge passes on unchanged
+ * while adding its residence to the correctionField.
+ */
+#include <string.h>
+#include "gptp.h"
+#include "pcapng.h"
+#include "util.h"
+
+#define TICKS_PER_SECOND     100000000
+
+// The gPTP message follows the untagged Ethernet header
+#define GPTP_OFFSET          14
+
+#define GPTP_MESSAGE_SYNC            0x0
+#define GPTP_MESSAGE_PDELAY_REQ      0x2
+#define GPTP_MESSAGE_PDELAY_RESP     0x3
+#define GPTP_MESSAGE_FOLLOW_UP       0x8
+#define GPTP_MESSAGE_ANNOUNCE        0xb
+
+// Offsets in the message
+#define GPTP_FLAGS                   6
+#define GPTP_CORRECTION              8
+#define GPTP_SOURCE_PORT_IDENTITY    20
+#define GPTP_SEQUENCE_ID             30
+#define GPTP_LOG_MESSAGE_INTERVAL    33
+#define GPTP_ORIGIN_TIMESTAMP        34
+#define GPTP_REQUESTING_PORT_IDENTITY 44
+#define GPTP_GRANDMASTER_IDENTITY    53
+
+#define GPTP_FLAG_TWO_STEP           0x02
+
+#define GPTP_HEADER_BYTES            34
+#define GPTP_TIMESTAMP_BYTES         10
+
+typedef struct {
+  uint64_t seconds;
+  uint32_t nanoseconds;
+} origin_timestamp_t;
+
+typedef struct {
+  int used;
+  unsigned interface_id;
+  uint8_t clock_identity[8];
+  uint16_t port_number;
+  uint8_t grandmaster_identity[8];
+  uint64_t last_seen;
+  int have_sync;
+  uint64_t last_sync_time;
+  int follow_up_pending;        // Waiting for the Follow_Up of a two-step Sync
+  uint16_t sync_sequence_id;
+  int pdelay_pending;           // Waiting for the Pdelay_Resp
+  uint16_t pdelay_sequence_id;
+  uint64_t pdelay_time;
+} port_state_t;
+
+/*
+ * The last Sync seen on an interface, with the timestamp and correction of its
+ * Follow_Up when it is two-step.
+ */
+typedef struct {
+  int valid;
+  uint64_t time;
+  origin_timestamp_t origin;
+  int64_t correction;
+} sync_event_t;
+
+// Only used by the core calling gptp_analyse()
+static port_state_t ports[GPTP_MAX_PORTS];
+static sync_event_t last_sync[GPTP_NUM_INTERFACES];
+
+void gptp_init()
+{
+  memset(ports, 0, sizeof(ports));
+  memset(last_sync, 0, sizeof(last_sync));
+}
+
+static uint16_t read16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static uint64_t read_bytes(const uint8_t *p, unsigned n)
+{
+  uint64_t value = 0;
+  for (unsigned i = 0; i < n; i++)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+static void read_origin_timestamp(const uint8_t *p, origin_timestamp_t *origin)
+{
+  origin->seconds = read_bytes(p, 6);
+  origin->nanoseconds = (uint32_t)read_bytes(p + 6, 4);
+}
+
+/*
+ * The state and window of the port that sent a message, replacing the port
+ * seen least recently when it is new and all are in use.
+ */
+static unsigned find_port(unsigned interface_id, const uint8_t *identity, uint64_t now,
+    gptp_window_t *window)
+{
+  uint16_t port_number = read16(identity + 8);
+  unsigned oldest = 0;
+
+  for (unsigned i = 0; i < GPTP_MAX_PORTS; i++) {
+    port_state_t *port = &ports[i];
+    if (port->used && port->interface_id == interface_id && port->port_number == port_number &&
+        memcmp(port->clock_identity, identity, 8) == 0) {
+      port->last_seen = now;
+      return i;
+    }
+    if (!port->used || (ports[oldest].used && port->last_seen < ports[oldest].last_seen))
+      oldest = i;
+  }
+
+  port_state_t *port = &ports[oldest];
+  memset(port, 0, sizeof(*port));
+  port->used = 1;
+  port->interface_id = interface_id;
+  memcpy(port->clock_identity, identity, 8);
+  port->port_number = port_number;
+  port->last_seen = now;
+
+  // Anything in the window was from the port replaced
+  memset(&window->ports[oldest], 0, sizeof(window->ports[oldest]));
+  return oldest;
+}
+
+static uint32_t nominal_interval(int8_t log_interval)
+{
+  if (log_interval < -7 || log_interval > 4)
+    return 0;
+  if (log_interval < 0)
+    return TICKS_PER_SECOND >> -log_interval;
+  return TICKS_PER_SECOND << log_interval;
+}
+
+static void record_sync(port_state_t *port, gptp_port_record_t *record, uint64_t now,
+    int8_t log_interval)
+{
+  record->syncs++;
+  record->nominal_interval_ticks = nominal_interval(log_interval);
+
+  if (port->have_sync && now - port->last_sync_time <= 0xffffffff) {
+    uint32_t interval = (uint32_t)(now - port->last_sync_time);
+    if (!record->intervals || interval < record->min_interval_ticks)
+      record->min_interval_ticks = interval;
+    if (interval > record->max_interval_ticks)
+      record->max_interval_ticks = interval;
+    record->intervals++;
+    record->total_interval_ticks += interval;
+
+    if (record->nominal_interval_ticks) {
+      uint32_t jitter = (interval > record->nominal_interval_ticks) ?
+          interval - record->nominal_interval_ticks : record->nominal_interval_ticks - interval;
+      if (jitter > record->max_jitter_ticks)
+        record->max_jitter_ticks = jitter;
+    }
+  }
+  port->have_sync = 1;
+  port->last_sync_time = now;
+}
+
+/*
+ * A Sync with its origin timestamp and correction. If the same Sync was last
+ * seen on another interface the time between them is its residence.
+ */
+static void record_sync_event(gptp_window_t *window, unsigned interface_id, uint64_t time,
+    const origin_timestamp_t *origin, int64_t correction)
+{
+  for (unsigned i = 0; i < GPTP_NUM_INTERFACES; i++) {
+    const sync_event_t *ingress = &last_sync[i];
+    if (i == interface_id || !ingress->valid || ingress->origin.seconds != origin->seconds ||
+        ingress->origin.nanoseconds != origin->nanoseconds || time - ingress->time > TICKS_PER_SECOND)
+      continue;
+
+    gptp_residence_record_t *record = &window->residence[i][interface_id];
+    uint32_t residence = (uint32_t)(time - ingress->time);
+    int64_t error = ((correction - ingress->correction) >> 16) - (int64_t)residence * 10;
+    int32_t error_ns = (error > INT32_MAX) ? INT32_MAX : (error < INT32_MIN) ? INT32_MIN : (int32_t)error;
+
+    if (!record->syncs || residence < record->min_residence_ticks)
+      record->min_residence_ticks = residence;
+    if (residence > record->max_residence_ticks)
+      record->max_residence_ticks = residence;
+    if (!record->syncs || error_ns < record->min_error_ns)
+      record->min_error_ns = error_ns;
+    if (!record->syncs || error_ns > record->max_error_ns)
+      record->max_error_ns = error_ns;
+    record->syncs++;
+    record->total_residence_ticks += residence;
+  }
+
+  sync_event_t *event = &last_sync[interface_id];
+  event->valid = 1;
+  event->time = time;
+  event->origin = *origin;
+  event->correction = correction;
+}
+
+static void record_pdelay_response(gptp_window_t *window, const uint8_t *message,
+    unsigned message_len, uint64_t now)
+{
+  const uint8_t *requester = message + GPTP_REQUESTING_PORT_IDENTITY;
+  uint16_t sequence_id = read16(message + GPTP_SEQUENCE_ID);
+  unsigned identity_len = 0;
+
+  if (message_len > GPTP_REQUESTING_PORT_IDENTITY)
+    identity_len = message_len - GPTP_REQUESTING_PORT_IDENTITY;
+  if (identity_len > 10)
+    identity_len = 10;
+
+  for (unsigned i = 0; i < GPTP_MAX_PORTS; i++) {
+    port_state_t *port = &ports[i];
+    if (!port->used || !port->pdelay_pending || port->pdelay_sequence_id != sequence_id)
+      continue;
+    if (memcmp(port->clock_identity, requester, identity_len < 8 ? identity_len : 8) != 0)
+      continue;
+    if (identity_len == 10 && port->port_number != read16(requester + 8))
+      continue;
+
+    gptp_port_record_t *record = &window->ports[i];
+    uint32_t turnaround = (uint32_t)(now - port->pdelay_time);
+    if (!record->pdelay_responses || turnaround < record->min_turnaround_ticks)
+      record->min_turnaround_ticks = turnaround;
+    if (turnaround > record->max_turnaround_ticks)
+      record->max_turnaround_ticks = turnaround;
+    record->pdelay_responses++;
+    record->total_turnaround_ticks += turnaround;
+    port->pdelay_pending = 0;
+    return;
+  }
+}
+
+void gptp_analyse(const unsigned char *buffer, gptp_window_t *window)
+{
+  const enhanced_packet_block_t *epb = (const enhanced_packet_block_t *)buffer;
+  const uint8_t *data = (const uint8_t *)&epb->data;
+  unsigned interface_id = epb->interface_id;
+
+  if (epb->block_type != PCAPNG_BLOCK_ENHANCED_PACKET || interface_id >= GPTP_NUM_INTERFACES ||
+      epb->captured_len < GPTP_OFFSET + GPTP_HEADER_BYTES)
+    return;
+
+  const uint8_t *message = data + GPTP_OFFSET;
+  unsigned message_len = epb->captured_len - GPTP_OFFSET;
+  unsigned message_type = message[0] & 0xf;
+  uint64_t now = ((uint64_t)epb->timestamp_high << 32) | epb->timestamp_low;
+
+  if (message_type == GPTP_MESSAGE_PDELAY_RESP) {
+    // Sent by the responder, so counted with the port that sent the request
+    record_pdelay_response(window, message, message_len, now);
+    return;
+  }
+
+  unsigned p = find_port(interface_id, message + GPTP_SOURCE_PORT_IDENTITY, now, window);
+  port_state_t *port = &ports[p];
+  gptp_port_record_t *record = &window->ports[p];
+  uint16_t sequence_id = read16(message + GPTP_SEQUENCE_ID);
+  int has_timestamp = message_len >= GPTP_ORIGIN_TIMESTAMP + GPTP_TIMESTAMP_BYTES;
+  origin_timestamp_t origin;
+
+  record->interface_id = interface_id;
+  memcpy(record->clock_identity, port->clock_identity, 8);
+  record->port_number = port->port_number;
+  record->frames++;
+
+  switch (message_type) {
+    case GPTP_MESSAGE_SYNC:
+      if (port->follow_up_pending)
+        record->missing_follow_ups++;
+      record_sync(port, record, now, (int8_t)message[GPTP_LOG_MESSAGE_INTERVAL]);
+
+      if (message[GPTP_FLAGS] & GPTP_FLAG_TWO_STEP) {
+        port->follow_up_pending = 1;
+        port->sync_sequence_id = sequence_id;
+      } else {
+        port->follow_up_pending = 0;
+        if (has_timestamp) {
+          read_origin_timestamp(message + GPTP_ORIGIN_TIMESTAMP, &origin);
+          record_sync_event(window, interface_id, now, &origin,
+              (int64_t)read_bytes(message + GPTP_CORRECTION, 8));
+        }
+      }
+      break;
+
+    case GPTP_MESSAGE_FOLLOW_UP:
+      if (port->follow_up_pending && port->sync_sequence_id == sequence_id && has_timestamp) {
+        read_origin_timestamp(message + GPTP_ORIGIN_TIMESTAMP, &origin);
+        record_sync_event(window, interface_id, port->last_sync_time, &origin,
+            (int64_t)read_bytes(message + GPTP_CORRECTION, 8));
+      }
+      port->follow_up_pending = 0;
+      break;
+
+    case GPTP_MESSAGE_PDELAY_REQ:
+      record->pdelay_requests++;
+      if (port->pdelay_pending)
+        record->pdelay_lost++;
+      port->pdelay_pending = 1;
+      port->pdelay_sequence_id = sequence_id;
+      port->pdelay_time = now;
+      break;
+
+    case GPTP_MESSAGE_ANNOUNCE:
+      if (message_len >= GPTP_GRANDMASTER_IDENTITY + 8)
+        memcpy(port->grandmaster_identity, message + GPTP_GRANDMASTER_IDENTITY, 8);
+      break;
+
+    default:
+      break;
+  }
+  memcpy(record->grandmaster_identity, port->grandmaster_identity, 8);
+}
+
+void gptp_send_records(unsigned char port_probe, unsigned char residence_probe,
+    gptp_window_t *window)
+{
+  for (unsigned i = 0; i < GPTP_MAX_PORTS; i++) {
+    gptp_port_record_t *record = &window->ports[i];
+    if (record->frames)
+      xscope_bytes_c(port_probe, sizeof(*record), (unsigned char *)record);
+  }
+
+  for (unsigned i = 0; i < GPTP_NUM_INTERFACES; i++) {
+    for (unsigned j = 0; j < GPTP_NUM_INTERFACES; j++) {
+      gptp_residence_record_t *record = &window->residence[i][j];
+      if (!record->syncs)
+        continue;
+      record->ingress_interface_id = i;
+      record->egress_interface_id = j;
+      xscope_bytes_c(residence_probe, sizeof(*record), (unsigned char *)record);
+    }
+  }
+}
@@ -0,0 +1,114 @@
+/**
+ * \brief   A check of the gPTP (802.1AS) timing seen on the wire, from the
+ *          capture timestamps of the Sync, Follow_Up and Pdelay messages.
+ *
+ *          For each port sending gPTP messages the intervals between its
+ *          Syncs are compared with the interval it advertises, and the time
+ *          between each of its Pdelay_Reqs and the Pdelay_Resp is measured.
+ *          When the same Sync is seen on two interfaces, as it goes into and
+ *          out of a bridge, the time between them is compared with the
+ *          residence the bridge added to the correctionField.
+ */
+
+#ifndef __GPTP_H__
+#define __GPTP_H__
+
+#ifdef __XC__
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define GPTP_ETHERTYPE      0x88f7
+
+#define GPTP_NUM_INTERFACES 2
+
+/*
+ * The ports followed, across all the interfaces. When a new port is seen with
+ * all of them in use, the port seen least recently is replaced.
+ */
+#ifndef GPTP_MAX_PORTS
+#define GPTP_MAX_PORTS      8
+#endif
+
+/**
+ * \var     typedef gptp_port_record_t
+ * \brief   The Syncs and Pdelays of a port in the last window, sent to the
+ *          host when it sent any gPTP messages. The times are in 10ns timer
+ *          ticks.
+ */
+typedef struct gptp_port_record_t {
+  uint32_t interface_id;
+  uint8_t clock_identity[8];      // The sourcePortIdentity of the port
+  uint32_t port_number;
+  uint8_t grandmaster_identity[8]; // From the last Announce, 0 unless it was
+                                  // captured (CAPTURE_BYTES of 76 or more)
+  uint32_t frames;                // gPTP messages sent by the port
+  uint32_t syncs;
+  uint32_t missing_follow_ups;    // Two-step Syncs without a Follow_Up
+  uint32_t nominal_interval_ticks; // From the logMessageInterval of the Syncs
+  uint32_t intervals;
+  uint32_t min_interval_ticks;
+  uint32_t max_interval_ticks;
+  uint32_t total_interval_ticks;
+  uint32_t max_jitter_ticks;      // Largest difference from the nominal interval
+  uint32_t pdelay_requests;
+  uint32_t pdelay_responses;
+  uint32_t pdelay_lost;           // Requests without a response before the next
+  uint32_t min_turnaround_ticks;  // From the Pdelay_Req to the Pdelay_Resp
+  uint32_t max_turnaround_ticks;
+  uint32_t total_turnaround_ticks;
+} gptp_port_record_t;
+
+/**
+ * \var     typedef gptp_residence_record_t
+ * \brief   The Syncs seen going in on one interface and out on another in the
+ *          last window, sent to the host when there were any. The error is the
+ *          residence added to the correctionField less the residence seen on
+ *          the wire, so also has the delay of the link into the bridge.
+ */
+typedef struct gptp_residence_record_t {
+  uint32_t ingress_interface_id;
+  uint32_t egress_interface_id;
+  uint32_t syncs;
+  uint32_t min_residence_ticks;
+  uint32_t max_residence_ticks;
+  uint32_t total_residence_ticks;
+  int32_t min_error_ns;
+  int32_t max_error_ns;
+} gptp_residence_record_t;
+
+/**
+ * \var     typedef gptp_window_t
+ * \brief   What was seen of gPTP in a window.
+ */
+typedef struct {
+  gptp_port_record_t ports[GPTP_MAX_PORTS];
+  gptp_residence_record_t residence[GPTP_NUM_INTERFACES][GPTP_NUM_INTERFACES];
+} gptp_window_t;
+
+/**
+ * \brief   Initialise with no ports seen.
+ */
+void gptp_init();
+
+/**
+ * \brief   Analyse a captured gPTP frame. Must be called for every gPTP frame
+ *          in the order they are seen, from a single core.
+ * \param   buffer            Pointer to the Enhanced Packet Block.
+ * \param   window            The window the frame was seen in.
+ */
+void gptp_analyse(const unsigned char *buffer, gptp_window_t *window);
+
+/**
+ * \brief   Send the ports that sent gPTP messages and the residence between
+ *          the interfaces seen in a window to the host.
+ */
+void gptp_send_records(unsigned char port_probe, unsigned char residence_probe,
+    gptp_window_t *window);
+
+#ifdef __XC__
+}
+#endif
+
+#endif // __GPTP_H__
@@ -14,8 +14,31 @@
 #define CLK_DELAY_RECEIVE    0
 
 /*
- * Define the number of buffers available
+ * Calibrated delay from the start of frame delimiter on the wire to it being
+ * sampled by each receiver, in 10ns timer ticks. Subtracted from the timestamps.
+ */
+#define PCAPNG_TIMESTAMP_OFFSET_0 0
+#define PCAPNG_TIMESTAMP_OFFSET_1 0
+
+/*
+ * Define the number of buffers available (split between the interfaces on the
+ * receiver tile)
  */
 #define BUFFER_COUNT 32
 
+/*
+ * Drop and count frames when the buffers run out instead of stopping
+ */
+#define PCAPNG_DROP_ON_OVERFLOW 1
+
+/*
+ * Batch the blocks sent between the tiles into transfers of up to
+ * INTER_TILE_BATCH_BYTES bytes and INTER_TILE_BATCH_MAX_BLOCKS blocks.
+ * Set INTER_TILE_BATCH_BYTES to 0 to send each block in its own transfer.
+ */
+#ifndef INTER_TILE_BATCH_BYTES
+#define INTER_TILE_BATCH_BYTES 1024
+#endif
+#define INTER_TILE_BATCH_MAX_BLOCKS 16
+
 #endif // __PCAPNG_CONF_H__
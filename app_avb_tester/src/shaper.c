@@ -0,0 +1,201 @@
+/*
+ * The credit-based shapers of the SR classes. The credit of a class rises at
+ * the idleSlope while the class has frames waiting, falls at the sendSlope
+ * (idleSlope - line rate) while they are sent, and a frame can only be sent
+ * with a credit of 0 or more. When the class has no frames waiting any positive
+ * credit is lost.
+ *
+ * The queues aren't seen, so the model keeps the most credit the class could
+ * have had. It can't have had a positive credit when the line was idle or a
+ * frame of a lower priority was started, as it would have been sent instead,
+ * so the credit is limited to 0 then. Between those points the class may have
+ * been waiting, so the credit rises at the idleSlope. Each frame of the class
+ * started with a negative credit is a violation, after which the model takes
+ * the credit the frame must have had (0) so one early frame isn't counted
+ * again for each frame after it.
+ *
+ * The interfaces run at 100Mb/s, so a bit takes one 10ns timer tick and the
+ * credit in bits is the idleSlope as a fraction of the line rate times the
+ * ticks.
+ */
+#include <string.h>
+#include "shaper.h"
+#include "pcapng.h"
+#include "util.h"
+
+#define TICKS_PER_SECOND     100000000
+
+// Preamble, SFD and inter-frame gap
+#define WIRE_OVERHEAD_BYTES  20
+
+#define ETHERTYPE_VLAN       0x8100
+
+// The credit is kept in bits and the idleSlope as a fraction of the line rate,
+// both shifted up by this much
+#define CREDIT_SHIFT         16
+
+// The timestamps are taken on the MII clock (40ns) so the time between two
+// frames may be off by two of its periods, and at a slope of at most 1 the
+// credit by as many bits
+#define TIMESTAMP_TOLERANCE_TICKS 8
+
+typedef struct {
+  int64_t credit;           // The most credit the class could have had at credit_time
+  uint32_t credit_time;
+  uint32_t clear_time;      // The last time the class can't have had a positive credit
+  uint32_t last_end;        // The end of the last frame of the class
+  uint32_t burst_bytes;     // Bytes of the class since clear_time
+} class_state_t;
+
+typedef struct {
+  uint32_t end_time;        // The earliest the next frame can start
+  class_state_t classes[SHAPER_NUM_CLASSES];
+} interface_state_t;
+
+// Only used by the core calling shaper_analyse()
+static interface_state_t state[SHAPER_NUM_INTERFACES];
+
+// The idleSlope of each class as a fraction of the line rate, set by the core
+// calling shaper_set_idle_slope() (single words)
+static volatile uint32_t idle_slope_fraction[SHAPER_NUM_INTERFACES][SHAPER_NUM_CLASSES];
+
+// Only used by the core calling shaper_set_idle_slope()
+static uint32_t idle_slope_bits[SHAPER_NUM_INTERFACES][SHAPER_NUM_CLASSES];
+
+void shaper_init()
+{
+  memset(state, 0, sizeof(state));
+  memset((void *)idle_slope_fraction, 0, sizeof(idle_slope_fraction));
+  memset(idle_slope_bits, 0, sizeof(idle_slope_bits));
+}
+
+shaper_class_t shaper_class(unsigned pcp)
+{
+  if (pcp == SHAPER_CLASS_A_PCP)
+    return SHAPER_CLASS_A;
+  if (pcp == SHAPER_CLASS_B_PCP)
+    return SHAPER_CLASS_B;
+  return SHAPER_CLASS_NONE;
+}
+
+void shaper_set_idle_slope(unsigned interface_id, shaper_class_t traffic_class,
+    unsigned bits_per_second)
+{
+  if (interface_id >= SHAPER_NUM_INTERFACES || traffic_class >= SHAPER_NUM_CLASSES)
+    return;
+
+  if (bits_per_second > TICKS_PER_SECOND)
+    bits_per_second = TICKS_PER_SECOND;
+  idle_slope_bits[interface_id][traffic_class] = bits_per_second;
+  idle_slope_fraction[interface_id][traffic_class] =
+      ((uint64_t)bits_per_second << CREDIT_SHIFT) / TICKS_PER_SECOND;
+}
+
+static void record_violation(shaper_window_t *window, const enhanced_packet_block_t *epb,
+    int32_t credit_bits)
+{
+  if (window->violations < SHAPER_MAX_VIOLATIONS) {
+    shaper_violation_t *violation = &window->violation[window->violations];
+    violation->timestamp_high = epb->timestamp_high;
+    violation->timestamp_low = epb->timestamp_low;
+    violation->credit_bits = credit_bits;
+  }
+  window->violations++;
+}
+
+void shaper_analyse(const unsigned char *buffer,
+    shaper_window_t windows[SHAPER_NUM_INTERFACES][SHAPER_NUM_CLASSES])
+{
+  const enhanced_packet_block_t *epb = (const enhanced_packet_block_t *)buffer;
+  const uint8_t *data = (const uint8_t *)&epb->data;
+  unsigned interface_id = epb->interface_id;
+  shaper_class_t frame_class = SHAPER_CLASS_NONE;
+
+  if (epb->block_type != PCAPNG_BLOCK_ENHANCED_PACKET || interface_id >= SHAPER_NUM_INTERFACES)
+    return;
+
+  if (epb->captured_len >= 16 && ((data[12] << 8) | data[13]) == ETHERTYPE_VLAN)
+    frame_class = shaper_class(data[14] >> 5);
+
+  interface_state_t *s = &state[interface_id];
+  uint32_t start = epb->timestamp_low;
+  uint32_t ticks = (epb->packet_len + WIRE_OVERHEAD_BYTES) * 8;
+  int idle = (int32_t)(start - s->end_time) > TIMESTAMP_TOLERANCE_TICKS;
+
+  for (unsigned c = 0; c < SHAPER_NUM_CLASSES; c++) {
+    class_state_t *k = &s->classes[c];
+    shaper_window_t *window = &windows[interface_id][c];
+    uint32_t slope = idle_slope_fraction[interface_id][c];
+    uint32_t elapsed = start - k->credit_time;
+    int64_t credit;
+
+    // A frame can start a little before the end of the last by the timestamps,
+    // and after a second without frames of the class any credit has been lost
+    if ((int32_t)elapsed < 0)
+      elapsed = 0;
+    if (!slope || elapsed > TICKS_PER_SECOND)
+      credit = 0;
+    else
+      credit = k->credit + (int64_t)slope * elapsed;
+
+    if (idle || frame_class > c) {
+      // The class wasn't sent so had nothing waiting or no credit
+      if (credit > 0)
+        credit = 0;
+      k->clear_time = start;
+      k->burst_bytes = 0;
+    }
+
+    if (frame_class == c) {
+      window->frames++;
+
+      if (slope) {
+        int32_t credit_bits = (int32_t)(credit >> CREDIT_SHIFT);
+        if (credit_bits < window->min_credit_bits)
+          window->min_credit_bits = credit_bits;
+        if (credit_bits < -TIMESTAMP_TOLERANCE_TICKS) {
+          record_violation(window, epb, credit_bits);
+          credit = 0;
+        }
+      }
+
+      // Waiting since the class was last sent or couldn't have been waiting
+      uint32_t waiting_since = ((int32_t)(k->clear_time - k->last_end) > 0) ? k->clear_time : k->last_end;
+      uint32_t interference = start - waiting_since;
+      if ((int32_t)interference > 0 && interference > window->max_interference_ticks)
+        window->max_interference_ticks = interference;
+
+      k->burst_bytes += epb->packet_len;
+      if (k->burst_bytes > window->max_burst_bytes)
+        window->max_burst_bytes = k->burst_bytes;
+
+      // Sent at the sendSlope
+      credit += ((int64_t)slope * ticks) - ((int64_t)ticks << CREDIT_SHIFT);
+      k->credit_time = start + ticks;
+      k->last_end = start + ticks;
+    } else {
+      k->credit_time = start;
+    }
+    // The credit of a class is only followed once it has an idleSlope
+    k->credit = slope ? credit : 0;
+  }
+  s->end_time = start + ticks;
+}
+
+void shaper_send_records(unsigned char probe,
+    shaper_window_t windows[SHAPER_NUM_INTERFACES][SHAPER_NUM_CLASSES])
+{
+  for (unsigned i = 0; i < SHAPER_NUM_INTERFACES; i++) {
+    for (unsigned c = 0; c < SHAPER_NUM_CLASSES; c++) {
+      if (!windows[i][c].frames && !idle_slope_bits[i][c])
+        continue;
+
+      shaper_record_t record;
+      record.interface_id = i;
+      record.traffic_class = c;
+      record.idle_slope = idle_slope_bits[i][c];
+      record.window = windows[i][c];
+      xscope_bytes_c(probe, sizeof(record), (unsigned char *)&record);
+    }
+  }
+}
@@ -0,0 +1,118 @@
+/**
+ * \brief   A check of the credit-based shapers (802.1Qav) of the SR classes
+ *          sending on each interface.
+ *
+ *          The credit of each class is modelled from the start times and
+ *          lengths of the frames on the wire with the idleSlope reserved by
+ *          the streams of the class. The queues of the shaper can't be seen,
+ *          so the model follows the most credit the class could have had and
+ *          a frame is a violation when even that is negative.
+ */
+
+#ifndef __SHAPER_H__
+#define __SHAPER_H__
+
+#ifdef __XC__
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define SHAPER_NUM_INTERFACES 2
+
+/*
+ * The SR classes, highest priority first, and the priorities (PCP) of their
+ * frames.
+ */
+typedef enum {
+  SHAPER_CLASS_A,
+  SHAPER_CLASS_B,
+  SHAPER_NUM_CLASSES,
+  SHAPER_CLASS_NONE = SHAPER_NUM_CLASSES,
+} shaper_class_t;
+
+#ifndef SHAPER_CLASS_A_PCP
+#define SHAPER_CLASS_A_PCP 3
+#endif
+#ifndef SHAPER_CLASS_B_PCP
+#define SHAPER_CLASS_B_PCP 2
+#endif
+
+/*
+ * The violations of each class on each interface reported with their
+ * timestamps each window. The rest are only counted.
+ */
+#define SHAPER_MAX_VIOLATIONS 4
+
+typedef struct {
+  uint32_t timestamp_high;      // The timestamp of the frame in the capture
+  uint32_t timestamp_low;
+  int32_t credit_bits;          // The most credit the class could have had
+} shaper_violation_t;
+
+/**
+ * \var     typedef shaper_window_t
+ * \brief   What was seen of a class on an interface in a window.
+ */
+typedef struct {
+  uint32_t frames;
+  uint32_t violations;
+  uint32_t max_burst_bytes;       // Bytes of the class sent while it could have
+                                  // kept its credit
+  uint32_t max_interference_ticks; // The longest a frame of the class could have
+                                  // waited behind other frames
+  int32_t min_credit_bits;        // The lowest credit at the start of a frame,
+                                  // 0 if it was never negative
+  shaper_violation_t violation[SHAPER_MAX_VIOLATIONS];
+} shaper_window_t;
+
+/**
+ * \var     typedef shaper_record_t
+ * \brief   A class on an interface in the last window, sent to the host.
+ */
+typedef struct shaper_record_t {
+  uint32_t interface_id;
+  uint32_t traffic_class;         // One of shaper_class_t
+  uint32_t idle_slope;            // Bits per second, 0 if no streams were seen
+  shaper_window_t window;
+} shaper_record_t;
+
+/**
+ * \brief   Initialise the shapers of all classes with no idleSlope.
+ */
+void shaper_init();
+
+/**
+ * \brief   The SR class of the frames with a priority.
+ */
+shaper_class_t shaper_class(unsigned pcp);
+
+/**
+ * \brief   Set the idleSlope of a class, from the streams of the class seen on
+ *          the interface. The frames of a class are only checked once it has
+ *          an idleSlope.
+ */
+void shaper_set_idle_slope(unsigned interface_id, shaper_class_t traffic_class,
+    unsigned bits_per_second);
+
+/**
+ * \brief   Model the shapers with a captured frame. Must be called for every
+ *          frame in the order they are seen, from a single core.
+ * \param   buffer            Pointer to the Enhanced Packet Block.
+ * \param   windows           The window of each class on each interface.
+ */
+void shaper_analyse(const unsigned char *buffer,
+    shaper_window_t windows[SHAPER_NUM_INTERFACES][SHAPER_NUM_CLASSES]);
+
+/**
+ * \brief   Send the window of each class that was seen on an interface to the
+ *          host.
+ */
+void shaper_send_records(unsigned char probe,
+    shaper_window_t windows[SHAPER_NUM_INTERFACES][SHAPER_NUM_CLASSES]);
+
+#ifdef __XC__
+}
+#endif
+
+#endif // __SHAPER_H__
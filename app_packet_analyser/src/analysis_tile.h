@@ -1,14 +1,18 @@
 #ifndef __ANALYSIS_TILE_H__
 #define __ANALYSIS_TILE_H__
 
+#include "packet_analyser.h"
+
 /**
  * \brief   A core that performs buffer management and manages the analysis tile.
+ *          Each buffer is queued for the analyser chosen by analyse_worker()
+ *          and up to ANALYSIS_WORKER_SLOTS are given to each analyser at once.
  *
  * \param   c_receiver_to_control     Channel for communication with receiver.
- * \param   c_control_to_analysis     Channel for communication with analyser.
+ * \param   c_control_to_analysis     Channels for communication with each analyser.
  */
 void analysis_control(streaming chanend c_receiver_to_control,
-                      streaming chanend c_control_to_analysis);
+                      streaming chanend c_control_to_analysis[ANALYSIS_WORKERS]);
 
 /**
  * \brief   A core that receives buffers from the other tile.
@@ -22,8 +26,9 @@ void buffer_receiver(chanend c_inter_tile, streaming chanend c_receiver_to_contr
  * \brief   A core that performs analysis of each packet buffer received.
  *
  * \param   c_control_to_analysis     Channel for communication with controller.
+ * \param   worker                    The index of this analyser.
  */
-void analyser(streaming chanend c_control_to_analysis);
+void analyser(streaming chanend c_control_to_analysis, unsigned worker);
 
 /**
  * \brief   A core that performs the checks on the stream packet rate once a 
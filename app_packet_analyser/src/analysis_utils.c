@@ -1,55 +1,376 @@
+#include <string.h>
 #include "debug_print.h"
 #include "analysis_utils.h"
 #include "pcapng.h"
 #include "xassert.h"
-#include "hwlock.h"
 #include "util.h"
+#include "latency.h"
+#include "talkers.h"
+#include "packet_analyser.h"
 
 #define NUM_INTERFACES 2
 
+/*
+ * The counts of each window are updated without a lock. Each core that counts
+ * frames owns two banks of counts and updates the bank of the current epoch.
+ * check_counts() starts the next epoch, waits for any update of the last bank
+ * that was already under way and then reads and clears that bank, so the
+ * cores counting frames never wait for it.
+ */
+typedef struct {
+  uint32_t byte_count;
+  uint32_t packet_count;
+  uint32_t drop_count;
+  uint32_t size_count[FRAME_SIZE_BINS];
+  uint32_t burst_bytes;            // The most bytes on the wire in a burst window
+} interface_counts_t;
+
+typedef struct {
+  interface_counts_t interfaces[NUM_INTERFACES];
+  uint32_t cost_frames;
+  uint32_t cost_max_ticks;
+  uint64_t cost_ticks;
+} counts_bank_t;
+
+typedef struct {
+  volatile unsigned sequence;      // Odd while a bank is being updated
+  counts_bank_t bank[2];
+} counts_writer_t;
+
+// Each analyser core (analyse_buffer() and analyse_cost()) then the control
+// core (analyse_dropped() and analyse_burst())
+#define WRITER_CONTROL ANALYSIS_WORKERS
+#define NUM_WRITERS    (ANALYSIS_WORKERS + 1)
+
+// The xCORE makes the memory accesses of a core in program order, so only the
+// compiler has to be stopped from moving the updates outside of the sequence
+#define COUNTS_BARRIER() asm volatile("" ::: "memory")
+
+static volatile unsigned epoch;
+static counts_writer_t writers[NUM_WRITERS];
+
+// The latency and top talkers of each analyser core, in the same banks
+static latency_window_t latency_windows[2][ANALYSIS_WORKERS];
+static talkers_window_t talkers_windows[2][ANALYSIS_WORKERS];
+
+// Only used by the core calling check_counts()
 interface_state_t interface_state[NUM_INTERFACES];
-hwlock_t lock;
+
+/*
+ * The bytes on the wire in a window that slides over the frame timestamps by a
+ * quarter of its length. The window is the sum of BURST_SLOTS slots, the last
+ * of which is the slot of the latest frame.
+ */
+#define BURST_SLOTS 4
+
+typedef struct {
+  uint32_t slot_ticks;
+  uint64_t slot_start;             // Timestamp of the start of the latest slot
+  unsigned slot;
+  uint32_t slot_bytes[BURST_SLOTS];
+  uint32_t window_bytes;
+} burst_state_t;
+
+// Preamble, start of frame delimiter and inter-frame gap
+#define WIRE_OVERHEAD_BYTES (8 + (96/8))
+
+// Only used by the control core
+static burst_state_t burst_state[NUM_INTERFACES];
+
+// Set from the host, in 10ns ticks
+static volatile uint32_t burst_window_ticks = BURST_WINDOW_DEFAULT_US * 100;
+
+// The drop count of the receiver tile from the last Interface Statistics Block
+// of each interface, and the part of it already reported
+static volatile uint32_t receiver_drops[NUM_INTERFACES];
+static uint32_t receiver_drops_reported[NUM_INTERFACES];
 
 void analyse_init()
 {
-  // Allocate the hardware lock that will be used to guard access to shared state
-  lock = hwlock_alloc();
+  memset(writers, 0, sizeof(writers));
+  memset(latency_windows, 0, sizeof(latency_windows));
+  memset(talkers_windows, 0, sizeof(talkers_windows));
+  epoch = 0;
 
   for (unsigned int i = 0; i < NUM_INTERFACES; i++)
     interface_state[i].interface_id = i;
+
+  latency_init();
+  talkers_init();
+}
+
+static counts_bank_t *counts_begin(unsigned writer_id, unsigned *current_epoch)
+{
+  counts_writer_t *writer = &writers[writer_id];
+  writer->sequence++;
+  COUNTS_BARRIER();
+  *current_epoch = epoch;
+  return &writer->bank[*current_epoch & 1];
+}
+
+static void counts_end(unsigned writer_id)
+{
+  COUNTS_BARRIER();
+  writers[writer_id].sequence++;
+}
+
+/*
+ * Start the next epoch and return when no core is still updating a bank of the
+ * last one. A core that was part way through an update when the epoch changed
+ * may have been updating either bank, so wait for it to finish.
+ */
+static unsigned counts_next_epoch()
+{
+  unsigned last_epoch = epoch;
+
+  epoch = last_epoch + 1;
+  COUNTS_BARRIER();
+  for (unsigned int i = 0; i < NUM_WRITERS; i++) {
+    unsigned sequence = writers[i].sequence;
+    if (sequence & 1) {
+      while (writers[i].sequence == sequence)
+        ;
+    }
+  }
+  COUNTS_BARRIER();
+  return last_epoch & 1;
 }
 
-void analyse_buffer(const unsigned char *buffer)
+static frame_size_bin_t frame_size_bin(unsigned packet_len)
+{
+  if (packet_len < 64)
+    return FRAME_SIZE_RUNT;
+  if (packet_len == 64)
+    return FRAME_SIZE_64;
+  if (packet_len < 128)
+    return FRAME_SIZE_65_127;
+  if (packet_len < 256)
+    return FRAME_SIZE_128_255;
+  if (packet_len < 512)
+    return FRAME_SIZE_256_511;
+  if (packet_len < 1024)
+    return FRAME_SIZE_512_1023;
+  if (packet_len <= 1518)
+    return FRAME_SIZE_1024_1518;
+  return FRAME_SIZE_OVERSIZE;
+}
+
+static void record_receiver_drops(const interface_statistics_block_t *isb)
+{
+  int interface_id = isb->interface_id;
+
+  xassert(interface_id < NUM_INTERFACES);
+  // A single word so it is never seen part written
+  receiver_drops[interface_id] = isb->isb_ifdrop_low;
+}
+
+void analyse_dropped(const unsigned char *buffer)
 {
   enhanced_packet_block_t *epb = (enhanced_packet_block_t *)buffer;
 
+  if (epb->block_type == PCAPNG_BLOCK_INTERFACE_STATISTICS) {
+    // The statistics are still valid even if the buffer can't be queued
+    record_receiver_drops((const interface_statistics_block_t *)buffer);
+    return;
+  }
+
   int interface_id = epb->interface_id;
 
   xassert(interface_id < NUM_INTERFACES);
-  hwlock_acquire(lock);
-  interface_state[interface_id].packet_count += 1;
-  interface_state[interface_id].byte_count += epb->packet_len;
-  hwlock_release(lock);
+  unsigned current_epoch;
+  counts_bank_t *bank = counts_begin(WRITER_CONTROL, &current_epoch);
+  bank->interfaces[interface_id].drop_count += 1;
+  counts_end(WRITER_CONTROL);
+}
+
+unsigned analyse_worker(const unsigned char *buffer)
+{
+  const enhanced_packet_block_t *epb = (const enhanced_packet_block_t *)buffer;
+
+  if (ANALYSIS_WORKERS == 1 || epb->block_type == PCAPNG_BLOCK_INTERFACE_STATISTICS)
+    return 0;
+
+  // A runt without both MAC addresses has nothing to share it by, and the
+  // rest of the buffer is left over from an earlier frame
+  if (epb->captured_len < 12)
+    return 0;
+
+  // The MAC addresses are the first three words of the frame. The high bits of
+  // the product depend on all the bits of the addresses.
+  const uint32_t *words = (const uint32_t *)&epb->data;
+  uint32_t hash = (words[0] ^ words[1] ^ words[2]) * 0x9e3779b1u;
+  return (hash >> 24) % ANALYSIS_WORKERS;
+}
+
+void analyse_set_burst_window(unsigned window_us)
+{
+  if (window_us < BURST_WINDOW_MIN_US)
+    window_us = BURST_WINDOW_MIN_US;
+  if (window_us > BURST_WINDOW_MAX_US)
+    window_us = BURST_WINDOW_MAX_US;
+
+  // The control core starts the new window at its next frame
+  burst_window_ticks = window_us * 100;
+}
+
+void analyse_burst(const unsigned char *buffer)
+{
+  enhanced_packet_block_t *epb = (enhanced_packet_block_t *)buffer;
+
+  if (epb->block_type != PCAPNG_BLOCK_ENHANCED_PACKET || epb->interface_id >= NUM_INTERFACES)
+    return;
+
+  burst_state_t *burst = &burst_state[epb->interface_id];
+  uint64_t timestamp = ((uint64_t)epb->timestamp_high << 32) | epb->timestamp_low;
+  uint32_t slot_ticks = burst_window_ticks / BURST_SLOTS;
+
+  if (burst->slot_ticks != slot_ticks) {
+    memset(burst, 0, sizeof(*burst));
+    burst->slot_ticks = slot_ticks;
+    burst->slot_start = timestamp;
+  }
+
+  // Slide the window on to the slot of this frame
+  uint64_t elapsed = timestamp - burst->slot_start;
+  if (timestamp >= burst->slot_start && elapsed >= slot_ticks) {
+    if (elapsed >= (uint64_t)slot_ticks * BURST_SLOTS) {
+      memset(burst->slot_bytes, 0, sizeof(burst->slot_bytes));
+      burst->window_bytes = 0;
+      burst->slot_start = timestamp;
+    } else {
+      while (elapsed >= slot_ticks) {
+        burst->slot = (burst->slot + 1) % BURST_SLOTS;
+        burst->window_bytes -= burst->slot_bytes[burst->slot];
+        burst->slot_bytes[burst->slot] = 0;
+        burst->slot_start += slot_ticks;
+        elapsed -= slot_ticks;
+      }
+    }
+  }
+
+  uint32_t wire_bytes = epb->packet_len + WIRE_OVERHEAD_BYTES;
+  burst->slot_bytes[burst->slot] += wire_bytes;
+  burst->window_bytes += wire_bytes;
+
+  // The whole of a frame is counted in the slot it starts in, so a window
+  // ending part way through a frame can count more than it has time for. It
+  // is clamped to the bytes of the window at line rate (a bit per tick).
+  uint32_t window_bytes = burst->window_bytes;
+  uint32_t window_capacity = (slot_ticks * BURST_SLOTS) / 8;
+  if (window_bytes > window_capacity)
+    window_bytes = window_capacity;
+
+  unsigned current_epoch;
+  counts_bank_t *bank = counts_begin(WRITER_CONTROL, &current_epoch);
+  interface_counts_t *counts = &bank->interfaces[epb->interface_id];
+  if (window_bytes > counts->burst_bytes)
+    counts->burst_bytes = window_bytes;
+  counts_end(WRITER_CONTROL);
+}
+
+void analyse_buffer(const unsigned char *buffer, unsigned worker)
+{
+  enhanced_packet_block_t *epb = (enhanced_packet_block_t *)buffer;
+
+  if (epb->block_type == PCAPNG_BLOCK_INTERFACE_STATISTICS) {
+    record_receiver_drops((const interface_statistics_block_t *)buffer);
+    return;
+  }
+
+  int interface_id = epb->interface_id;
+  frame_size_bin_t size_bin = frame_size_bin(epb->packet_len);
+
+  xassert(interface_id < NUM_INTERFACES);
+  xassert(worker < ANALYSIS_WORKERS);
+  unsigned current_epoch;
+  counts_bank_t *bank = counts_begin(worker, &current_epoch);
+  interface_counts_t *counts = &bank->interfaces[interface_id];
+  counts->packet_count += 1;
+  counts->byte_count += epb->packet_len;
+  counts->size_count[size_bin] += 1;
+
+  latency_analyse(buffer, worker, &latency_windows[current_epoch & 1][worker]);
+  talkers_analyse(buffer, worker, &talkers_windows[current_epoch & 1][worker]);
+  counts_end(worker);
+}
+
+void analyse_cost(unsigned ticks, unsigned worker)
+{
+  unsigned current_epoch;
+  counts_bank_t *bank = counts_begin(worker, &current_epoch);
+  bank->cost_frames++;
+  bank->cost_ticks += ticks;
+  if (ticks > bank->cost_max_ticks)
+    bank->cost_max_ticks = ticks;
+  counts_end(worker);
 }
 
 void check_counts()
 {
-  // First pass to snapshot the current counts
-  hwlock_acquire(lock);
+  // First pass to take the counts of the last epoch
+  analysis_cost_t cost_snapshot;
+  uint64_t cost_ticks = 0;
+  unsigned last = counts_next_epoch();
+
+  memset(&cost_snapshot, 0, sizeof(cost_snapshot));
   for (unsigned int i = 0; i < NUM_INTERFACES; i++) {
-    interface_state[i].byte_snapshot = interface_state[i].byte_count;
-    interface_state[i].total_byte_count += interface_state[i].byte_count;
-    interface_state[i].byte_count = 0;
+    interface_state_t *state = &interface_state[i];
 
-    interface_state[i].packet_snapshot = interface_state[i].packet_count;
-    interface_state[i].total_packet_count += interface_state[i].packet_count;
-    interface_state[i].packet_count = 0;
+    state->byte_snapshot = 0;
+    state->packet_snapshot = 0;
+    state->drop_snapshot = 0;
+    state->burst_snapshot = 0;
+    state->burst_window_ticks = burst_window_ticks;
+    memset(state->size_snapshot, 0, sizeof(state->size_snapshot));
+
+    // The receiver drops are a running count, and the blocks may be seen out
+    // of order when some are handled by the control core
+    uint32_t drops = receiver_drops[i];
+    if ((int32_t)(drops - receiver_drops_reported[i]) > 0) {
+      state->drop_snapshot = drops - receiver_drops_reported[i];
+      receiver_drops_reported[i] = drops;
+    }
+  }
+
+  for (unsigned int w = 0; w < NUM_WRITERS; w++) {
+    counts_bank_t *bank = &writers[w].bank[last];
+
+    for (unsigned int i = 0; i < NUM_INTERFACES; i++) {
+      interface_state_t *state = &interface_state[i];
+      interface_counts_t *counts = &bank->interfaces[i];
+
+      state->byte_snapshot += counts->byte_count;
+      state->packet_snapshot += counts->packet_count;
+      state->drop_snapshot += counts->drop_count;
+      if (counts->burst_bytes > state->burst_snapshot)
+        state->burst_snapshot = counts->burst_bytes;
+      for (unsigned int j = 0; j < FRAME_SIZE_BINS; j++)
+        state->size_snapshot[j] += counts->size_count[j];
+    }
+
+    cost_snapshot.frames += bank->cost_frames;
+    cost_ticks += bank->cost_ticks;
+    if (bank->cost_max_ticks > cost_snapshot.max_ticks)
+      cost_snapshot.max_ticks = bank->cost_max_ticks;
+
+    // Ready for the epoch after next
+    memset(bank, 0, sizeof(*bank));
   }
-  hwlock_release(lock);
+  cost_snapshot.ticks_low = (uint32_t)cost_ticks;
+  cost_snapshot.ticks_high = (uint32_t)(cost_ticks >> 32);
 
   // Second pass to do the printing
   for (unsigned int i = 0; i < NUM_INTERFACES; i++) {
-    xscope_bytes_c(0, sizeof(interface_state[i]), (unsigned char *)&interface_state[i]);
+    interface_state[i].total_byte_count += interface_state[i].byte_snapshot;
+    interface_state[i].total_packet_count += interface_state[i].packet_snapshot;
+    xscope_bytes_c(PACKET_ANALYSER_PROBE_COUNTS, sizeof(interface_state[i]), (unsigned char *)&interface_state[i]);
   }
-}
 
+  latency_send_records(PACKET_ANALYSER_PROBE_LATENCY, latency_windows[last]);
+  memset(latency_windows[last], 0, sizeof(latency_windows[last]));
+  talkers_send_records(PACKET_ANALYSER_PROBE_TALKERS, talkers_windows[last]);
+  memset(talkers_windows[last], 0, sizeof(talkers_windows[last]));
+
+  if (cost_snapshot.frames)
+    xscope_bytes_c(PACKET_ANALYSER_PROBE_COST, sizeof(cost_snapshot), (unsigned char *)&cost_snapshot);
+}
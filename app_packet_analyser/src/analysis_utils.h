@@ -18,27 +18,99 @@ extern "C" {
 void analyse_init();
 
 /**
- * \brief   Analyse a packet buffer. Determine if it is AVB audio data, and
- *          if it is then increment the count for that stream.
+ * \brief   The analyser core that a packet buffer is given to. Frames between
+ *          the same MAC addresses always go to the same one, as do both
+ *          sightings of a frame forwarded by the device under test.
  * \param   buffer            Pointer to the packet buffer.
- * \param   length_in_bytes   Number of bytes in the buffer.
  */
-void analyse_buffer(const unsigned char *buffer);
+unsigned analyse_worker(const unsigned char *buffer);
+
+/**
+ * \brief   Track the bytes on the wire of a frame in the sliding burst window
+ *          of its interface, timed by the frame timestamps. Called by the
+ *          control core for every frame, including those that are dropped.
+ * \param   buffer            Pointer to the packet buffer.
+ */
+void analyse_burst(const unsigned char *buffer);
+
+/**
+ * \brief   Set the length of the burst window, between BURST_WINDOW_MIN_US and
+ *          BURST_WINDOW_MAX_US.
+ */
+void analyse_set_burst_window(unsigned window_us);
+
+/**
+ * \brief   Analyse a packet buffer and count it on its interface.
+ * \param   buffer            Pointer to the packet buffer.
+ * \param   worker            The analyser core, from analyse_worker().
+ */
+void analyse_buffer(const unsigned char *buffer, unsigned worker);
+
+/**
+ * \brief   Record that a packet buffer had to be dropped because the analysis
+ *          tile ran out of buffers.
+ * \param   buffer            Pointer to the packet buffer.
+ */
+void analyse_dropped(const unsigned char *buffer);
+
+/**
+ * \brief   The RMON (RFC 2819) frame size bins. The sizes include the FCS, so
+ *          a VLAN tagged frame of 1519-1522 bytes is counted as oversize.
+ */
+typedef enum {
+  FRAME_SIZE_RUNT,                 // < 64 bytes
+  FRAME_SIZE_64,
+  FRAME_SIZE_65_127,
+  FRAME_SIZE_128_255,
+  FRAME_SIZE_256_511,
+  FRAME_SIZE_512_1023,
+  FRAME_SIZE_1024_1518,
+  FRAME_SIZE_OVERSIZE,             // > 1518 bytes
+  FRAME_SIZE_BINS
+} frame_size_bin_t;
 
 /**
  * \var     typedef stream_state_t
- * \brief   State that is tracked for each interface
+ * \brief   State that is tracked for each interface, sent to the host at the
+ *          end of each window. The counts of the window being captured are
+ *          kept separately by each core that counts frames.
  */
 typedef struct {
   uint64_t total_byte_count;
   uint64_t total_packet_count;
   uint32_t interface_id;
-  uint32_t byte_count;             // Byte count in the current window
-  uint32_t byte_snapshot;
-  uint32_t packet_count;           // Packet count in the current window
-  uint32_t packet_snapshot;
+  uint32_t byte_snapshot;          // Byte count in the last window
+  uint32_t packet_snapshot;        // Packet count in the last window
+  uint32_t drop_snapshot;          // Frames dropped in the last window
+  uint32_t burst_snapshot;         // The most bytes on the wire, including the preamble
+                                   // and inter-frame gap, in a burst window in the last window
+  uint32_t burst_window_ticks;     // The length of the burst window
+  uint32_t size_snapshot[FRAME_SIZE_BINS]; // Frames of each size in the last window
 } interface_state_t;
 
+/**
+ * \var     typedef analysis_cost_t
+ * \brief   The time taken to analyse the frames in the last window, in 10ns
+ *          timer ticks (with ANALYSIS_MEASURE_COST)
+ */
+typedef struct {
+  uint32_t frames;
+  uint32_t ticks_low;
+  uint32_t ticks_high;
+  uint32_t max_ticks;
+} analysis_cost_t;
+
+/**
+ * \brief   Record the time taken to analyse a frame.
+ * \param   ticks             Timer ticks taken by analyse_buffer().
+ * \param   worker            The analyser core that analysed it.
+ */
+void analyse_cost(unsigned ticks, unsigned worker);
+
+/**
+ * \brief   Send the counts of the last window to the host and start the next
+ *          window. Called once a second.
+ */
 void check_counts();
 
 #ifdef __XC__
@@ -0,0 +1,353 @@
+/*
+ * DUT transit latency. The frames waiting for their second sighting are kept
+ * in a small set-associative table so that the memory and the time taken per
+ * frame are bounded. When a set is full the oldest frame in it is given up on.
+ */
+#include <string.h>
+#include "latency.h"
+#include "pcapng.h"
+#include "pcapng_conf.h"
+#include "util.h"
+#include "packet_analyser.h"
+
+#define ETHERTYPE_VLAN      0x8100
+#define ETHERTYPE_QINQ      0x88a8
+#define MAX_VLAN_TAGS       2
+
+#define LATENCY_TABLE_SETS  64
+#define LATENCY_TABLE_WAYS  4
+
+// Frames not matched within this time (10ms) are counted as unmatched
+#define LATENCY_MAX_AGE_TICKS 1000000
+
+/*
+ * The payload bytes hashed. Only as many as are always captured, even when
+ * the DUT adds VLAN tags, so the hash is the same on both interfaces.
+ */
+#define LATENCY_HASH_PAYLOAD_BYTES (CAPTURE_BYTES - 12 - (4 * MAX_VLAN_TAGS) - 2)
+
+typedef struct latency_entry_t {
+  uint32_t hash;
+  uint32_t timestamp;
+  uint8_t valid;
+  uint8_t interface_id;
+  uint8_t flow;
+  uint8_t pcp;
+} latency_entry_t;
+
+static volatile int enabled = 0;
+
+// Changed each time the measurement is enabled or disabled, so each analyser
+// core clears its own table and flows before it next uses them
+static volatile unsigned generation = 0;
+
+// Each analyser core has its own table and flows, and measures into its own
+// windows. Both sightings of a frame go to the same analyser (see
+// analyse_worker()), and a single flow can use all the sets.
+static latency_entry_t table[ANALYSIS_WORKERS][LATENCY_TABLE_SETS][LATENCY_TABLE_WAYS];
+static latency_flow_t flows[ANALYSIS_WORKERS][LATENCY_MAX_FLOWS];
+static uint32_t flow_first_seen[ANALYSIS_WORKERS][LATENCY_MAX_FLOWS];
+static unsigned num_flows[ANALYSIS_WORKERS];
+static unsigned worker_generation[ANALYSIS_WORKERS];
+
+// The flows sent to the host, only used by the core sending the records. The
+// flows of the analyser cores are merged into these so each keeps its id, and
+// new flows are given ids in the order they were first seen.
+static latency_flow_t sent_flows[LATENCY_MAX_FLOWS];
+static unsigned num_sent_flows;
+static unsigned sent_generation;
+
+void latency_init()
+{
+  memset(table, 0, sizeof(table));
+  memset(flows, 0, sizeof(flows));
+  memset(num_flows, 0, sizeof(num_flows));
+  memset(worker_generation, 0, sizeof(worker_generation));
+  num_sent_flows = 0;
+  sent_generation = generation;
+}
+
+void latency_set_enabled(int enable)
+{
+  enabled = 0;
+  generation++;
+  enabled = enable;
+}
+
+static unsigned histogram_bin(uint32_t latency)
+{
+  unsigned bin = 0;
+  while (latency > 1 && bin < LATENCY_HISTOGRAM_BINS - 1) {
+    latency >>= 1;
+    bin++;
+  }
+  return bin;
+}
+
+static void add_latency(latency_stats_t *stats, uint32_t latency)
+{
+  if (!stats->count || latency < stats->min)
+    stats->min = latency;
+  if (latency > stats->max)
+    stats->max = latency;
+  stats->count++;
+  stats->sum += latency;
+  stats->bins[histogram_bin(latency)]++;
+}
+
+/*
+ * Find the flow of a frame in the flows of an analyser core, adding it if it
+ * is a new flow.
+ */
+static unsigned find_flow(unsigned worker, const latency_flow_t *key, uint32_t timestamp)
+{
+  for (unsigned i = 0; i < num_flows[worker]; i++) {
+    if (memcmp(&flows[worker][i], key, sizeof(*key)) == 0)
+      return i;
+  }
+  if (num_flows[worker] == LATENCY_MAX_FLOWS)
+    return LATENCY_MAX_FLOWS;
+  flows[worker][num_flows[worker]] = *key;
+  flow_first_seen[worker][num_flows[worker]] = timestamp;
+  return num_flows[worker]++;
+}
+
+/*
+ * The stats of the flow of a frame in a window, which is given the flow so the
+ * window can be merged without the flows of the analyser core.
+ */
+static latency_stats_t *window_flow_stats(latency_window_t *window, unsigned worker,
+                                          const latency_entry_t *entry)
+{
+  if (entry->flow < LATENCY_MAX_FLOWS) {
+    window->flows[entry->flow] = flows[worker][entry->flow];
+    window->flow_first_seen[entry->flow] = flow_first_seen[worker][entry->flow];
+  }
+  return &window->flow_stats[entry->flow];
+}
+
+static void add_unmatched(latency_window_t *window, unsigned worker,
+                          const latency_entry_t *entry)
+{
+  window_flow_stats(window, worker, entry)->unmatched++;
+  window->pcp_stats[entry->pcp].unmatched++;
+}
+
+void latency_analyse(const unsigned char *buffer, unsigned worker, latency_window_t *window)
+{
+  const enhanced_packet_block_t *epb = (const enhanced_packet_block_t *)buffer;
+  const uint8_t *data = (const uint8_t *)&epb->data;
+  unsigned len = epb->captured_len;
+  unsigned offset = 12;
+  unsigned num_tags = 0;
+  unsigned pcp = 0;
+  latency_flow_t key;
+
+  if (!enabled || len < 14)
+    return;
+
+  // Frames of the table from before the measurement was last enabled belong
+  // to flows which have since been reset
+  if (worker_generation[worker] != generation) {
+    worker_generation[worker] = generation;
+    memset(table[worker], 0, sizeof(table[worker]));
+    num_flows[worker] = 0;
+  }
+
+  memcpy(key.dst_mac, &data[0], 6);
+  memcpy(key.src_mac, &data[6], 6);
+  key.vlan_id = 0xffff;
+
+  // Skip the VLAN tags as the DUT may add or remove them
+  key.ethertype = (data[offset] << 8) | data[offset + 1];
+  while ((key.ethertype == ETHERTYPE_VLAN || key.ethertype == ETHERTYPE_QINQ) &&
+         num_tags < MAX_VLAN_TAGS && offset + 8 <= len) {
+    if (num_tags == 0) {
+      pcp = data[offset + 2] >> 5;
+      key.vlan_id = ((data[offset + 2] << 8) | data[offset + 3]) & 0xfff;
+    }
+    num_tags++;
+    offset += 4;
+    key.ethertype = (data[offset] << 8) | data[offset + 1];
+  }
+
+  // FNV-1a over the MAC addresses, the untagged length and the payload
+  uint32_t hash = 2166136261u;
+  unsigned untagged_len = epb->packet_len - (4 * num_tags);
+  unsigned end = offset + LATENCY_HASH_PAYLOAD_BYTES;
+  if (end > len)
+    end = len;
+  for (unsigned i = 0; i < 12; i++)
+    hash = (hash ^ data[i]) * 16777619u;
+  for (unsigned i = 0; i < 4; i++)
+    hash = (hash ^ ((untagged_len >> (i * 8)) & 0xff)) * 16777619u;
+  for (unsigned i = offset; i < end; i++)
+    hash = (hash ^ data[i]) * 16777619u;
+
+  latency_entry_t *set = table[worker][hash % LATENCY_TABLE_SETS];
+  uint32_t timestamp = epb->timestamp_low;
+  latency_entry_t *match = NULL;
+  latency_entry_t *unused = NULL;
+  latency_entry_t *oldest = NULL;
+
+  for (unsigned i = 0; i < LATENCY_TABLE_WAYS; i++) {
+    latency_entry_t *entry = &set[i];
+    if (entry->valid && (int)(timestamp - entry->timestamp) > LATENCY_MAX_AGE_TICKS) {
+      add_unmatched(window, worker, entry);
+      entry->valid = 0;
+    }
+    if (!entry->valid) {
+      if (!unused)
+        unused = entry;
+      continue;
+    }
+    // Match the oldest sighting on the other interface
+    if (entry->hash == hash && entry->interface_id != epb->interface_id &&
+        (!match || (int)(entry->timestamp - match->timestamp) < 0)) {
+      match = entry;
+    }
+    if (!oldest || (int)(entry->timestamp - oldest->timestamp) < 0)
+      oldest = entry;
+  }
+
+  if (match) {
+    // The interfaces are not analysed in time order so either can be first
+    int latency = (int)(timestamp - match->timestamp);
+    if (latency < 0)
+      latency = -latency;
+
+    add_latency(window_flow_stats(window, worker, match), latency);
+    add_latency(&window->pcp_stats[match->pcp], latency);
+    match->valid = 0;
+    return;
+  }
+
+  latency_entry_t *entry = unused;
+  if (!entry) {
+    // Give up on the oldest frame in the set
+    entry = oldest;
+    add_unmatched(window, worker, entry);
+  }
+
+  entry->flow = find_flow(worker, &key, timestamp);
+  entry->hash = hash;
+  entry->timestamp = timestamp;
+  entry->interface_id = epb->interface_id;
+  entry->pcp = pcp;
+  entry->valid = 1;
+}
+
+/*
+ * Find the id a flow is sent to the host with, LATENCY_MAX_FLOWS if it has none.
+ */
+static unsigned find_sent_flow(const latency_flow_t *key)
+{
+  for (unsigned i = 0; i < num_sent_flows; i++) {
+    if (memcmp(&sent_flows[i], key, sizeof(*key)) == 0)
+      return i;
+  }
+  return LATENCY_MAX_FLOWS;
+}
+
+static int flow_active(const latency_window_t *window, unsigned i)
+{
+  return window->flow_stats[i].count || window->flow_stats[i].unmatched;
+}
+
+/*
+ * Give the new flows of the windows ids, the first seen first.
+ */
+static void add_sent_flows(const latency_window_t windows[])
+{
+  while (num_sent_flows < LATENCY_MAX_FLOWS) {
+    const latency_window_t *first = NULL;
+    unsigned first_index = 0;
+
+    for (unsigned w = 0; w < ANALYSIS_WORKERS; w++) {
+      const latency_window_t *window = &windows[w];
+      for (unsigned i = 0; i < LATENCY_MAX_FLOWS; i++) {
+        if (!flow_active(window, i) || find_sent_flow(&window->flows[i]) != LATENCY_MAX_FLOWS)
+          continue;
+        if (!first || (int)(window->flow_first_seen[i] - first->flow_first_seen[first_index]) < 0) {
+          first = window;
+          first_index = i;
+        }
+      }
+    }
+    if (!first)
+      return;
+    sent_flows[num_sent_flows++] = first->flows[first_index];
+  }
+}
+
+static void merge_record(latency_record_t *record, const latency_stats_t *stats)
+{
+  uint64_t sum = ((uint64_t)record->sum_high << 32) | record->sum_low;
+
+  if (stats->count && (!record->count || stats->min < record->min))
+    record->min = stats->min;
+  if (stats->max > record->max)
+    record->max = stats->max;
+  record->count += stats->count;
+  record->unmatched += stats->unmatched;
+  sum += stats->sum;
+  record->sum_low = (uint32_t)sum;
+  record->sum_high = (uint32_t)(sum >> 32);
+  for (unsigned i = 0; i < LATENCY_HISTOGRAM_BINS; i++)
+    record->bins[i] += stats->bins[i];
+}
+
+void latency_send_records(unsigned char probe, const latency_window_t windows[])
+{
+  // The flows followed by the priorities
+  latency_record_t records[LATENCY_MAX_FLOWS + 1 + LATENCY_NUM_PCPS];
+
+  if (!enabled)
+    return;
+
+  if (sent_generation != generation) {
+    sent_generation = generation;
+    num_sent_flows = 0;
+  }
+  add_sent_flows(windows);
+
+  memset(records, 0, sizeof(records));
+  for (unsigned i = 0; i < LATENCY_MAX_FLOWS + 1 + LATENCY_NUM_PCPS; i++) {
+    if (i <= LATENCY_MAX_FLOWS) {
+      records[i].type = LATENCY_RECORD_FLOW;
+      records[i].id = i;
+    } else {
+      records[i].type = LATENCY_RECORD_PCP;
+      records[i].id = i - (LATENCY_MAX_FLOWS + 1);
+    }
+  }
+
+  for (unsigned w = 0; w < ANALYSIS_WORKERS; w++) {
+    const latency_window_t *window = &windows[w];
+    for (unsigned i = 0; i <= LATENCY_MAX_FLOWS; i++) {
+      const latency_stats_t *stats = &window->flow_stats[i];
+      if (!flow_active(window, i))
+        continue;
+
+      unsigned id = LATENCY_MAX_FLOWS;
+      if (i < LATENCY_MAX_FLOWS)
+        id = find_sent_flow(&window->flows[i]);
+      merge_record(&records[id], stats);
+    }
+    for (unsigned i = 0; i < LATENCY_NUM_PCPS; i++)
+      merge_record(&records[LATENCY_MAX_FLOWS + 1 + i], &window->pcp_stats[i]);
+  }
+
+  for (unsigned id = 0; id < num_sent_flows; id++) {
+    latency_record_t *record = &records[id];
+    memcpy(record->dst_mac, sent_flows[id].dst_mac, 6);
+    memcpy(record->src_mac, sent_flows[id].src_mac, 6);
+    record->vlan_id = sent_flows[id].vlan_id;
+    record->ethertype = sent_flows[id].ethertype;
+  }
+
+  for (unsigned i = 0; i < LATENCY_MAX_FLOWS + 1 + LATENCY_NUM_PCPS; i++) {
+    if (records[i].count || records[i].unmatched)
+      xscope_bytes_c(probe, sizeof(records[i]), (unsigned char *)&records[i]);
+  }
+}
@@ -0,0 +1,129 @@
+/**
+ * \brief   Measurement of the transit latency of a device under test (DUT).
+ *
+ *          The tap is connected so that the frames going into the DUT are
+ *          seen on one interface and the frames it forwards are seen on the
+ *          other. Each frame is hashed over the bytes a switch does not change
+ *          and the first sighting of a frame is matched against the second on
+ *          the other interface. The difference between the timestamps is the
+ *          latency through the DUT.
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#ifdef __XC__
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Histogram bin i counts latencies of [2^i, 2^(i+1)) timer ticks (10ns), bin 0
+ * also counts a latency of 0 and the last bin counts everything above.
+ */
+#define LATENCY_HISTOGRAM_BINS 18
+
+/*
+ * Flows are tracked individually up to the maximum, later flows are added to
+ * an overflow flow with the id LATENCY_MAX_FLOWS.
+ */
+#define LATENCY_MAX_FLOWS 8
+
+#define LATENCY_NUM_PCPS 8
+
+/*
+ * The latencies of a flow or priority in a window. The minimum is only valid
+ * once there is a count.
+ */
+typedef struct latency_stats_t {
+  uint32_t count;
+  uint32_t unmatched;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+  uint32_t bins[LATENCY_HISTOGRAM_BINS];
+} latency_stats_t;
+
+typedef struct latency_flow_t {
+  uint8_t dst_mac[6];
+  uint16_t vlan_id;
+  uint8_t src_mac[6];
+  uint16_t ethertype;
+} latency_flow_t;
+
+/**
+ * \var     typedef latency_window_t
+ * \brief   The latencies measured by an analyser core in a window, cleared
+ *          (all zero) at the start of each window. The flows are indexed as
+ *          the analyser core found them, the last holding the flows beyond
+ *          LATENCY_MAX_FLOWS.
+ */
+typedef struct latency_window_t {
+  latency_flow_t flows[LATENCY_MAX_FLOWS + 1];
+  uint32_t flow_first_seen[LATENCY_MAX_FLOWS + 1]; // Timestamp of the first frame
+  latency_stats_t flow_stats[LATENCY_MAX_FLOWS + 1];
+  latency_stats_t pcp_stats[LATENCY_NUM_PCPS];
+} latency_window_t;
+
+typedef enum {
+  LATENCY_RECORD_FLOW,
+  LATENCY_RECORD_PCP,
+} latency_record_type_t;
+
+/**
+ * \var     typedef latency_record_t
+ * \brief   The latencies measured for a flow or a priority (PCP) in the last
+ *          window, sent to the host. A flow is the destination and source MAC,
+ *          VLAN ID and ethertype of the frames.
+ */
+typedef struct latency_record_t {
+  uint32_t type;                // One of latency_record_type_t
+  uint32_t id;                  // The flow index or PCP
+  uint8_t dst_mac[6];
+  uint16_t vlan_id;             // 0xffff if untagged
+  uint8_t src_mac[6];
+  uint16_t ethertype;
+  uint32_t count;               // Frames matched on both interfaces
+  uint32_t unmatched;           // Frames only seen on one interface (lost by the DUT
+                                // or too long in the DUT to be matched)
+  uint32_t min;                 // Minimum latency in timer ticks
+  uint32_t max;
+  uint32_t sum_low;             // Sum of the latencies in timer ticks
+  uint32_t sum_high;
+  uint32_t bins[LATENCY_HISTOGRAM_BINS];
+} latency_record_t;
+
+/**
+ * \brief   Initialise the latency measurement (disabled).
+ */
+void latency_init();
+
+/**
+ * \brief   Enable or disable the latency measurement. Each analyser core clears
+ *          its frames and flows when it next analyses a frame.
+ */
+void latency_set_enabled(int enabled);
+
+/**
+ * \brief   Match a captured frame against the frames seen on the other
+ *          interface.
+ * \param   buffer            Pointer to the Enhanced Packet Block.
+ * \param   worker            The analyser core, from analyse_worker().
+ * \param   window            The window of the analyser core the frame was
+ *                            seen in.
+ */
+void latency_analyse(const unsigned char *buffer, unsigned worker, latency_window_t *window);
+
+/**
+ * \brief   Send the records of the flows and priorities with any activity in
+ *          a window to the host, merged across the analyser cores.
+ * \param   windows           The window of each analyser core.
+ */
+void latency_send_records(unsigned char probe, const latency_window_t windows[]);
+
+#ifdef __XC__
+}
+#endif
+
+#endif // __LATENCY_H__
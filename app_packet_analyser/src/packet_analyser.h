@@ -1,9 +1,65 @@
 #ifndef __PACKET_ANALYSER_H__
 #define __PACKET_ANALYSER_H__
 
+/*
+ * Replace the MII receivers with frame generators to benchmark the buffer
+ * pipeline. The packet counts reported to the host are then the number of
+ * frames per second that the pipeline sustains (frames it can't keep up with
+ * are reported as drops).
+ */
+#ifndef BENCHMARK_FRAME_GENERATOR
+#define BENCHMARK_FRAME_GENERATOR 0
+#endif
+#define BENCHMARK_FRAME_BYTES 64
+
+/*
+ * Time the analysis of each frame and report the mean and maximum to the host
+ * every second, to check the analysis stays within the time available per
+ * frame at line rate.
+ */
+#ifndef ANALYSIS_MEASURE_COST
+#define ANALYSIS_MEASURE_COST 0
+#endif
+
+/*
+ * The number of analyser cores the frames are shared between, and the number
+ * of frames that can be queued for each. The frames between a pair of MAC
+ * addresses always go to the same analyser so they are analysed in order.
+ */
+#ifndef ANALYSIS_WORKERS
+#define ANALYSIS_WORKERS 2
+#endif
+#ifndef ANALYSIS_WORKER_SLOTS
+#define ANALYSIS_WORKER_SLOTS 2
+#endif
+
+/*
+ * The window over which the peak (burst) utilisation of each interface is
+ * measured, in microseconds. Set by the host with
+ * PACKET_ANALYSER_SET_BURST_WINDOW.
+ */
+#define BURST_WINDOW_MIN_US     100
+#define BURST_WINDOW_MAX_US     1000000
+#define BURST_WINDOW_DEFAULT_US 1000
+
+/*
+ * The xscope probes used to send data to the host
+ */
+enum {
+  PACKET_ANALYSER_PROBE_COUNTS = 0,
+  PACKET_ANALYSER_PROBE_LATENCY,    // latency_record_t (see latency.h)
+  PACKET_ANALYSER_PROBE_TALKERS,    // talkers_record_t (see talkers.h)
+  PACKET_ANALYSER_PROBE_COST,       // analysis_cost_t (see analysis_utils.h)
+};
+
 typedef enum {
   PACKET_ANALYSER_SET_RELAY_OPEN,
   PACKET_ANALYSER_SET_RELAY_CLOSE,
+  PACKET_ANALYSER_LATENCY_ENABLE,
+  PACKET_ANALYSER_LATENCY_DISABLE,
+  PACKET_ANALYSER_TALKERS_ENABLE,
+  PACKET_ANALYSER_TALKERS_DISABLE,
+  PACKET_ANALYSER_SET_BURST_WINDOW, // Followed by a word with the window in microseconds
 } tester_command_t;
 
 #endif // __PACKET_ANALYSER_H__
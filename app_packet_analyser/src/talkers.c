@@ -0,0 +1,244 @@
+/*
+ * Top talkers. The bytes of each pair are added to a count-min sketch with
+ * conservative update (only the counters at the minimum are raised) which
+ * gives an estimate that is never too low. A pair is added to the table of
+ * top talkers once its estimate passes the smallest in the table, which it
+ * then replaces. Each frame costs one hash, three counter updates and, for the
+ * pairs in or entering the table, a search of the TALKERS_TOP_K entries.
+ *
+ * Each analyser core has its own sketch and keeps its tables in the window of
+ * the current epoch (see analysis_utils.c), so no lock is taken per frame. The
+ * frames of a MAC pair all go to one analyser core, so the tables only need
+ * merging when they are sent. The sketch is only read by its own core, so it
+ * is not banked but cleared when the core starts a new window. The interfaces
+ * share the sketch, so the memory used is ANALYSIS_WORKERS * (TALKERS_SKETCH_ROWS
+ * * TALKERS_SKETCH_WIDTH * 4 + 2 * sizeof(talkers_window_t)) bytes, about 8KB
+ * with two analyser cores. With three rows a light pair only looks heavy if it
+ * shares a counter with a heavy pair in every row, which is rare with a few
+ * heavy pairs among thousands.
+ */
+#include <string.h>
+#include "talkers.h"
+#include "pcapng.h"
+#include "util.h"
+#include "packet_analyser.h"
+
+#define ETHERTYPE_VLAN       0x8100
+#define ETHERTYPE_QINQ       0x88a8
+#define ETHERTYPE_IPV4       0x0800
+#define MAX_VLAN_TAGS        2
+
+#define IPV4_SRC_OFFSET      12
+#define IPV4_DST_OFFSET      16
+
+#define TALKERS_SKETCH_ROWS  3
+#define TALKERS_SKETCH_WIDTH 256   // Indexed by a byte of the hash
+
+static volatile int enabled = 0;
+
+static uint32_t sketch[ANALYSIS_WORKERS][TALKERS_SKETCH_ROWS][TALKERS_SKETCH_WIDTH];
+
+void talkers_init()
+{
+  enabled = 0;
+  memset(sketch, 0, sizeof(sketch));
+}
+
+void talkers_set_enabled(int enable)
+{
+  enabled = enable;
+}
+
+static int same_key(const talkers_key_t *a, const talkers_key_t *b)
+{
+  return a->words[0] == b->words[0] && a->words[1] == b->words[1] &&
+         a->words[2] == b->words[2] && a->type == b->type;
+}
+
+static void find_min(talkers_window_t *window, unsigned interface_id)
+{
+  const talkers_entry_t *top = window->top[interface_id];
+  unsigned min_index = 0;
+  for (unsigned i = 1; i < window->num_top[interface_id]; i++) {
+    if (top[i].bytes < top[min_index].bytes)
+      min_index = i;
+  }
+  window->min_index[interface_id] = min_index;
+}
+
+/*
+ * Update the table of an interface with the estimate of a pair.
+ */
+static void update_top(talkers_window_t *window, unsigned interface_id, const talkers_key_t *key,
+    uint32_t hash, uint32_t estimate, uint32_t bytes)
+{
+  talkers_entry_t *top = window->top[interface_id];
+  unsigned *num_top = &window->num_top[interface_id];
+  talkers_entry_t *entry;
+
+  for (unsigned i = 0; i < *num_top; i++) {
+    entry = &top[i];
+    if (entry->hash == hash && same_key(&entry->key, key)) {
+      entry->bytes = estimate;
+      entry->frames++;
+      if (i == window->min_index[interface_id])
+        find_min(window, interface_id);
+      return;
+    }
+  }
+
+  // Add the pair, replacing the smallest once the table is full
+  if (*num_top < TALKERS_TOP_K)
+    entry = &top[(*num_top)++];
+  else
+    entry = &top[window->min_index[interface_id]];
+
+  entry->hash = hash;
+  entry->key = *key;
+  entry->bytes = estimate;
+  entry->error_bytes = estimate - bytes;
+  entry->frames = 1;
+  find_min(window, interface_id);
+}
+
+void talkers_analyse(const unsigned char *buffer, unsigned worker, talkers_window_t *window)
+{
+  const enhanced_packet_block_t *epb = (const enhanced_packet_block_t *)buffer;
+  const uint8_t *data = (const uint8_t *)&epb->data;
+  unsigned len = epb->captured_len;
+  unsigned interface_id = epb->interface_id;
+  unsigned offset = 12;
+  unsigned num_tags = 0;
+  unsigned ethertype;
+  talkers_key_t key;
+
+  if (!enabled || len < 14 || interface_id >= TALKERS_NUM_INTERFACES)
+    return;
+
+  ethertype = (data[offset] << 8) | data[offset + 1];
+  while ((ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) &&
+         num_tags < MAX_VLAN_TAGS && offset + 6 <= len) {
+    num_tags++;
+    offset += 4;
+    ethertype = (data[offset] << 8) | data[offset + 1];
+  }
+  offset += 2;
+
+  if (ethertype == ETHERTYPE_IPV4 && offset + IPV4_DST_OFFSET + 4 <= len) {
+    // The addresses are not word aligned
+    const uint8_t *src = &data[offset + IPV4_SRC_OFFSET];
+    const uint8_t *dst = &data[offset + IPV4_DST_OFFSET];
+    key.words[0] = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+    key.words[1] = dst[0] | (dst[1] << 8) | (dst[2] << 16) | (dst[3] << 24);
+    key.words[2] = 0;
+    key.type = TALKERS_KEY_IPV4;
+  } else {
+    // The frame data is word aligned
+    const uint32_t *words = (const uint32_t *)data;
+    key.words[0] = words[0];
+    key.words[1] = words[1];
+    key.words[2] = words[2];
+    key.type = TALKERS_KEY_MAC;
+  }
+
+  // Multiplicative hash of the words. A multiply only carries differences up,
+  // so the high bits are folded down after each one as the addresses mostly
+  // differ in their last bytes (the high bits of the words) and each row of the
+  // sketch is indexed by a different byte. The interface is hashed with the
+  // type so the interfaces share the sketch.
+  uint32_t hash = 0;
+  for (unsigned i = 0; i < TALKERS_KEY_WORDS - 1; i++) {
+    hash = (hash ^ key.words[i]) * 0x9e3779b1u;
+    hash ^= hash >> 16;
+  }
+  hash = (hash ^ key.type ^ (interface_id << 8)) * 0x85ebca6bu;
+  hash ^= hash >> 13;
+
+  if (!window->started) {
+    window->started = 1;
+    memset(sketch[worker], 0, sizeof(sketch[worker]));
+  }
+
+  uint32_t bytes = epb->packet_len;
+  uint32_t *c0 = &sketch[worker][0][hash & 0xff];
+  uint32_t *c1 = &sketch[worker][1][(hash >> 8) & 0xff];
+  uint32_t *c2 = &sketch[worker][2][(hash >> 16) & 0xff];
+  uint32_t estimate = (*c0 < *c1) ? *c0 : *c1;
+  if (*c2 < estimate)
+    estimate = *c2;
+  estimate += bytes;
+  if (*c0 < estimate)
+    *c0 = estimate;
+  if (*c1 < estimate)
+    *c1 = estimate;
+  if (*c2 < estimate)
+    *c2 = estimate;
+
+  if (window->num_top[interface_id] < TALKERS_TOP_K ||
+      estimate > window->top[interface_id][window->min_index[interface_id]].bytes)
+    update_top(window, interface_id, &key, hash, estimate, bytes);
+}
+
+void talkers_send_records(unsigned char probe, const talkers_window_t windows[])
+{
+  // A pair is only counted by one analyser core unless its frames differ in
+  // their MAC addresses, when its entries are added together
+  talkers_entry_t top[ANALYSIS_WORKERS * TALKERS_TOP_K];
+
+  if (!enabled)
+    return;
+
+  for (unsigned i = 0; i < TALKERS_NUM_INTERFACES; i++) {
+    unsigned num_top = 0;
+
+    for (unsigned w = 0; w < ANALYSIS_WORKERS; w++) {
+      for (unsigned j = 0; j < windows[w].num_top[i]; j++) {
+        const talkers_entry_t *entry = &windows[w].top[i][j];
+        unsigned k = 0;
+        for (; k < num_top; k++) {
+          if (top[k].hash == entry->hash && same_key(&top[k].key, &entry->key))
+            break;
+        }
+        if (k == num_top) {
+          top[num_top++] = *entry;
+        } else {
+          top[k].bytes += entry->bytes;
+          top[k].error_bytes += entry->error_bytes;
+          top[k].frames += entry->frames;
+        }
+      }
+    }
+
+    // Sort the largest first
+    for (unsigned j = 1; j < num_top; j++) {
+      talkers_entry_t entry = top[j];
+      unsigned k = j;
+      for (; k > 0 && top[k - 1].bytes < entry.bytes; k--)
+        top[k] = top[k - 1];
+      top[k] = entry;
+    }
+    if (num_top > TALKERS_TOP_K)
+      num_top = TALKERS_TOP_K;
+
+    for (unsigned j = 0; j < num_top; j++) {
+      talkers_record_t record;
+      record.interface_id = i;
+      record.rank = j;
+      const uint8_t *key_bytes = (const uint8_t *)top[j].key.words;
+      record.key_type = top[j].key.type;
+      memset(record.src, 0, sizeof(record.src));
+      memset(record.dst, 0, sizeof(record.dst));
+      if (record.key_type == TALKERS_KEY_IPV4) {
+        memcpy(record.src, &key_bytes[0], 4);
+        memcpy(record.dst, &key_bytes[4], 4);
+      } else {
+        memcpy(record.dst, &key_bytes[0], 6);
+        memcpy(record.src, &key_bytes[6], 6);
+      }
+      record.bytes = top[j].bytes;
+      record.error_bytes = top[j].error_bytes;
+      record.frames = top[j].frames;
+      xscope_bytes_c(probe, sizeof(record), (unsigned char *)&record);
+    }
+  }
+}
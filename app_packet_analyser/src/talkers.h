@@ -0,0 +1,114 @@
+/**
+ * \brief   The top talkers of each interface: the source/destination pairs
+ *          sending the most bytes.
+ *
+ *          The bytes of every pair are counted in a small count-min sketch
+ *          and the pairs whose estimate is among the largest are kept in a
+ *          table of TALKERS_TOP_K entries, so the memory and the time taken
+ *          per frame are bounded however many pairs there are. IPv4 frames
+ *          are counted by their IP addresses and other frames by their MAC
+ *          addresses. Each analyser core counts its frames into its own
+ *          window and the tables are merged when they are sent.
+ */
+
+#ifndef __TALKERS_H__
+#define __TALKERS_H__
+
+#ifdef __XC__
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * The talkers reported for each interface every second.
+ */
+#define TALKERS_TOP_K 8
+
+#define TALKERS_NUM_INTERFACES 2
+
+/*
+ * The key is compared and hashed as words to keep the cost per frame down. For
+ * MAC pairs the first three words are the addresses as they are in the frame
+ * (destination then source), for IPv4 pairs the source and destination.
+ */
+#define TALKERS_KEY_WORDS    4
+
+typedef struct talkers_key_t {
+  uint32_t words[TALKERS_KEY_WORDS - 1];
+  uint32_t type;
+} talkers_key_t;
+
+typedef struct talkers_entry_t {
+  uint32_t hash;
+  talkers_key_t key;
+  uint32_t bytes;
+  uint32_t error_bytes;
+  uint32_t frames;
+} talkers_entry_t;
+
+/**
+ * \var     typedef talkers_window_t
+ * \brief   The top talkers of an analyser core in a window, cleared (all
+ *          zero) at the start of each window.
+ */
+typedef struct talkers_window_t {
+  unsigned started;             // Set once the analyser core has cleared its sketch
+  talkers_entry_t top[TALKERS_NUM_INTERFACES][TALKERS_TOP_K];
+  unsigned num_top[TALKERS_NUM_INTERFACES];
+  unsigned min_index[TALKERS_NUM_INTERFACES];  // The entry with the fewest bytes
+} talkers_window_t;
+
+typedef enum {
+  TALKERS_KEY_MAC,
+  TALKERS_KEY_IPV4,
+} talkers_key_type_t;
+
+/**
+ * \var     typedef talkers_record_t
+ * \brief   A top talker of an interface in the last window, sent to the host.
+ *          The bytes are an estimate which is never below the real count and
+ *          is at most error_bytes above it.
+ */
+typedef struct talkers_record_t {
+  uint32_t interface_id;
+  uint32_t rank;                // 0 for the pair sending the most bytes
+  uint32_t key_type;            // One of talkers_key_type_t
+  uint8_t src[6];               // MAC address, or IPv4 address in the first 4 bytes
+  uint8_t dst[6];
+  uint32_t bytes;
+  uint32_t error_bytes;         // Bytes counted before the pair was in the table
+  uint32_t frames;              // Frames since the pair was in the table
+} talkers_record_t;
+
+/**
+ * \brief   Initialise the top talkers (disabled).
+ */
+void talkers_init();
+
+/**
+ * \brief   Enable or disable the top talkers.
+ */
+void talkers_set_enabled(int enabled);
+
+/**
+ * \brief   Count a captured frame.
+ * \param   buffer            Pointer to the Enhanced Packet Block.
+ * \param   worker            The analyser core, from analyse_worker().
+ * \param   window            The window of the analyser core the frame was
+ *                            seen in.
+ */
+void talkers_analyse(const unsigned char *buffer, unsigned worker, talkers_window_t *window);
+
+/**
+ * \brief   Send the top talkers of each interface in a window to the host,
+ *          merged across the analyser cores.
+ * \param   windows           The window of each analyser core.
+ */
+void talkers_send_records(unsigned char probe, const talkers_window_t windows[]);
+
+#ifdef __XC__
+}
+#endif
+
+#endif // __TALKERS_H__
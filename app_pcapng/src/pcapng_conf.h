@@ -14,8 +14,20 @@
 #define CLK_DELAY_RECEIVE    0
 
 /*
- * Define the number of buffers available
+ * Calibrated delay from the start of frame delimiter on the wire to it being
+ * sampled by each receiver, in 10ns timer ticks. Subtracted from the timestamps.
+ */
+#define PCAPNG_TIMESTAMP_OFFSET_0 0
+#define PCAPNG_TIMESTAMP_OFFSET_1 0
+
+/*
+ * Define the number of buffers available (split between the interfaces)
  */
 #define BUFFER_COUNT 100
 
+/*
+ * Drop and count frames when the buffers run out instead of stopping
+ */
+#define PCAPNG_DROP_ON_OVERFLOW 1
+
 #endif // __PCAPNG_CONF_H__
@@ -0,0 +1,45 @@
+#ifndef __PCAPNG_TAP_H__
+#define __PCAPNG_TAP_H__
+
+#include <stdint.h>
+
+/*
+ * The xscope probes used to send data to the host
+ */
+enum {
+  PCAPNG_PROBE_PACKET_DATA = 0,
+  PCAPNG_PROBE_FILTER_COUNTS,
+  PCAPNG_PROBE_BUFFER_OCCUPANCY,
+  PCAPNG_PROBE_TIME,              // tap_time_t
+};
+
+/*
+ * Commands from the host. PCAPNG_TAP_SET_FILTER is followed by the words of a
+ * pcapng_filter_program_t in the same upload.
+ */
+typedef enum {
+  PCAPNG_TAP_SET_FILTER,
+  PCAPNG_TAP_CLEAR_FILTER,
+  PCAPNG_TAP_GET_TIME,            // Followed by a sequence number
+} tap_command_t;
+
+/*
+ * The reply to PCAPNG_TAP_GET_TIME with the current time of the timestamps, so
+ * the host can relate them to its own clock.
+ */
+typedef struct tap_time_t {
+  uint32_t sequence;
+  uint32_t timestamp_high;
+  uint32_t timestamp_low;
+} tap_time_t;
+
+#ifdef __XC__
+/*
+ * Interface to the core on the tile which timestamps the frames.
+ */
+interface tap_time_if {
+  void send_time(unsigned sequence);
+};
+#endif
+
+#endif // __PCAPNG_TAP_H__
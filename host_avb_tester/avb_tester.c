@@ -16,7 +16,12 @@
   #include <pthread.h>
 #endif
 
+#include <time.h>
+
 #include "xscope_host_shared.h"
+#include "analysis_utils.h"
+#include "shaper.h"
+#include "gptp.h"
 #include "avb_tester.h"
 
 #define DEFAULT_FILE "cap.pcapng"
@@ -26,18 +31,276 @@ const char *g_prompt = " > ";
 // Indicate whether the output should be pcap or pcapng
 int g_libpcap_mode = 0;
 
+// Print the histogram of the inter-arrival times of each stream
+static int g_print_jitter_bins = 0;
+
+// The sequence errors of each stream are logged to this file (-l)
+static FILE *g_sequence_log = NULL;
+
+static const char *g_gap_bin_names[SEQUENCE_GAP_BINS] = {
+  "1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65-127"
+};
+
+// The sequence errors of each stream since the start, printed on exit
+#define MAX_SEQUENCE_TOTALS 1024
+static stream_sequence_record_t g_sequence_totals[MAX_SEQUENCE_TOTALS];
+static unsigned g_num_sequence_totals = 0;
+
 void hook_registration_received(int sockfd, int xscope_probe, char *name)
 {
   // Do nothing
 }
 
+/*
+ * The largest interval of a jitter bin (see analysis_utils.h), in ticks.
+ */
+static unsigned jitter_bin_upper_ticks(const stream_jitter_record_t *record, int bin)
+{
+  int octave = bin - JITTER_CENTRE_BIN;
+
+  if (bin == JITTER_BINS - 1)
+    return record->max_ticks;
+  if (octave >= 0)
+    return record->nominal_ticks + (JITTER_BIN_TICKS << octave);
+  return record->nominal_ticks - (JITTER_BIN_TICKS << (-octave - 1));
+}
+
+static void print_jitter_bins(const stream_jitter_record_t *record)
+{
+  int i;
+
+  // The bins are the deviation from the nominal interval
+  for (i = 0; i < JITTER_BINS; i++) {
+    int octave = i - JITTER_CENTRE_BIN;
+    if (!record->bins[i])
+      continue;
+    if (octave == 0)
+      printf("    within 1 us      : %u\n", record->bins[i]);
+    else if (i == 0 || i == JITTER_BINS - 1)
+      printf("    %s >= %-4d us  : %u\n", octave < 0 ? "early" : "late ", 1 << (abs(octave) - 1), record->bins[i]);
+    else
+      printf("    %s %4d-%-4d us : %u\n", octave < 0 ? "early" : "late ", 1 << (abs(octave) - 1), 1 << abs(octave),
+          record->bins[i]);
+  }
+}
+
+static void print_jitter_record(const stream_jitter_record_t *record)
+{
+  unsigned above = 0;
+  int bin;
+
+  // The 99.9th percentile is at most the top of the bin holding it
+  for (bin = JITTER_BINS - 1; bin > 0; bin--) {
+    above += record->bins[bin];
+    if (above > record->intervals / 1000)
+      break;
+  }
+  unsigned percentile = jitter_bin_upper_ticks(record, bin);
+  if (percentile > record->max_ticks)
+    percentile = record->max_ticks;
+
+  printf("Stream 0x%08x%08x: %u intervals, min %.2f us, max %s%.2f us, 99.9%% <= %.2f us\n",
+      record->id_high, record->id_low, record->intervals, record->min_ticks / 100.0,
+      record->max_ticks == 0xffff ? ">" : "", record->max_ticks / 100.0, percentile / 100.0);
+  if (g_print_jitter_bins)
+    print_jitter_bins(record);
+}
+
+static void print_shaper_record(const shaper_record_t *record)
+{
+  const shaper_window_t *window = &record->window;
+  unsigned i;
+
+  printf("Shaper class %c on interface %u: idleSlope %.2f Mb/s, %u frames, max burst %u bytes, "
+      "max interference %.2f us, lowest credit %d bits, %u violations\n",
+      'A' + record->traffic_class, record->interface_id, record->idle_slope / 1000000.0,
+      window->frames, window->max_burst_bytes, window->max_interference_ticks / 100.0,
+      window->min_credit_bits, window->violations);
+
+  // The timestamps are 10ns ticks
+  for (i = 0; i < window->violations && i < SHAPER_MAX_VIOLATIONS; i++) {
+    const shaper_violation_t *violation = &window->violation[i];
+    uint64_t timestamp = ((uint64_t)violation->timestamp_high << 32) | violation->timestamp_low;
+    printf("  VIOLATION: frame at %llu.%08llu s sent with a credit of %d bits\n",
+        (unsigned long long)(timestamp / 100000000), (unsigned long long)(timestamp % 100000000),
+        violation->credit_bits);
+  }
+  if (window->violations > SHAPER_MAX_VIOLATIONS)
+    printf("  ... and %u more violations\n", window->violations - SHAPER_MAX_VIOLATIONS);
+}
+
+static void print_clock_identity(const uint8_t *identity)
+{
+  printf("%02x%02x%02x.%02x%02x.%02x%02x%02x", identity[0], identity[1], identity[2],
+      identity[3], identity[4], identity[5], identity[6], identity[7]);
+}
+
+static void print_gptp_port_record(const gptp_port_record_t *record)
+{
+  static const uint8_t no_identity[8] = { 0 };
+
+  printf("gPTP port ");
+  print_clock_identity(record->clock_identity);
+  printf("-%u on interface %u", record->port_number, record->interface_id);
+  if (memcmp(record->grandmaster_identity, no_identity, sizeof(no_identity)) != 0) {
+    printf(" (grandmaster ");
+    print_clock_identity(record->grandmaster_identity);
+    printf(")");
+  }
+  printf(": %u messages\n", record->frames);
+
+  // The times are 10ns ticks
+  if (record->syncs) {
+    printf("  Sync: %u syncs", record->syncs);
+    if (record->intervals) {
+      printf(", interval min %.3f mean %.3f max %.3f ms", record->min_interval_ticks / 100000.0,
+          record->total_interval_ticks / 100000.0 / record->intervals,
+          record->max_interval_ticks / 100000.0);
+      if (record->nominal_interval_ticks)
+        printf(" (nominal %.3f ms, jitter %.2f us)", record->nominal_interval_ticks / 100000.0,
+            record->max_jitter_ticks / 100.0);
+    }
+    if (record->missing_follow_ups)
+      printf(", ERROR: %u without a Follow_Up", record->missing_follow_ups);
+    printf("\n");
+  }
+
+  if (record->pdelay_requests || record->pdelay_responses) {
+    printf("  Pdelay: %u requests, %u responses", record->pdelay_requests, record->pdelay_responses);
+    if (record->pdelay_responses)
+      printf(", turnaround min %.2f mean %.2f max %.2f us", record->min_turnaround_ticks / 100.0,
+          record->total_turnaround_ticks / 100.0 / record->pdelay_responses,
+          record->max_turnaround_ticks / 100.0);
+    if (record->pdelay_lost)
+      printf(", ERROR: %u without a response", record->pdelay_lost);
+    printf("\n");
+  }
+}
+
+static void print_gptp_residence_record(const gptp_residence_record_t *record)
+{
+  printf("gPTP residence from interface %u to %u: %u syncs, residence min %.2f mean %.2f max %.2f us, "
+      "correctionField error %d to %d ns\n",
+      record->ingress_interface_id, record->egress_interface_id, record->syncs,
+      record->min_residence_ticks / 100.0, record->total_residence_ticks / 100.0 / record->syncs,
+      record->max_residence_ticks / 100.0, record->min_error_ns, record->max_error_ns);
+}
+
+static void print_sequence_record(const stream_sequence_record_t *record)
+{
+  const char *prefix = " | gaps";
+  int i;
+
+  printf("Stream 0x%08x%08x: %u lost, %u duplicates, %u reordered, %u restarts",
+      record->id_high, record->id_low, record->lost, record->duplicates, record->reordered,
+      record->restarts);
+  for (i = 0; i < SEQUENCE_GAP_BINS; i++) {
+    if (record->gap_bins[i]) {
+      printf("%s %s:%u", prefix, g_gap_bin_names[i], record->gap_bins[i]);
+      prefix = "";
+    }
+  }
+  printf("\n");
+}
+
+static void log_sequence_record(const stream_sequence_record_t *record)
+{
+  int i;
+
+  fprintf(g_sequence_log, "%lu,0x%08x%08x,%u,%u,%u,%u", (unsigned long)time(NULL),
+      record->id_high, record->id_low, record->lost, record->duplicates, record->reordered,
+      record->restarts);
+  for (i = 0; i < SEQUENCE_GAP_BINS; i++)
+    fprintf(g_sequence_log, ",%u", record->gap_bins[i]);
+  fprintf(g_sequence_log, "\n");
+  fflush(g_sequence_log);
+}
+
+static void add_sequence_totals(const stream_sequence_record_t *record)
+{
+  stream_sequence_record_t *totals = NULL;
+  unsigned i;
+
+  for (i = 0; i < g_num_sequence_totals; i++) {
+    if (g_sequence_totals[i].id_high == record->id_high && g_sequence_totals[i].id_low == record->id_low) {
+      totals = &g_sequence_totals[i];
+      break;
+    }
+  }
+  if (!totals) {
+    if (g_num_sequence_totals == MAX_SEQUENCE_TOTALS)
+      return;
+    totals = &g_sequence_totals[g_num_sequence_totals++];
+    memset(totals, 0, sizeof(*totals));
+    totals->id_high = record->id_high;
+    totals->id_low = record->id_low;
+  }
+
+  totals->lost += record->lost;
+  totals->duplicates += record->duplicates;
+  totals->reordered += record->reordered;
+  totals->restarts += record->restarts;
+  for (i = 0; i < SEQUENCE_GAP_BINS; i++)
+    totals->gap_bins[i] += record->gap_bins[i];
+}
+
 void hook_data_received(int sockfd, int xscope_probe, void *data, int data_len)
 {
-  // Do nothing
+  if (xscope_probe == AVB_TESTER_PROBE_GPTP_PORT) {
+    if (data_len == sizeof(gptp_port_record_t)) {
+      print_gptp_port_record((gptp_port_record_t *)data);
+      fflush(stdout);
+    }
+    return;
+  }
+
+  if (xscope_probe == AVB_TESTER_PROBE_GPTP_RESIDENCE) {
+    if (data_len == sizeof(gptp_residence_record_t)) {
+      print_gptp_residence_record((gptp_residence_record_t *)data);
+      fflush(stdout);
+    }
+    return;
+  }
+
+  if (xscope_probe == AVB_TESTER_PROBE_SEQUENCE) {
+    if (data_len == sizeof(stream_sequence_record_t)) {
+      print_sequence_record((stream_sequence_record_t *)data);
+      add_sequence_totals((stream_sequence_record_t *)data);
+      if (g_sequence_log)
+        log_sequence_record((stream_sequence_record_t *)data);
+      fflush(stdout);
+    }
+    return;
+  }
+
+  if (xscope_probe == AVB_TESTER_PROBE_SHAPER) {
+    if (data_len == sizeof(shaper_record_t)) {
+      print_shaper_record((shaper_record_t *)data);
+      fflush(stdout);
+    }
+    return;
+  }
+
+  if (xscope_probe == AVB_TESTER_PROBE_JITTER) {
+    if (data_len == sizeof(stream_jitter_record_t)) {
+      print_jitter_record((stream_jitter_record_t *)data);
+      fflush(stdout);
+    }
+    return;
+  }
 }
 
 void hook_exiting()
 {
+  unsigned i;
+
+  if (g_num_sequence_totals) {
+    printf("Sequence errors since the start:\n");
+    for (i = 0; i < g_num_sequence_totals; i++)
+      print_sequence_record(&g_sequence_totals[i]);
+  }
+  if (g_sequence_log)
+    fclose(g_sequence_log);
 }
 
 void print_console_usage()
@@ -80,6 +343,10 @@ void *console_thread(void *arg)
       buffer[i] = tolower(c);
     buffer[i] = '\0';
 
+    // Stop taking commands if the input is closed
+    if (c == EOF && i == 0)
+      break;
+
     switch (buffer[0]) {
       case 'q':
         print_and_exit("Done\n");
@@ -129,9 +396,11 @@ void *console_thread(void *arg)
 
 void usage(char *argv[])
 {
-  printf("Usage: %s [-s server_ip] [-p port]\n", argv[0]);
+  printf("Usage: %s [-s server_ip] [-p port] [-j] [-l file]\n", argv[0]);
   printf("  -s server_ip :   The IP address of the xscope server (default %s)\n", DEFAULT_SERVER_IP);
   printf("  -p port      :   The port of the xscope server (default %s)\n", DEFAULT_PORT);
+  printf("  -j           :   Print the histogram of the packet inter-arrival times of each stream\n");
+  printf("  -l file      :   Log the lost, duplicated and reordered packets of each stream as CSV\n");
   exit(1);
 }
 
@@ -152,8 +421,24 @@ int main(int argc, char *argv[])
   // Set stdout to be unbuffered
   setvbuf(stdout, NULL, _IOLBF, 0);
 
-  while ((c = getopt(argc, argv, "s:p:")) != -1) {
+  while ((c = getopt(argc, argv, "s:p:jl:")) != -1) {
     switch (c) {
+      case 'j':
+        g_print_jitter_bins = 1;
+        break;
+      case 'l':
+        g_sequence_log = fopen(optarg, "w");
+        if (!g_sequence_log) {
+          fprintf(stderr, "Unable to open '%s'\n", optarg);
+          err++;
+        } else {
+          int i;
+          fprintf(g_sequence_log, "time,stream,lost,duplicates,reordered,restarts");
+          for (i = 0; i < SEQUENCE_GAP_BINS; i++)
+            fprintf(g_sequence_log, ",gaps_%s", g_gap_bin_names[i]);
+          fprintf(g_sequence_log, "\n");
+        }
+        break;
       case 's':
         server_ip = optarg;
         break;
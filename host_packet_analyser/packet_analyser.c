@@ -15,20 +15,205 @@
 #else
   #include <pthread.h>
 #endif
+#include <time.h>
 
 #include "xscope_host_shared.h"
 #include "analysis_utils.h"
 #include "packet_analyser.h"
+#include "latency.h"
+#include "talkers.h"
 
 const char *g_prompt = "";
 
+// Whether the DUT latency measurement has been enabled on the device
+int g_latency_enabled = 0;
+
+// Whether the frame size distribution is printed under the counts
+int g_print_sizes = 0;
+
+// Whether the top talkers have been enabled on the device
+int g_talkers_enabled = 0;
+
+// The burst window of the device and the peak utilisation over it that raises
+// an alarm (-b, 0 for none)
+unsigned g_burst_window_us = BURST_WINDOW_DEFAULT_US;
+double g_burst_alarm_percent = 0;
+
+/*
+ * The time available to analyse each frame when both interfaces are receiving
+ * minimum sized frames at 100Mb/s (84 bytes on the wire each) in ns
+ */
+#define LINE_RATE_BUDGET_NS (84 * 8 * 10 / 2)
+
+// The frame size distribution is logged once a second to this file (-l)
+FILE *g_size_log = NULL;
+
+static const char *g_size_bin_names[FRAME_SIZE_BINS] = {
+  "runt", "64", "65-127", "128-255", "256-511", "512-1023", "1024-1518", "oversize"
+};
+
 void hook_registration_received(int sockfd, int xscope_probe, char *name)
 {
   // Do nothing
 }
 
+static void print_mac(const uint8_t *mac)
+{
+  printf("%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+/*
+ * Print the latencies of a flow or priority. The device sends them in 10ns
+ * timer ticks.
+ */
+static void print_latency_record(const latency_record_t *record)
+{
+  uint64_t sum = ((uint64_t)record->sum_high << 32) | record->sum_low;
+  int i;
+
+  if (record->type == LATENCY_RECORD_FLOW) {
+    printf("  Latency flow %u: ", record->id);
+    if (record->id == LATENCY_MAX_FLOWS) {
+      printf("(other flows)");
+    } else {
+      print_mac(record->src_mac);
+      printf(" > ");
+      print_mac(record->dst_mac);
+      if (record->vlan_id != 0xffff)
+        printf(" vid %u", record->vlan_id);
+      printf(" type 0x%04x", record->ethertype);
+    }
+  } else {
+    printf("  Latency PCP %u:", record->id);
+  }
+  printf("\n    %u frames", record->count);
+  if (record->count) {
+    printf(", min %.2f us, mean %.2f us, max %.2f us",
+        record->min / 100.0, (sum / 100.0) / record->count, record->max / 100.0);
+  }
+  printf(", %u unmatched\n", record->unmatched);
+
+  // Bin i is [2^i, 2^(i+1)) ticks, the first and last bins are open ended
+  for (i = 0; i < LATENCY_HISTOGRAM_BINS; i++) {
+    if (!record->bins[i])
+      continue;
+    if (i == LATENCY_HISTOGRAM_BINS - 1)
+      printf("    >= %8.2f us : %u\n", (1 << i) / 100.0, record->bins[i]);
+    else
+      printf("    <  %8.2f us : %u\n", (2 << i) / 100.0, record->bins[i]);
+  }
+}
+
+static void print_sizes(const interface_state_t *state)
+{
+  int i;
+
+  printf("  %-4s sizes:", state->interface_id ? "DOWN" : "UP");
+  for (i = 0; i < FRAME_SIZE_BINS; i++)
+    printf(" %s %u%s", g_size_bin_names[i], state->size_snapshot[i], i < FRAME_SIZE_BINS - 1 ? " |" : "\n");
+}
+
+static void log_sizes(const interface_state_t *state)
+{
+  int i;
+
+  fprintf(g_size_log, "%lu,%u,%u,%u,%u", (unsigned long)time(NULL), state->interface_id,
+      state->packet_snapshot, state->byte_snapshot, state->drop_snapshot);
+  for (i = 0; i < FRAME_SIZE_BINS; i++)
+    fprintf(g_size_log, ",%u", state->size_snapshot[i]);
+  fprintf(g_size_log, "\n");
+}
+
+static void print_talker(const talkers_record_t *record)
+{
+  if (record->rank == 0)
+    printf("  Top talkers %s:\n", record->interface_id ? "DOWN" : "UP");
+
+  printf("    %u. ", record->rank + 1);
+  if (record->key_type == TALKERS_KEY_IPV4) {
+    printf("%u.%u.%u.%u > %u.%u.%u.%u",
+        record->src[0], record->src[1], record->src[2], record->src[3],
+        record->dst[0], record->dst[1], record->dst[2], record->dst[3]);
+  } else {
+    print_mac(record->src);
+    printf(" > ");
+    print_mac(record->dst);
+  }
+  printf(" : %6.2f Mb/s, %u bytes", (record->bytes * 8.0) / 1000000.0, record->bytes);
+  if (record->error_bytes)
+    printf(" (up to %u over)", record->error_bytes);
+  printf(", %u frames\n", record->frames);
+}
+
+static void print_cost(const analysis_cost_t *cost)
+{
+  uint64_t ticks = ((uint64_t)cost->ticks_high << 32) | cost->ticks_low;
+  double mean_ns = (ticks * 10.0) / cost->frames;
+
+  printf("  Analysis: %u frames, mean %.0f ns, max %u ns per frame (%.0f%% of the %u ns at line rate)\n",
+      cost->frames, mean_ns, cost->max_ticks * 10, (mean_ns * 100.0) / LINE_RATE_BUDGET_NS,
+      LINE_RATE_BUDGET_NS);
+}
+
+static void send_burst_window(int sockfd, unsigned window_us)
+{
+  uint32_t cmd[2] = { PACKET_ANALYSER_SET_BURST_WINDOW, window_us };
+  xscope_ep_request_upload(sockfd, sizeof(cmd), (unsigned char *)cmd);
+}
+
+/*
+ * The peak utilisation over the burst window. At 100Mb/s a bit takes one 10ns
+ * tick.
+ */
+static double burst_utilisation(const interface_state_t *state)
+{
+  if (!state->burst_window_ticks)
+    return 0;
+  return (state->burst_snapshot * 8.0 * 100.0) / state->burst_window_ticks;
+}
+
+static void check_burst_alarm(const interface_state_t *state)
+{
+  double utilisation = burst_utilisation(state);
+
+  if (g_burst_alarm_percent && utilisation >= g_burst_alarm_percent) {
+    printf("ALARM: microburst on %s, %.2f %% of line rate over %u us (threshold %.2f %%)\n",
+        state->interface_id ? "DOWN" : "UP", utilisation, state->burst_window_ticks / 100,
+        g_burst_alarm_percent);
+  }
+}
+
 void hook_data_received(int sockfd, int xscope_probe, void *data, int data_len)
 {
+  static interface_state_t states[2];
+
+  if (xscope_probe == PACKET_ANALYSER_PROBE_LATENCY) {
+    if (data_len == sizeof(latency_record_t)) {
+      print_latency_record((latency_record_t *)data);
+      fflush(stdout);
+    }
+    return;
+  }
+
+  if (xscope_probe == PACKET_ANALYSER_PROBE_TALKERS) {
+    if (data_len == sizeof(talkers_record_t)) {
+      print_talker((talkers_record_t *)data);
+      fflush(stdout);
+    }
+    return;
+  }
+
+  if (xscope_probe == PACKET_ANALYSER_PROBE_COST) {
+    if (data_len == sizeof(analysis_cost_t) && ((analysis_cost_t *)data)->frames) {
+      print_cost((analysis_cost_t *)data);
+      fflush(stdout);
+    }
+    return;
+  }
+
+  if (data_len != sizeof(interface_state_t))
+    return;
+
   interface_state_t *state = (interface_state_t *)data;
   double mega_bits_per_second = (state->byte_snapshot * 8.0) / 1000000.0;
 
@@ -38,18 +223,33 @@ void hook_data_received(int sockfd, int xscope_probe, void *data, int data_len)
   const unsigned int used_bits = used_bytes * 8;
   double utilisation = (used_bits / 100000000.0) * 100.0;
 
-  printf("| %7d | %8d | %6.2f | %6.2f %% |",
-      state->packet_snapshot, state->byte_snapshot, mega_bits_per_second, utilisation);
+  printf("| %7d | %8d | %6.2f | %6.2f %% | %6.2f %% | %6d |",
+      state->packet_snapshot, state->byte_snapshot, mega_bits_per_second, utilisation,
+      burst_utilisation(state), state->drop_snapshot);
+
+  if (state->interface_id < 2)
+    states[state->interface_id] = *state;
+  if (g_size_log)
+    log_sizes(state);
 
   if (state->interface_id) {
     printf("\n");
+    check_burst_alarm(&states[0]);
+    check_burst_alarm(&states[1]);
+    if (g_print_sizes) {
+      print_sizes(&states[0]);
+      print_sizes(&states[1]);
+    }
     fflush(stdout);
+    if (g_size_log)
+      fflush(g_size_log);
   }
 }
 
 void hook_exiting()
 {
-  // Do nothing
+  if (g_size_log)
+    fclose(g_size_log);
 }
 
 void print_console_usage()
@@ -58,6 +258,11 @@ void print_console_usage()
   printf("  h|?     : print this help message\n");
   printf("  c       : close the relay (connect)\n");
   printf("  o       : open the relay (disconnect)\n");
+  printf("  l       : toggle the measurement of the latency of a DUT between the interfaces\n");
+  printf("  t       : toggle the top talkers (source/destination pairs) of each interface\n");
+  printf("  z       : toggle printing the frame size distribution (RMON bins)\n");
+  printf("  w <us>  : set the window of the peak (burst) utilisation, %u to %u us\n",
+      BURST_WINDOW_MIN_US, BURST_WINDOW_MAX_US);
   printf("  q       : quit\n");
 }
 
@@ -82,6 +287,10 @@ void *console_thread(void *arg)
       buffer[i] = tolower(c);
     buffer[i] = '\0';
 
+    // Stop taking commands if the input is closed
+    if (c == EOF && i == 0)
+      break;
+
     switch (buffer[0]) {
       case 'q':
         print_and_exit("Done\n");
@@ -99,6 +308,38 @@ void *console_thread(void *arg)
         break;
       }
 
+      case 'l': {
+        g_latency_enabled = !g_latency_enabled;
+        tester_command_t cmd = g_latency_enabled ? PACKET_ANALYSER_LATENCY_ENABLE : PACKET_ANALYSER_LATENCY_DISABLE;
+        xscope_ep_request_upload(sockfd, 4, (unsigned char *)&cmd);
+        printf("Latency measurement %s\n", g_latency_enabled ? "enabled" : "disabled");
+        break;
+      }
+
+      case 't': {
+        g_talkers_enabled = !g_talkers_enabled;
+        tester_command_t cmd = g_talkers_enabled ? PACKET_ANALYSER_TALKERS_ENABLE : PACKET_ANALYSER_TALKERS_DISABLE;
+        xscope_ep_request_upload(sockfd, 4, (unsigned char *)&cmd);
+        printf("Top talkers %s\n", g_talkers_enabled ? "enabled" : "disabled");
+        break;
+      }
+
+      case 'z':
+        g_print_sizes = !g_print_sizes;
+        break;
+
+      case 'w': {
+        unsigned window_us = atoi(&buffer[1]);
+        if (window_us < BURST_WINDOW_MIN_US || window_us > BURST_WINDOW_MAX_US) {
+          printf("The window must be %u to %u us\n", BURST_WINDOW_MIN_US, BURST_WINDOW_MAX_US);
+          break;
+        }
+        g_burst_window_us = window_us;
+        send_burst_window(sockfd, window_us);
+        printf("Burst window %u us\n", window_us);
+        break;
+      }
+
       case 'h':
       case '?':
         print_console_usage();
@@ -118,9 +359,13 @@ void *console_thread(void *arg)
 }
 void usage(char *argv[])
 {
-  printf("Usage: %s [-s server_ip] [-p port]\n", argv[0]);
+  printf("Usage: %s [-s server_ip] [-p port] [-l file] [-w window_us] [-b percent]\n", argv[0]);
   printf("  -s server_ip :   The IP address of the xscope server (default %s)\n", DEFAULT_SERVER_IP);
   printf("  -p port      :   The port of the xscope server (default %s)\n", DEFAULT_PORT);
+  printf("  -l file      :   Log the counts and frame size distribution of each interface every second as CSV\n");
+  printf("  -w window_us :   The window of the peak (burst) utilisation, %u to %u us (default %u)\n",
+      BURST_WINDOW_MIN_US, BURST_WINDOW_MAX_US, BURST_WINDOW_DEFAULT_US);
+  printf("  -b percent   :   Raise a microburst alarm when the peak utilisation reaches this (default none)\n");
   exit(1);
 }
 
@@ -137,7 +382,7 @@ int main(int argc, char *argv[])
   int sockfds[1] = {0};
   int c = 0;
 
-  while ((c = getopt(argc, argv, "s:p:")) != -1) {
+  while ((c = getopt(argc, argv, "s:p:l:w:b:")) != -1) {
     switch (c) {
       case 's':
         server_ip = optarg;
@@ -145,6 +390,23 @@ int main(int argc, char *argv[])
       case 'p':
         port_str = optarg;
         break;
+      case 'l':
+        g_size_log = fopen(optarg, "w");
+        if (!g_size_log) {
+          fprintf(stderr, "Unable to open '%s'\n", optarg);
+          err++;
+        }
+        break;
+      case 'w':
+        g_burst_window_us = atoi(optarg);
+        if (g_burst_window_us < BURST_WINDOW_MIN_US || g_burst_window_us > BURST_WINDOW_MAX_US) {
+          fprintf(stderr, "The window must be %u to %u us\n", BURST_WINDOW_MIN_US, BURST_WINDOW_MAX_US);
+          err++;
+        }
+        break;
+      case 'b':
+        g_burst_alarm_percent = atof(optarg);
+        break;
       case ':': /* -f or -o without operand */
         fprintf(stderr, "Option -%c requires an operand\n", optopt);
         err++;
@@ -161,9 +423,19 @@ int main(int argc, char *argv[])
     usage(argv);
 
   sockfds[0] = initialise_socket(server_ip, port_str);
+  if (g_burst_window_us != BURST_WINDOW_DEFAULT_US)
+    send_burst_window(sockfds[0], g_burst_window_us);
+
+  if (g_size_log) {
+    int i;
+    fprintf(g_size_log, "time,interface,packets,bytes,drops");
+    for (i = 0; i < FRAME_SIZE_BINS; i++)
+      fprintf(g_size_log, ",%s", g_size_bin_names[i]);
+    fprintf(g_size_log, "\n");
+  }
 
-  printf("|                 UP                     ||                  DOWN                  |\n");
-  printf("| Packets | Bytes    | Mb/s   | %% util   || Packets | Bytes    | Mb/s   | %% util   |\n");
+  printf("|                           UP                               ||                          DOWN                              |\n");
+  printf("| Packets | Bytes    | Mb/s   | %% util   | %% peak   | Drops  || Packets | Bytes    | Mb/s   | %% util   | %% peak   | Drops  |\n");
 
   // Now start the console
 #ifdef _WIN32
@@ -0,0 +1,343 @@
+/*
+ * Extract a time window, or the frames of one interface, from a capture
+ * written by pcapng_listener. The index written with pcapng_listener -x (see
+ * pcapng_index.h) is used to find the part of the capture to read so only
+ * that part is touched. Without an index the whole capture is scanned.
+ *
+ *  ./pcapng_extract -s 1700000000.25 -e 1700000000.5 cap.pcapng window.pcapng
+ *  ./pcapng_extract -r -s 3600 -e 3601 -i 1 cap.pcapng window.pcapng
+ *
+ * Without an output file the matching frames are only counted.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcapng.h"
+#include "pcapng_index.h"
+
+// Timestamps are in 10ns ticks
+#define TICKS_PER_SECOND 100000000ull
+
+#define ALL_INTERFACES   -1
+
+typedef struct mapped_file_t {
+  const uint8_t *data;
+  size_t size;
+} mapped_file_t;
+
+static int map_file(const char *filename, mapped_file_t *file)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  file->size = st.st_size;
+  file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return file->data != MAP_FAILED;
+}
+
+static uint32_t read32(const mapped_file_t *file, size_t offset)
+{
+  uint32_t value;
+  memcpy(&value, file->data + offset, sizeof(value));
+  return value;
+}
+
+/*
+ * The length of the block at the offset, or 0 if it is not a valid block.
+ */
+static size_t block_length(const mapped_file_t *file, size_t offset)
+{
+  uint32_t length;
+
+  if (file->size - offset < 12)
+    return 0;
+  length = read32(file, offset + 4);
+  if (length < 12 || (length % 4) || length > file->size - offset)
+    return 0;
+  return length;
+}
+
+static int is_timestamped(uint32_t block_type)
+{
+  return block_type == PCAPNG_BLOCK_ENHANCED_PACKET || block_type == PCAPNG_BLOCK_INTERFACE_STATISTICS;
+}
+
+static uint64_t block_timestamp(const mapped_file_t *file, size_t offset)
+{
+  return ((uint64_t)read32(file, offset + 12) << 32) | read32(file, offset + 16);
+}
+
+/*
+ * Parse seconds with up to 8 decimal places into 10ns ticks. Doubles don't
+ * hold enough digits for absolute times at this resolution.
+ */
+static int parse_time(const char *str, uint64_t *ticks)
+{
+  char *end;
+  uint64_t fraction = 0;
+  uint64_t scale = TICKS_PER_SECOND;
+
+  *ticks = strtoull(str, &end, 10) * TICKS_PER_SECOND;
+  if (*end == '.') {
+    for (end++; *end >= '0' && *end <= '9'; end++) {
+      if (scale > 1) {
+        scale /= 10;
+        fraction += (*end - '0') * scale;
+      }
+    }
+  }
+  *ticks += fraction;
+  return *end == '\0' && end != str;
+}
+
+/*
+ * The if_tsoffset of the first interface, for captures without an index.
+ */
+static uint64_t find_tsoffset(const mapped_file_t *file, size_t header_end)
+{
+  size_t offset = 0;
+
+  while (offset < header_end) {
+    size_t length = block_length(file, offset);
+    if (read32(file, offset) == PCAPNG_BLOCK_INTERFACE_DESCRIPTION) {
+      size_t option = offset + 16;
+      while (option + 4 <= offset + length - 4) {
+        uint32_t word = read32(file, option);
+        uint16_t code = word & 0xffff;
+        uint16_t option_length = word >> 16;
+        if (code == PCAPNG_OPTION_END_OF_OPT)
+          break;
+        if (code == PCAPNG_OPTION_IF_TSOFFSET && option_length == 8)
+          return ((uint64_t)read32(file, option + 8) << 32) | read32(file, option + 4);
+        option += 4 + ((option_length + 3) & ~3);
+      }
+      return 0;
+    }
+    offset += length;
+  }
+  return 0;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - start->tv_sec) * 1000.0) + ((now.tv_nsec - start->tv_nsec) / 1000000.0);
+}
+
+static void usage(char *argv[])
+{
+  printf("Usage: %s [-s start] [-e end] [-r] [-i interface] file [output]\n", argv[0]);
+  printf("  -s start     :   Start of the window in seconds (default the start of the capture)\n");
+  printf("  -e end       :   End of the window in seconds (default the end of the capture)\n");
+  printf("  -r           :   The times are from the first frame rather than Unix times\n");
+  printf("  -i interface :   Only extract the frames of this interface\n");
+  printf("  file         :   The capture, with its index in file%s if there is one\n", PCAPNG_INDEX_SUFFIX);
+  printf("  output       :   The pcapng file to write, the frames are only counted if not given\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char index_name[FILENAME_MAX];
+  mapped_file_t capture, index;
+  const pcapng_index_header_t *header = NULL;
+  const pcapng_index_entry_t *entries = NULL;
+  size_t num_entries = 0;
+  uint32_t num_interfaces = 0;
+  uint64_t start_ticks = 0, end_ticks = UINT64_MAX;
+  uint64_t tsoffset_ticks, first_timestamp = UINT64_MAX;
+  int have_end = 0, relative = 0;
+  int interface_id = ALL_INTERFACES;
+  size_t header_end = 0, scan_start, scan_end, offset;
+  unsigned long frames = 0;
+  struct timespec start_time;
+  FILE *out = NULL;
+  int c;
+  uint32_t i;
+
+  while ((c = getopt(argc, argv, "s:e:ri:")) != -1) {
+    switch (c) {
+      case 's':
+        if (!parse_time(optarg, &start_ticks))
+          usage(argv);
+        break;
+      case 'e':
+        if (!parse_time(optarg, &end_ticks))
+          usage(argv);
+        have_end = 1;
+        break;
+      case 'r':
+        relative = 1;
+        break;
+      case 'i':
+        interface_id = atoi(optarg);
+        break;
+      default:
+        usage(argv);
+    }
+  }
+  if (optind == argc || argc - optind > 2)
+    usage(argv);
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  if (!map_file(argv[optind], &capture)) {
+    fprintf(stderr, "ERROR: unable to read '%s'\n", argv[optind]);
+    exit(1);
+  }
+
+  // The section header and interface descriptions are copied to the output
+  while (header_end < capture.size && !is_timestamped(read32(&capture, header_end))) {
+    size_t length = block_length(&capture, header_end);
+    if (!length) {
+      fprintf(stderr, "ERROR: invalid block at offset %zu (not a pcapng file from the tap?)\n", header_end);
+      exit(1);
+    }
+    header_end += length;
+  }
+
+  snprintf(index_name, sizeof(index_name), "%s%s", argv[optind], PCAPNG_INDEX_SUFFIX);
+  if (map_file(index_name, &index) && index.size >= sizeof(pcapng_index_header_t)) {
+    header = (const pcapng_index_header_t *)index.data;
+    if (header->magic != PCAPNG_INDEX_MAGIC || header->version != PCAPNG_INDEX_VERSION) {
+      fprintf(stderr, "ERROR: '%s' is not an index of a supported version\n", index_name);
+      exit(1);
+    }
+    entries = (const pcapng_index_entry_t *)(header + 1);
+    num_entries = (index.size - sizeof(*header)) / sizeof(pcapng_index_entry_t);
+    for (offset = 0; offset < num_entries; offset++) {
+      if (entries[offset].interface_id >= num_interfaces)
+        num_interfaces = entries[offset].interface_id + 1;
+    }
+  } else {
+    fprintf(stderr, "No index found, scanning the whole capture\n");
+  }
+
+  tsoffset_ticks = (header ? header->tsoffset_seconds : find_tsoffset(&capture, header_end)) * TICKS_PER_SECOND;
+
+  if (relative) {
+    if (entries) {
+      for (offset = 0; offset < num_entries; offset++) {
+        if (entries[offset].timestamp < first_timestamp)
+          first_timestamp = entries[offset].timestamp;
+      }
+    } else if (header_end < capture.size) {
+      first_timestamp = block_timestamp(&capture, header_end);
+    }
+    if (first_timestamp == UINT64_MAX)
+      first_timestamp = 0;
+    start_ticks += first_timestamp;
+    if (have_end)
+      end_ticks += first_timestamp;
+  } else {
+    // Convert the Unix times to the timestamps in the file
+    start_ticks = (start_ticks > tsoffset_ticks) ? start_ticks - tsoffset_ticks : 0;
+    if (have_end)
+      end_ticks = (end_ticks > tsoffset_ticks) ? end_ticks - tsoffset_ticks : 0;
+  }
+
+  /*
+   * The records of each interface are in timestamp order, so the window of an
+   * interface starts in the last bucket that starts at or before the start of
+   * the window and ends before the first bucket that starts after its end.
+   */
+  scan_start = header_end;
+  scan_end = capture.size;
+  if (entries) {
+    int found = 0;
+    scan_start = capture.size;
+    scan_end = header_end;
+
+    // Captures from several taps have the interfaces of each of them
+    for (i = 0; i < num_interfaces; i++) {
+      size_t interface_start = 0, interface_end = capture.size;
+      int have_entries = 0;
+
+      if (interface_id != ALL_INTERFACES && (uint32_t)interface_id != i)
+        continue;
+
+      for (offset = 0; offset < num_entries; offset++) {
+        const pcapng_index_entry_t *entry = &entries[offset];
+        if (entry->interface_id != i)
+          continue;
+        if (!have_entries || entry->timestamp <= start_ticks)
+          interface_start = entry->offset;
+        have_entries = 1;
+        if (entry->timestamp > end_ticks) {
+          interface_end = entry->offset;
+          break;
+        }
+      }
+      if (!have_entries)
+        continue;
+
+      found = 1;
+      if (interface_start < scan_start)
+        scan_start = interface_start;
+      if (interface_end > scan_end)
+        scan_end = interface_end;
+    }
+
+    // Frames written after the index was last flushed are not in it
+    if (!found) {
+      scan_start = header_end;
+      scan_end = capture.size;
+    }
+  }
+
+  if (optind + 1 < argc) {
+    out = fopen(argv[optind + 1], "wb");
+    if (!out) {
+      fprintf(stderr, "ERROR: unable to open '%s'\n", argv[optind + 1]);
+      exit(1);
+    }
+    fwrite(capture.data, header_end, 1, out);
+  }
+
+  madvise((void *)(capture.data + (scan_start & ~(size_t)(sysconf(_SC_PAGESIZE) - 1))),
+      scan_end - (scan_start & ~(size_t)(sysconf(_SC_PAGESIZE) - 1)), MADV_SEQUENTIAL);
+
+  for (offset = scan_start; offset < scan_end; ) {
+    size_t length = block_length(&capture, offset);
+    uint32_t block_type;
+
+    if (!length) {
+      fprintf(stderr, "WARNING: invalid block at offset %zu, stopping\n", offset);
+      break;
+    }
+    block_type = read32(&capture, offset);
+    if (is_timestamped(block_type) &&
+        (interface_id == ALL_INTERFACES || read32(&capture, offset + 8) == (uint32_t)interface_id)) {
+      uint64_t timestamp = block_timestamp(&capture, offset);
+      if (timestamp >= start_ticks && timestamp <= end_ticks) {
+        if (out)
+          fwrite(capture.data + offset, length, 1, out);
+        if (block_type == PCAPNG_BLOCK_ENHANCED_PACKET)
+          frames++;
+      }
+    }
+    offset += length;
+  }
+
+  if (out)
+    fclose(out);
+
+  fprintf(stderr, "%lu frames, scanned %.1f MB of %.1f MB in %.1f ms\n", frames,
+      (scan_end - scan_start) / 1048576.0, capture.size / 1048576.0, elapsed_ms(&start_time));
+  return 0;
+}
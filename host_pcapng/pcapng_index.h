@@ -0,0 +1,34 @@
+/*
+ * The sidecar index written next to a capture by pcapng_listener -x and read
+ * by pcapng_extract. The index file is the capture file name with ".idx"
+ * added and holds a header followed by entries.
+ *
+ * The records of each interface are split into buckets by their timestamp and
+ * an entry is written for each bucket that has any records. The entries of an
+ * interface are in timestamp order, but the entries of different interfaces
+ * are interleaved in the order their buckets ended.
+ */
+#ifndef __PCAPNG_INDEX_H__
+#define __PCAPNG_INDEX_H__
+
+#include <stdint.h>
+
+#define PCAPNG_INDEX_MAGIC   0x58444e49   // "INDX"
+#define PCAPNG_INDEX_VERSION 1
+#define PCAPNG_INDEX_SUFFIX  ".idx"
+
+typedef struct pcapng_index_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t bucket_ticks;        // Width of the buckets in 10ns ticks
+  uint64_t tsoffset_seconds;    // The if_tsoffset of the interfaces in the capture
+} pcapng_index_header_t;
+
+typedef struct pcapng_index_entry_t {
+  uint64_t timestamp;           // Timestamp of the first record in the bucket
+  uint64_t offset;              // File offset of the first record in the bucket
+  uint32_t interface_id;
+  uint32_t records;             // Records of the interface in the bucket
+} pcapng_index_entry_t;
+
+#endif // __PCAPNG_INDEX_H__
@@ -0,0 +1,176 @@
+/*
+ * Measure the timestamp jitter of a capture of a fixed rate stream.
+ *
+ * The capture should contain frames of a fixed size sent at a fixed rate (e.g.
+ * back to back at line rate). The time between consecutive frames on each
+ * interface should then be constant, so any spread in it is jitter in the
+ * timestamps. A histogram of the deviation from the median is printed for each
+ * interface.
+ *
+ *  ./pcapng_jitter cap.pcapng
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "pcapng.h"
+
+// Timestamps are in 10ns ticks
+#define NS_PER_TICK 10
+
+// The histogram covers +/- this many ticks around the median
+#define HISTOGRAM_HALF_WIDTH 32
+#define HISTOGRAM_BINS ((2 * HISTOGRAM_HALF_WIDTH) + 1)
+
+// The largest block expected from the tap
+#define MAX_BLOCK_BYTES 4096
+
+typedef struct interface_deltas_t {
+  int have_last;
+  uint64_t last_time;
+  uint32_t last_len;
+  unsigned num_deltas;
+  unsigned max_deltas;
+  uint32_t *deltas;
+} interface_deltas_t;
+
+static interface_deltas_t g_interfaces[PCAPNG_NUM_INTERFACES];
+
+static void add_delta(interface_deltas_t *intf, uint32_t delta)
+{
+  if (intf->num_deltas == intf->max_deltas) {
+    intf->max_deltas = intf->max_deltas ? intf->max_deltas * 2 : 1024;
+    intf->deltas = realloc(intf->deltas, intf->max_deltas * sizeof(uint32_t));
+    if (!intf->deltas) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(1);
+    }
+  }
+  intf->deltas[intf->num_deltas++] = delta;
+}
+
+static void process_epb(const enhanced_packet_block_t *epb)
+{
+  interface_deltas_t *intf;
+  uint64_t time;
+
+  if (epb->interface_id >= PCAPNG_NUM_INTERFACES)
+    return;
+
+  intf = &g_interfaces[epb->interface_id];
+  time = ((uint64_t)epb->timestamp_high << 32) | epb->timestamp_low;
+
+  // Only frames the same size as the previous one follow at the stream rate
+  if (intf->have_last && epb->packet_len == intf->last_len && time > intf->last_time)
+    add_delta(intf, (uint32_t)(time - intf->last_time));
+
+  intf->have_last = 1;
+  intf->last_time = time;
+  intf->last_len = epb->packet_len;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void print_histogram(unsigned id, interface_deltas_t *intf)
+{
+  unsigned histogram[HISTOGRAM_BINS] = {0};
+  unsigned below = 0;
+  unsigned above = 0;
+  unsigned max_count = 0;
+  double sum_sq = 0;
+  uint32_t median;
+  unsigned i;
+
+  printf("Interface %u: ", id);
+  if (intf->num_deltas == 0) {
+    printf("no frames\n\n");
+    return;
+  }
+
+  qsort(intf->deltas, intf->num_deltas, sizeof(uint32_t), compare_u32);
+  median = intf->deltas[intf->num_deltas / 2];
+
+  for (i = 0; i < intf->num_deltas; i++) {
+    int deviation = (int)(intf->deltas[i] - median);
+    sum_sq += (double)deviation * deviation;
+    if (deviation < -HISTOGRAM_HALF_WIDTH)
+      below++;
+    else if (deviation > HISTOGRAM_HALF_WIDTH)
+      above++;
+    else
+      histogram[deviation + HISTOGRAM_HALF_WIDTH]++;
+  }
+
+  printf("%u intervals, median %u ns, min %d ns, max +%d ns, rms %.1f ns\n",
+      intf->num_deltas, median * NS_PER_TICK,
+      (int)(intf->deltas[0] - median) * NS_PER_TICK,
+      (int)(intf->deltas[intf->num_deltas - 1] - median) * NS_PER_TICK,
+      sqrt(sum_sq / intf->num_deltas) * NS_PER_TICK);
+
+  for (i = 0; i < HISTOGRAM_BINS; i++) {
+    if (histogram[i] > max_count)
+      max_count = histogram[i];
+  }
+
+  if (below)
+    printf("  < %5d ns %9u\n", -HISTOGRAM_HALF_WIDTH * NS_PER_TICK, below);
+  for (i = 0; i < HISTOGRAM_BINS; i++) {
+    unsigned bar = max_count ? (histogram[i] * 50 + max_count - 1) / max_count : 0;
+    if (!histogram[i])
+      continue;
+    printf("  %+7d ns %9u ", ((int)i - HISTOGRAM_HALF_WIDTH) * NS_PER_TICK, histogram[i]);
+    while (bar--)
+      putchar('#');
+    putchar('\n');
+  }
+  if (above)
+    printf("  > %+5d ns %9u\n", HISTOGRAM_HALF_WIDTH * NS_PER_TICK, above);
+  printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t block[MAX_BLOCK_BYTES / 4];
+  FILE *fptr;
+  unsigned i;
+
+  if (argc != 2) {
+    printf("Usage: %s file\n", argv[0]);
+    printf("  file         :   A pcapng capture of a fixed size, fixed rate stream\n");
+    exit(1);
+  }
+
+  fptr = fopen(argv[1], "rb");
+  if (!fptr) {
+    fprintf(stderr, "ERROR: unable to open '%s'\n", argv[1]);
+    exit(1);
+  }
+
+  // Walk the blocks using the Block Type and Block Total Length at their start
+  while (fread(block, 8, 1, fptr) == 1) {
+    uint32_t length = block[1];
+
+    if (length < 12 || length > sizeof(block) || (length % 4)) {
+      fprintf(stderr, "ERROR: invalid block length %u (not a pcapng file from the tap?)\n", length);
+      exit(1);
+    }
+    if (fread(&block[2], length - 8, 1, fptr) != 1)
+      break;
+
+    if (block[0] == PCAPNG_BLOCK_ENHANCED_PACKET)
+      process_epb((const enhanced_packet_block_t *)block);
+  }
+  fclose(fptr);
+
+  for (i = 0; i < PCAPNG_NUM_INTERFACES; i++)
+    print_histogram(i, &g_interfaces[i]);
+
+  return 0;
+}
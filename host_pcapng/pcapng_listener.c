@@ -7,59 +7,1055 @@
  *  ./pcapng_listener -s 127.0.0.1 -p 12346
  *
  */
+/*
+ * Includes for thread support
+ */
+#ifdef __linux__
+  #define _GNU_SOURCE   // fallocate()
+#endif
+#ifdef _WIN32
+  #include <winsock.h>
+#else
+  #include <pthread.h>
+  #include <sys/uio.h>
+  #include <time.h>
+  #include <fcntl.h>
+#endif
+
+#include <stddef.h>
+
 #include "xscope_host_shared.h"
 
 #include "pcapng.h"
+#include "pcapng_conf.h"
 #include "pcap.h"
+#include "filter.h"
+#include "pcapng_tap.h"
+#include "pcapng_index.h"
+#include "pcapng_shm.h"
 
 #define DEFAULT_FILE "cap.pcapng"
 
+// Timestamps from the device are in 10ns ticks
+#define TICKS_PER_SECOND     100000000ull
+#define NS_PER_TICK          10
+
+#define TIME_SYNC_EXCHANGES  8
+#define TIME_SYNC_TIMEOUT_MS 200
+
+#define DEFAULT_RING_MBYTES  16
+#define DEFAULT_FLUSH_MS     100
+#define DEFAULT_FLUSH_KBYTES 64
+#define DEFAULT_REORDER_MS   50
+#define DEFAULT_SHM_MBYTES   64
+
+// The taps that can be captured from at once
+#define MAX_DEVICES          8
+#define MAX_INTERFACES       (MAX_DEVICES * PCAPNG_NUM_INTERFACES)
+
+// The blocks of each device that can be held to put them in time order
+#define MERGE_QUEUE_BLOCKS   32768
+#define MERGE_BLOCK_WORDS    ((PCAPNG_EPB_OVERHEAD_BYTES + CAPTURE_BYTES + 3) / 4)
+
 FILE *g_pcap_fptr = NULL;
 
+/*
+ * The capture can be rotated through a ring of files, named after the file
+ * given with a sequence number added (e.g. cap_00003.pcapng). Each file starts
+ * with its own headers so it can be opened on its own.
+ */
+char *g_filename = DEFAULT_FILE;
+size_t g_rotate_bytes = 0;            // Start a new file once this size is reached (0 for no limit)
+unsigned g_rotate_seconds = 0;        // Start a new file after this long (0 for no limit)
+unsigned g_max_files = 0;             // Delete the oldest files beyond this many (0 keeps them all)
+
+unsigned g_file_index = 0;
+size_t g_file_bytes = 0;              // Bytes written to the current file
+int g_file_has_records = 0;
+unsigned long long g_file_start_ms = 0;
+char g_file_path[FILENAME_MAX];
+
+/*
+ * The sidecar index of the capture (see pcapng_index.h), written when -x is
+ * given. The entry of the bucket each interface is in is written out once the
+ * interface moves on to the next bucket.
+ */
+unsigned g_index_ms = 0;
+FILE *g_index_fptr = NULL;
+
+typedef struct index_bucket_t {
+  int active;
+  uint64_t bucket;
+  pcapng_index_entry_t entry;
+} index_bucket_t;
+
+index_bucket_t g_index_buckets[MAX_INTERFACES];
+
 // Indicate whether the output should be pcap or pcapng
 int g_libpcap_mode = 0;
 
+// The capture filter expression, NULL if all frames are captured
+char *g_filter_expr = NULL;
+
+// Indicate whether the device buffer occupancy should be printed
+int g_print_occupancy = 0;
+
+// The words of a buffers_ring_occupancy_t sent by the device for each interface
+enum {
+  OCCUPANCY_CAPACITY_BYTES = 0,
+  OCCUPANCY_BYTES,
+  OCCUPANCY_FRAMES,
+  OCCUPANCY_PEAK_BYTES,
+  OCCUPANCY_PEAK_FRAMES,
+  OCCUPANCY_NUM_WORDS
+};
+
+/*
+ * The socket thread must never block on the file, otherwise the xscope server
+ * drops data. The records are copied into a single-producer/single-consumer
+ * byte ring and written out by a separate writer thread in large batches. If
+ * the ring is full the record is dropped and counted.
+ */
+#ifdef _WIN32
+  #define memory_barrier() MemoryBarrier()
+#else
+  #define memory_barrier() __sync_synchronize()
+#endif
+
+typedef struct writer_ring_t {
+  unsigned char *data;
+  size_t size;                        // A power of 2
+  volatile size_t head;               // Bytes written since the start (socket thread)
+  volatile size_t tail;               // Bytes written to the file (writer thread)
+  volatile unsigned long records;     // Records queued (socket thread)
+  volatile unsigned long overflows;   // Records dropped as the ring was full (socket thread)
+  volatile size_t high_water;         // Peak bytes queued since the start (socket thread)
+  volatile size_t window_high_water;  // Peak bytes queued in the current stats window
+  volatile unsigned window;           // Stats window, advanced by the writer thread
+  unsigned seen_window;               // Last window seen by the socket thread
+  volatile int stop;
+} writer_ring_t;
+
+writer_ring_t g_ring;
+
+// Write out the ring once there is this much data or the interval has passed
+size_t g_flush_bytes = DEFAULT_FLUSH_KBYTES * 1024;
+unsigned g_flush_ms = DEFAULT_FLUSH_MS;
+
+// Indicate whether the writer throughput should be printed
+int g_print_throughput = 0;
+
+#ifndef _WIN32
+// The shared memory the blocks are also published to for live readers (-m)
+char *g_shm_name = NULL;
+pcapng_shm_t g_shm;
+#endif
+
+#ifdef _WIN32
+HANDLE g_writer_thread;
+HANDLE g_startup_thread;
+#else
+pthread_t g_writer_thread;
+pthread_t g_startup_thread;
+#endif
+
+/*
+ * The relation between the device timestamps and the host clock, measured when
+ * the capture starts. The absolute time of a device timestamp is:
+ *   (timestamp + residual_ticks of the device) * 10ns + g_tsoffset_seconds
+ * The whole seconds are written to the if_tsoffset option of the interfaces and
+ * the rest is added to the timestamps of the blocks, so no precision is lost.
+ * With several devices the seconds are those of the device with the smallest
+ * offset so that the timestamps of all the devices are on the same time base.
+ */
+uint64_t g_tsoffset_seconds = 0;
+
+// The frames are only written once the file headers have been written
+volatile int g_capturing = 0;
+
+/*
+ * With several devices the blocks are put in time order before they are
+ * written. Each device has a queue of its blocks sorted by timestamp (the
+ * blocks of a device are only slightly out of order as the device sends the
+ * oldest frame of its interfaces first) and the queues are merged by always
+ * writing the oldest of their heads. A block is written once it is older than
+ * the newest block of each active device by the reorder window, or once it
+ * has been held for that long, so the frames are held for a bounded time.
+ */
+typedef struct merge_block_t {
+  uint64_t timestamp;
+  unsigned long long arrival_ms;
+  uint32_t length;
+  uint32_t data[MERGE_BLOCK_WORDS];
+} merge_block_t;
+
+typedef struct merge_queue_t {
+  merge_block_t *blocks;              // MERGE_QUEUE_BLOCKS, sorted from head to tail
+  unsigned head;
+  unsigned tail;
+  uint64_t newest;                    // Newest timestamp received
+  unsigned long long last_arrival_ms; // Host time the last block was received
+} merge_queue_t;
+
+/*
+ * A tap being captured from. The interfaces of device d have the interface IDs
+ * from d * PCAPNG_NUM_INTERFACES in the capture.
+ */
+typedef struct device_t {
+  char *server_ip;
+  char *port_str;
+  int sockfd;
+
+  // Host ticks - device ticks, if the device replied to the time requests
+  int synced;
+  uint64_t offset_ticks;
+
+  // Added to the timestamps of the device
+  uint64_t residual_ticks;
+
+  // The last reply to a PCAPNG_TAP_GET_TIME request
+  volatile unsigned time_sequence;
+  volatile int time_received;
+  tap_time_t time_reply;
+  uint64_t time_reply_ns;
+
+  merge_queue_t queue;
+} device_t;
+
+device_t g_devices[MAX_DEVICES];
+unsigned g_num_devices = 0;
+
+unsigned g_reorder_ms = DEFAULT_REORDER_MS;
+
+static unsigned long long time_ms()
+{
+#ifdef _WIN32
+  return GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif
+}
+
+/*
+ * The host time in nanoseconds since the Unix epoch
+ */
+static uint64_t wall_time_ns()
+{
+#ifdef _WIN32
+  FILETIME ft;
+  uint64_t t;
+  GetSystemTimeAsFileTime(&ft);
+  // In 100ns units since 1601
+  t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+  return (t - 116444736000000000ull) * 100;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+#endif
+}
+
+static void sleep_ms(unsigned ms)
+{
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  usleep(ms * 1000);
+#endif
+}
+
+static int rotating()
+{
+  return g_rotate_bytes || g_rotate_seconds;
+}
+
+static size_t emit_file_headers(FILE *f);
+static size_t emit_pcapng_headers(FILE *f);
+
+static void index_open()
+{
+  char name[FILENAME_MAX + sizeof(PCAPNG_INDEX_SUFFIX)];
+  pcapng_index_header_t header = {
+    PCAPNG_INDEX_MAGIC,
+    PCAPNG_INDEX_VERSION,
+    (uint64_t)g_index_ms * (TICKS_PER_SECOND / 1000),
+    g_tsoffset_seconds
+  };
+
+  // Only pcapng files carry the interface of each frame
+  if (!g_index_ms || g_libpcap_mode)
+    return;
+
+  snprintf(name, sizeof(name), "%s%s", g_file_path, PCAPNG_INDEX_SUFFIX);
+  g_index_fptr = fopen(name, "wb");
+  if (!g_index_fptr) {
+    fprintf(stderr, "ERROR: unable to open '%s'\n", name);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, g_index_fptr);
+  memset(g_index_buckets, 0, sizeof(g_index_buckets));
+}
+
+static void index_close()
+{
+  int i;
+
+  if (!g_index_fptr)
+    return;
+
+  for (i = 0; i < MAX_INTERFACES; i++) {
+    if (g_index_buckets[i].active)
+      fwrite(&g_index_buckets[i].entry, sizeof(pcapng_index_entry_t), 1, g_index_fptr);
+  }
+  fclose(g_index_fptr);
+  g_index_fptr = NULL;
+}
+
+static void file_name(char *name, size_t size, unsigned index)
+{
+  const char *ext = strrchr(g_filename, '.');
+  const char *dir = strrchr(g_filename, '/');
+
+  if (!ext || (dir && ext < dir))
+    ext = g_filename + strlen(g_filename);
+  snprintf(name, size, "%.*s_%05u%s", (int)(ext - g_filename), g_filename, index, ext);
+}
+
+/*
+ * Open the next capture file. When rotating the space for the whole file is
+ * reserved up front so that it is contiguous on the disk and the disk filling
+ * up is found when the file is opened rather than part way through it.
+ */
+static void file_open()
+{
+  char name[FILENAME_MAX + sizeof(PCAPNG_INDEX_SUFFIX)];
+
+  if (rotating())
+    file_name(g_file_path, sizeof(g_file_path), g_file_index);
+  else
+    snprintf(g_file_path, sizeof(g_file_path), "%s", g_filename);
+
+  g_pcap_fptr = fopen(g_file_path, "wb");
+  if (!g_pcap_fptr) {
+    fprintf(stderr, "ERROR: unable to open '%s'\n", g_file_path);
+    exit(1);
+  }
+  g_file_bytes = 0;
+  g_file_has_records = 0;
+  g_file_start_ms = time_ms();
+
+#ifdef __linux__
+  if (g_rotate_bytes && fallocate(fileno(g_pcap_fptr), FALLOC_FL_KEEP_SIZE, 0, g_rotate_bytes) != 0 &&
+      errno != EOPNOTSUPP) {
+    fprintf(stderr, "ERROR: unable to allocate %u MB for '%s': %s\n",
+        (unsigned)(g_rotate_bytes >> 20), g_file_path, strerror(errno));
+    exit(1);
+  }
+#endif
+
+  if (rotating() && g_max_files && g_file_index >= g_max_files) {
+    file_name(name, sizeof(name), g_file_index - g_max_files);
+    remove(name);
+    strcat(name, PCAPNG_INDEX_SUFFIX);
+    remove(name);
+  }
+}
+
+static void file_close()
+{
+  index_close();
+  fflush(g_pcap_fptr);
+#ifdef __linux__
+  // Give back the space reserved beyond the end of the data
+  if (g_rotate_bytes && ftruncate(fileno(g_pcap_fptr), g_file_bytes) != 0)
+    perror("WARNING: unable to release the unused space of the file");
+#endif
+  fclose(g_pcap_fptr);
+}
+
+/*
+ * Write the headers to a newly opened file and start its index.
+ */
+static void file_start()
+{
+  g_file_bytes = emit_file_headers(g_pcap_fptr);
+  fflush(g_pcap_fptr);
+  index_open();
+}
+
+#ifndef _WIN32
+/*
+ * The live readers get a pcapng stream whatever the format of the file.
+ */
+static void shm_start()
+{
+  char headers[PCAPNG_SHM_HEADER_BYTES];
+  FILE *f = fmemopen(headers, sizeof(headers), "wb");
+  size_t length;
+
+  if (!f)
+    print_and_exit("ERROR: unable to write the shared memory headers\n");
+  length = emit_pcapng_headers(f);
+  fclose(f);
+  if (pcapng_shm_set_headers(&g_shm, headers, length))
+    print_and_exit("ERROR: too many interfaces for the shared memory headers\n");
+}
+#endif
+
+static void file_rotate()
+{
+  file_close();
+  g_file_index++;
+  file_open();
+  file_start();
+}
+
+static void writer_ring_init(writer_ring_t *ring, size_t size)
+{
+  memset(ring, 0, sizeof(*ring));
+  ring->size = size;
+  ring->data = malloc(size);
+  if (!ring->data) {
+    fprintf(stderr, "ERROR: unable to allocate %u MB for the writer ring\n", (unsigned)(size >> 20));
+    exit(1);
+  }
+}
+
+static void ring_copy_in(writer_ring_t *ring, size_t pos, const void *data, size_t len)
+{
+  size_t offset = pos & (ring->size - 1);
+  size_t first = (len < ring->size - offset) ? len : ring->size - offset;
+  memcpy(&ring->data[offset], data, first);
+  memcpy(&ring->data[0], (const unsigned char *)data + first, len - first);
+}
+
+/*
+ * Queue a record made of a header (may be empty) and data. Only called from
+ * the socket thread.
+ */
+static void writer_push(writer_ring_t *ring, const void *header, size_t header_len,
+    const void *data, size_t data_len)
+{
+  size_t head = ring->head;
+  size_t used = head - ring->tail;
+  size_t len = header_len + data_len;
+
+  if (len > ring->size - used) {
+    ring->overflows++;
+    return;
+  }
+
+  ring_copy_in(ring, head, header, header_len);
+  ring_copy_in(ring, head + header_len, data, data_len);
+
+  // The data must be in the ring before the writer can see the new head
+  memory_barrier();
+  ring->head = head + len;
+  ring->records++;
+
+  used += len;
+  if (ring->seen_window != ring->window) {
+    ring->seen_window = ring->window;
+    ring->window_high_water = 0;
+  }
+  if (used > ring->window_high_water)
+    ring->window_high_water = used;
+  if (used > ring->high_water)
+    ring->high_water = used;
+}
+
+/*
+ * Write out everything between the tail and the given head, in at most two
+ * parts as the data may wrap around the end of the ring.
+ */
+static void writer_write(writer_ring_t *ring, FILE *f, size_t head)
+{
+  size_t tail = ring->tail;
+  size_t offset = tail & (ring->size - 1);
+  size_t len = head - tail;
+  size_t first = (len < ring->size - offset) ? len : ring->size - offset;
+
+  if (!len)
+    return;
+
+#ifdef _WIN32
+  fwrite(&ring->data[offset], first, 1, f);
+  fwrite(&ring->data[0], len - first, 1, f);
+  fflush(f);
+#else
+  {
+    struct iovec iov[2];
+    int fd = fileno(f);
+    iov[0].iov_base = &ring->data[offset];
+    iov[0].iov_len = first;
+    iov[1].iov_base = &ring->data[0];
+    iov[1].iov_len = len - first;
+
+    while (iov[0].iov_len + iov[1].iov_len) {
+      ssize_t written = writev(fd, iov[0].iov_len ? &iov[0] : &iov[1], iov[0].iov_len ? 2 : 1);
+      if (written < 0) {
+        perror("ERROR: write failed");
+        exit(1);
+      }
+      if ((size_t)written >= iov[0].iov_len) {
+        written -= iov[0].iov_len;
+        iov[0].iov_len = 0;
+        iov[1].iov_base = (unsigned char *)iov[1].iov_base + written;
+        iov[1].iov_len -= written;
+      } else {
+        iov[0].iov_base = (unsigned char *)iov[0].iov_base + written;
+        iov[0].iov_len -= written;
+      }
+    }
+  }
+#endif
+
+  // The data must be written before the socket thread can overwrite it
+  memory_barrier();
+  ring->tail = head;
+}
+
+static uint32_t ring_read32(writer_ring_t *ring, size_t pos)
+{
+  uint32_t value = 0;
+  int i;
+  for (i = 3; i >= 0; i--)
+    value = (value << 8) | ring->data[(pos + i) & (ring->size - 1)];
+  return value;
+}
+
+/*
+ * The length of the record at the given position. A pcapng block holds its
+ * length in its second word and a libpcap record has a 16 byte header with
+ * the captured length in its third word.
+ */
+static size_t record_length(writer_ring_t *ring, size_t pos)
+{
+  if (g_libpcap_mode)
+    return sizeof(pcaprec_hdr_t) + ring_read32(ring, pos + 8);
+  return ring_read32(ring, pos + 4);
+}
+
+/*
+ * Add the packet and statistics blocks between the tail and the given end to
+ * the index. The tail is at the current end of the file.
+ */
+static void index_records(writer_ring_t *ring, size_t end)
+{
+  uint64_t bucket_ticks = (uint64_t)g_index_ms * (TICKS_PER_SECOND / 1000);
+  size_t pos = ring->tail;
+
+  if (!g_index_fptr)
+    return;
+
+  while (pos != end) {
+    size_t len = record_length(ring, pos);
+    uint32_t block_type = ring_read32(ring, pos);
+    uint32_t interface_id = ring_read32(ring, pos + 8);
+
+    if (len == 0 || len > end - pos)
+      return;
+
+    if ((block_type == PCAPNG_BLOCK_ENHANCED_PACKET || block_type == PCAPNG_BLOCK_INTERFACE_STATISTICS) &&
+        interface_id < MAX_INTERFACES) {
+      index_bucket_t *b = &g_index_buckets[interface_id];
+      uint64_t timestamp = ((uint64_t)ring_read32(ring, pos + 12) << 32) | ring_read32(ring, pos + 16);
+      uint64_t bucket = timestamp / bucket_ticks;
+
+      if (!b->active || bucket != b->bucket) {
+        if (b->active)
+          fwrite(&b->entry, sizeof(b->entry), 1, g_index_fptr);
+        b->active = 1;
+        b->bucket = bucket;
+        b->entry.timestamp = timestamp;
+        b->entry.offset = g_file_bytes + (pos - ring->tail);
+        b->entry.interface_id = interface_id;
+        b->entry.records = 0;
+      }
+      b->entry.records++;
+    }
+    pos += len;
+  }
+}
+
+/*
+ * Write out everything up to the given head, starting new files as needed
+ * when rotating. The files are only ever split between records.
+ */
+static void writer_output(writer_ring_t *ring, size_t head)
+{
+  while (ring->tail != head) {
+    size_t end = head;
+
+    if (g_file_has_records && g_rotate_seconds &&
+        (time_ms() - g_file_start_ms) >= (unsigned long long)g_rotate_seconds * 1000)
+      file_rotate();
+
+    if (g_rotate_bytes && g_file_bytes + (head - ring->tail) > g_rotate_bytes) {
+      // Find the last record that fits in the file
+      size_t pos = ring->tail;
+      while (pos != head) {
+        size_t len = record_length(ring, pos);
+        if (len == 0 || len > head - pos) {
+          pos = head;
+          break;
+        }
+        if (g_file_bytes + (pos + len - ring->tail) > g_rotate_bytes)
+          break;
+        pos += len;
+      }
+      end = pos;
+
+      if (end == ring->tail) {
+        if (g_file_has_records) {
+          file_rotate();
+          continue;
+        }
+        // A record larger than a whole file gets a file of its own
+        end = ring->tail + record_length(ring, ring->tail);
+        if (end == ring->tail || end - ring->tail > head - ring->tail)
+          end = head;
+      }
+    }
+
+    index_records(ring, end);
+    g_file_bytes += end - ring->tail;
+    g_file_has_records = 1;
+    writer_write(ring, g_pcap_fptr, end);
+  }
+
+  // Keep the index up to date with the file in case the listener is killed
+  if (g_index_fptr)
+    fflush(g_index_fptr);
+}
+
+static void print_throughput(writer_ring_t *ring, unsigned long records, unsigned long bytes,
+    unsigned long overflows)
+{
+  fprintf(stderr, "Writer: %lu records/s %.2f MB/s | queued %.2f MB, peak %.2f MB (%.2f MB since start) of %.2f MB | %lu dropped\n",
+      records, bytes / 1048576.0, (ring->head - ring->tail) / 1048576.0,
+      ring->window_high_water / 1048576.0, ring->high_water / 1048576.0,
+      ring->size / 1048576.0, overflows);
+
+#ifndef _WIN32
+  // How far behind each of the live readers is
+  if (g_shm_name) {
+    uint64_t write_pos = pcapng_shm_load(&g_shm.control->write_pos);
+    int i;
+    for (i = 0; i < PCAPNG_SHM_MAX_READERS; i++) {
+      pcapng_shm_reader_slot_t *slot = &g_shm.control->readers[i];
+      int32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+      if (pid)
+        fprintf(stderr, "Reader %d: lag %.2f MB | %llu overruns, %.2f MB lost\n", (int)pid,
+            (write_pos - pcapng_shm_load(&slot->cursor)) / 1048576.0,
+            (unsigned long long)slot->overruns, slot->lost_bytes / 1048576.0);
+    }
+  }
+#endif
+}
+
+#ifdef _WIN32
+DWORD WINAPI writer_thread(void *arg)
+#else
+void *writer_thread(void *arg)
+#endif
+{
+  writer_ring_t *ring = (writer_ring_t *)arg;
+  unsigned long long last_flush = time_ms();
+  unsigned long long last_stats = last_flush;
+  unsigned long last_records = 0;
+  unsigned long last_overflows = 0;
+  size_t last_head = 0;
+
+  while (!ring->stop) {
+    unsigned long long now = time_ms();
+    size_t head = ring->head;
+
+    if ((head - ring->tail) >= g_flush_bytes || (now - last_flush) >= g_flush_ms) {
+      memory_barrier();
+      writer_output(ring, head);
+      last_flush = now;
+    } else {
+      sleep_ms(1);
+    }
+
+    if (now - last_stats >= 1000) {
+      unsigned long records = ring->records;
+      unsigned long overflows = ring->overflows;
+      if (g_print_throughput)
+        print_throughput(ring, records - last_records, head - last_head, overflows - last_overflows);
+      last_records = records;
+      last_overflows = overflows;
+      last_head = head;
+      last_stats = now;
+      ring->window++;
+    }
+  }
+
+  // Write out everything queued before stopping
+  memory_barrier();
+  writer_output(ring, ring->head);
+
+#ifdef _WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+static void writer_start(writer_ring_t *ring)
+{
+#ifdef _WIN32
+  g_writer_thread = CreateThread(NULL, 0, writer_thread, ring, 0, NULL);
+  if (g_writer_thread == NULL) {
+    fprintf(stderr, "ERROR: Failed to create writer thread\n");
+    exit(1);
+  }
+#else
+  if (pthread_create(&g_writer_thread, NULL, &writer_thread, ring) != 0) {
+    fprintf(stderr, "ERROR: Failed to create writer thread\n");
+    exit(1);
+  }
+#endif
+}
+
+static void writer_stop(writer_ring_t *ring)
+{
+  if (!g_capturing)
+    return;
+
+  ring->stop = 1;
+#ifdef _WIN32
+  WaitForSingleObject(g_writer_thread, INFINITE);
+#else
+  pthread_join(g_writer_thread, NULL);
+#endif
+  if (ring->overflows)
+    fprintf(stderr, "Writer: %lu records dropped as the ring was full\n", ring->overflows);
+}
+
+/*
+ * Relate the device timestamps to the host clock. The device replies to each
+ * request with its current time, which is assumed to be half way through the
+ * round trip. The exchange with the shortest round trip is the most accurate.
+ * Returns 0 if the device did not reply.
+ */
+static int time_sync(device_t *device)
+{
+  uint64_t best_rtt = 0;
+  int64_t best_offset_ticks = 0;
+  unsigned int buffer[2];
+  int i;
+
+  for (i = 0; i < TIME_SYNC_EXCHANGES; i++) {
+    unsigned long long start = time_ms();
+    uint64_t t0;
+
+    device->time_received = 0;
+    device->time_sequence++;
+    buffer[0] = PCAPNG_TAP_GET_TIME;
+    buffer[1] = device->time_sequence;
+    t0 = wall_time_ns();
+    xscope_ep_request_upload(device->sockfd, sizeof(buffer), (unsigned char *)buffer);
+
+    while (!device->time_received && (time_ms() - start) < TIME_SYNC_TIMEOUT_MS)
+      sleep_ms(1);
+
+    if (device->time_received) {
+      uint64_t rtt = device->time_reply_ns - t0;
+      uint64_t device_ticks = ((uint64_t)device->time_reply.timestamp_high << 32) | device->time_reply.timestamp_low;
+      uint64_t host_ticks = (t0 + (rtt / 2)) / NS_PER_TICK;
+      if (!best_rtt || rtt < best_rtt) {
+        best_rtt = rtt;
+        best_offset_ticks = (int64_t)(host_ticks - device_ticks);
+      }
+    }
+  }
+
+  if (!best_rtt || best_offset_ticks < 0)
+    return 0;
+
+  device->synced = 1;
+  device->offset_ticks = best_offset_ticks;
+  fprintf(stderr, "Device %s:%s time correlated to within %.1f us\n",
+      device->server_ip, device->port_str, best_rtt / 2000.0);
+  return 1;
+}
+
+/*
+ * Put all the devices on the time base of the one with the smallest offset.
+ * Devices that did not reply are assumed to have started with that device.
+ */
+static void time_sync_devices()
+{
+  uint64_t base_ticks = 0;
+  int have_base = 0;
+  unsigned d;
+
+  for (d = 0; d < g_num_devices; d++) {
+    if (!time_sync(&g_devices[d])) {
+      fprintf(stderr, "WARNING: No reply to time request from %s:%s, timestamps are relative to the device start\n",
+          g_devices[d].server_ip, g_devices[d].port_str);
+    } else if (!have_base || g_devices[d].offset_ticks < base_ticks) {
+      base_ticks = g_devices[d].offset_ticks;
+      have_base = 1;
+    }
+  }
+
+  g_tsoffset_seconds = base_ticks / TICKS_PER_SECOND;
+  for (d = 0; d < g_num_devices; d++) {
+    device_t *device = &g_devices[d];
+    uint64_t offset_ticks = device->synced ? device->offset_ticks : base_ticks;
+    device->residual_ticks = offset_ticks - (g_tsoffset_seconds * TICKS_PER_SECOND);
+  }
+}
+
+static device_t *find_device(int sockfd)
+{
+  unsigned d;
+  for (d = 0; d < g_num_devices; d++) {
+    if (g_devices[d].sockfd == sockfd)
+      return &g_devices[d];
+  }
+  return &g_devices[0];
+}
+
+/*
+ * Write out a packet or statistics block. The header is the first five words
+ * of the block, with the timestamp and interface ID already converted to
+ * those of the capture.
+ */
+static void output_block(const uint32_t header[5], const void *rest, size_t rest_len)
+{
+  uint64_t timestamp = ((uint64_t)header[3] << 32) | header[4];
+
+#ifndef _WIN32
+  if (g_shm_name)
+    pcapng_shm_publish(&g_shm, header, 5 * sizeof(uint32_t), rest, rest_len);
+#endif
+
+  if (g_libpcap_mode) {
+    // Only packets can be represented in libpcap format (drop counts are lost)
+    const uint32_t *lengths = (const uint32_t *)rest;
+    if (header[0] != PCAPNG_BLOCK_ENHANCED_PACKET || rest_len < 8)
+      return;
+
+    // Time resolution in pcapng is 10ns, the pcap file is in nanoseconds
+    uint32_t ts_sec = (timestamp / TICKS_PER_SECOND) + g_tsoffset_seconds;
+    uint32_t ts_nsec = (timestamp % TICKS_PER_SECOND) * NS_PER_TICK;
+    pcaprec_hdr_t record = { ts_sec, ts_nsec, lengths[0], lengths[1] };
+    writer_push(&g_ring, &record, sizeof(record), &lengths[2], lengths[0]);
+  } else {
+    writer_push(&g_ring, header, 5 * sizeof(uint32_t), rest, rest_len);
+  }
+}
+
+static void merge_init(device_t *device)
+{
+  device->queue.blocks = malloc(MERGE_QUEUE_BLOCKS * sizeof(merge_block_t));
+  if (!device->queue.blocks) {
+    fprintf(stderr, "ERROR: unable to allocate the reorder buffer\n");
+    exit(1);
+  }
+}
+
+/*
+ * Write out the oldest block held if it can't be overtaken by a later one, or
+ * always if forced. Returns 0 if there was nothing to write.
+ */
+static int merge_release_one(int force)
+{
+  unsigned long long now = time_ms();
+  uint64_t window_ticks = (uint64_t)g_reorder_ms * (TICKS_PER_SECOND / 1000);
+  uint64_t watermark = UINT64_MAX;
+  merge_queue_t *oldest = NULL;
+  merge_block_t *block;
+  unsigned d;
+
+  for (d = 0; d < g_num_devices; d++) {
+    merge_queue_t *q = &g_devices[d].queue;
+    if (q->head != q->tail &&
+        (!oldest || q->blocks[q->head % MERGE_QUEUE_BLOCKS].timestamp <
+                    oldest->blocks[oldest->head % MERGE_QUEUE_BLOCKS].timestamp))
+      oldest = q;
+
+    // Devices that have gone quiet don't hold back the others
+    if (q->last_arrival_ms && (now - q->last_arrival_ms) < g_reorder_ms) {
+      uint64_t limit = (q->newest > window_ticks) ? q->newest - window_ticks : 0;
+      if (limit < watermark)
+        watermark = limit;
+    }
+  }
+  if (!oldest)
+    return 0;
+
+  block = &oldest->blocks[oldest->head % MERGE_QUEUE_BLOCKS];
+  if (!force && block->timestamp > watermark && (now - block->arrival_ms) < g_reorder_ms)
+    return 0;
+
+  output_block(block->data, &block->data[5], block->length - (5 * sizeof(uint32_t)));
+  oldest->head++;
+  return 1;
+}
+
+/*
+ * Add a block to the queue of its device, keeping the queue sorted.
+ */
+static void merge_add(device_t *device, const uint32_t header[5], const void *rest, size_t rest_len,
+    uint64_t timestamp)
+{
+  merge_queue_t *q = &device->queue;
+  unsigned long long now = time_ms();
+  unsigned pos;
+
+  if (5 * sizeof(uint32_t) + rest_len > MERGE_BLOCK_WORDS * sizeof(uint32_t)) {
+    output_block(header, rest, rest_len);
+    return;
+  }
+
+  // The buffer is bounded, when full the oldest block is written out
+  while (q->tail - q->head == MERGE_QUEUE_BLOCKS)
+    merge_release_one(1);
+
+  pos = q->tail++;
+  while (pos != q->head && q->blocks[(pos - 1) % MERGE_QUEUE_BLOCKS].timestamp > timestamp) {
+    q->blocks[pos % MERGE_QUEUE_BLOCKS] = q->blocks[(pos - 1) % MERGE_QUEUE_BLOCKS];
+    pos--;
+  }
+
+  merge_block_t *block = &q->blocks[pos % MERGE_QUEUE_BLOCKS];
+  block->timestamp = timestamp;
+  block->arrival_ms = now;
+  block->length = 5 * sizeof(uint32_t) + rest_len;
+  memcpy(block->data, header, 5 * sizeof(uint32_t));
+  memcpy(&block->data[5], rest, rest_len);
+
+  if (timestamp > q->newest)
+    q->newest = timestamp;
+  q->last_arrival_ms = now;
+}
+
 void hook_registration_received(int sockfd, int xscope_probe, char *name)
 {
   // Do nothing
+  (void)sockfd;
+  (void)xscope_probe;
+  (void)name;
 }
 
 void hook_data_received(int sockfd, int xscope_probe, void *data, int data_len)
 {
-  if (g_libpcap_mode) {
-    // Convert the pacpng data from the target to libpcap format
-    enhanced_packet_block_t *ehb = (enhanced_packet_block_t *) data;
-
-    // Time resolution in pcapng is 10ns
-    uint64_t packet_time = (((uint64_t)ehb->timestamp_high << 32) | ehb->timestamp_low) / 100;
-    uint32_t ts_sec = packet_time / 1000000;
-    uint32_t ts_usec = packet_time % 1000000;
-
-    pcaprec_hdr_t header = { ts_sec, ts_usec, ehb->captured_len, ehb->packet_len };
-    fwrite(&header, sizeof(header), 1, g_pcap_fptr);
-    fwrite(&ehb->data, ehb->captured_len, 1, g_pcap_fptr);
-    fflush(g_pcap_fptr);
-  } else {
-    // Emit the pcapng data
-    fwrite(data, data_len, 1, g_pcap_fptr);
+  device_t *device = find_device(sockfd);
+  unsigned device_index = device - g_devices;
+
+  if (xscope_probe == PCAPNG_PROBE_TIME) {
+    uint64_t now = wall_time_ns();
+    tap_time_t *time = (tap_time_t *) data;
+
+    if (data_len == sizeof(tap_time_t) && time->sequence == device->time_sequence) {
+      device->time_reply = *time;
+      device->time_reply_ns = now;
+      memory_barrier();
+      device->time_received = 1;
+    }
+    return;
+  }
+
+  if (xscope_probe == PCAPNG_PROBE_FILTER_COUNTS) {
+    pcapng_filter_counts_t *counts = (pcapng_filter_counts_t *) data;
+    int i;
+
+    if (!g_filter_expr || data_len != (PCAPNG_NUM_INTERFACES * sizeof(pcapng_filter_counts_t)))
+      return;
+
+    fprintf(stderr, "Filter:");
+    if (g_num_devices > 1)
+      fprintf(stderr, " %s:%s", device->server_ip, device->port_str);
+    for (i = 0; i < PCAPNG_NUM_INTERFACES; i++)
+      fprintf(stderr, " | if%d accepted %u rejected %u", i, counts[i].accepted, counts[i].rejected);
+    fprintf(stderr, "\n");
+    return;
+  }
+
+  if (xscope_probe == PCAPNG_PROBE_BUFFER_OCCUPANCY) {
+    uint32_t *occupancy = (uint32_t *) data;
+    int i;
+
+    // Every tap sends its occupancy every second, so the blocks held for
+    // reordering are written once old enough even when no frames arrive
+    if (g_capturing && g_num_devices > 1)
+      while (merge_release_one(0));
+
+    if (!g_print_occupancy || data_len != (PCAPNG_NUM_INTERFACES * OCCUPANCY_NUM_WORDS * sizeof(uint32_t)))
+      return;
+
+    fprintf(stderr, "Buffers:");
+    if (g_num_devices > 1)
+      fprintf(stderr, " %s:%s", device->server_ip, device->port_str);
+    for (i = 0; i < PCAPNG_NUM_INTERFACES; i++, occupancy += OCCUPANCY_NUM_WORDS) {
+      fprintf(stderr, " | if%d %u/%u bytes %u frames (peak %u bytes %u frames)", i,
+          occupancy[OCCUPANCY_BYTES], occupancy[OCCUPANCY_CAPACITY_BYTES], occupancy[OCCUPANCY_FRAMES],
+          occupancy[OCCUPANCY_PEAK_BYTES], occupancy[OCCUPANCY_PEAK_FRAMES]);
+    }
+    fprintf(stderr, "\n");
+    return;
   }
+
+  // Anything received before the file headers are written is discarded
+  if (!g_capturing)
+    return;
+
+  // Blocks held for reordering that are now old enough are written first
+  if (g_num_devices > 1)
+    while (merge_release_one(0));
+
+  enhanced_packet_block_t *ehb = (enhanced_packet_block_t *) data;
+  uint32_t header[5];
+
+  if (data_len < (int)sizeof(header) ||
+      (ehb->block_type != PCAPNG_BLOCK_ENHANCED_PACKET && ehb->block_type != PCAPNG_BLOCK_INTERFACE_STATISTICS)) {
+    if (!g_libpcap_mode)
+      writer_push(&g_ring, NULL, 0, data, data_len);
+    return;
+  }
+
+  // Move the packet and statistics blocks to the time base and interface IDs
+  // of the capture
+  uint64_t timestamp = (((uint64_t)ehb->timestamp_high << 32) | ehb->timestamp_low) + device->residual_ticks;
+  memcpy(header, data, sizeof(header));
+  header[2] += device_index * PCAPNG_NUM_INTERFACES;
+  header[3] = (uint32_t)(timestamp >> 32);
+  header[4] = (uint32_t)timestamp;
+
+  if (g_num_devices > 1)
+    merge_add(device, header, (unsigned char *)data + sizeof(header), data_len - sizeof(header), timestamp);
+  else
+    output_block(header, (unsigned char *)data + sizeof(header), data_len - sizeof(header));
 }
 
 void hook_exiting()
 {
-  fflush(g_pcap_fptr);
-  fclose(g_pcap_fptr);
+  if (g_capturing && g_num_devices > 1)
+    while (merge_release_one(1));
+  writer_stop(&g_ring);
+  file_close();
+#ifndef _WIN32
+  if (g_shm_name && g_shm.control)
+    pcapng_shm_destroy(&g_shm, g_shm_name);
+#endif
 }
 
 void emit_pcap_header(FILE *f)
 {
   pcap_hdr_t header = {
-    0xA1B2C3D4,             // Byte-Order Magic
+    PCAP_MAGIC_NANOSECONDS, // Byte-Order Magic
     0x2,                    // Major Version
     0x4,                    // Minor Version
     0x0,                    // Time zone (GMT)
     0x0,                    // Accuracy - simply set 0
-    CAPTURE_LENGTH,         // Snaplength
+    CAPTURE_BYTES,          // Snaplength
     DATA_LINK_ETHERNET,     // Data link type
   };
   fwrite(&header, sizeof(header), 1, f);
@@ -80,51 +1076,424 @@ void emit_pcapng_section_header_block(FILE *f)
   fwrite(&header, sizeof(header), 1, f);
 }
 
-void emit_pcapng_interface_description_block(FILE *f)
+/*
+ * Write the description of an interface of a device. With several devices the
+ * interfaces are named after the device they were captured on. Returns the
+ * bytes written.
+ */
+size_t emit_pcapng_interface_description_block(FILE *f, const device_t *device, unsigned interface)
 {
   interface_description_block_t iface = {
     0x1,                                    // Block Type
     sizeof(interface_description_block_t),  // Block Total Length
     0x1,                                    // LinkType
     0x0,                                    // Reserved
-    CAPTURE_LENGTH,                         // SnapLen
+    CAPTURE_BYTES,                          // SnapLen
     // Options
-    { 0x09, 0x01, 0x08 },                       // if_tsresol (10^-8)
+    { PCAPNG_OPTION_IF_TSRESOL, 1, 8,       // if_tsresol (10^-8)
+      { 0, 0, 0 } },
+    { PCAPNG_OPTION_IF_TSOFFSET, 8,         // if_tsoffset (seconds)
+      (uint32_t)g_tsoffset_seconds, (uint32_t)(g_tsoffset_seconds >> 32) },
+    PCAPNG_OPTION_END_OF_OPT, 0,
     sizeof(interface_description_block_t)   // Block Total Length
   };
-  fwrite(&iface, sizeof(iface), 1, f);
+  char name[64];
+  uint16_t option[2];
+  uint32_t padding = 0;
+  uint32_t length;
+  size_t name_len, name_words;
+
+  if (g_num_devices == 1) {
+    fwrite(&iface, sizeof(iface), 1, f);
+    return sizeof(iface);
+  }
+
+  // Insert an if_name option before the end of the options
+  name_len = snprintf(name, sizeof(name), "%s:%s if%u", device->server_ip, device->port_str, interface);
+  if (name_len >= sizeof(name))
+    name_len = sizeof(name) - 1;
+  name_words = (name_len + 3) / 4;
+  length = sizeof(iface) + 4 + (name_words * 4);
+  iface.block_total_len_pre = length;
+  iface.block_total_len_post = length;
+
+  option[0] = PCAPNG_OPTION_IF_NAME;
+  option[1] = name_len;
+  fwrite(&iface, offsetof(interface_description_block_t, end_of_opt_code), 1, f);
+  fwrite(option, sizeof(option), 1, f);
+  fwrite(name, name_len, 1, f);
+  fwrite(&padding, (name_words * 4) - name_len, 1, f);
+  fwrite(&iface.end_of_opt_code, sizeof(iface) - offsetof(interface_description_block_t, end_of_opt_code), 1, f);
+  return length;
+}
+
+/*
+ * Write the headers at the start of each file. Returns the bytes written.
+ */
+static size_t emit_file_headers(FILE *f)
+{
+  if (g_libpcap_mode) {
+    // Emit libpcap common header
+    emit_pcap_header(f);
+    return sizeof(pcap_hdr_t);
+  }
+
+  return emit_pcapng_headers(f);
+}
+
+/*
+ * Write the section header and the interface descriptions of each tap.
+ * Returns the bytes written.
+ */
+static size_t emit_pcapng_headers(FILE *f)
+{
+  size_t bytes = sizeof(section_block_header_t);
+  unsigned d, i;
+  emit_pcapng_section_header_block(f);
+  for (d = 0; d < g_num_devices; d++) {
+    for (i = 0; i < PCAPNG_NUM_INTERFACES; i++)
+      bytes += emit_pcapng_interface_description_block(f, &g_devices[d], i);
+  }
+  return bytes;
+}
+
+/*
+ * The filter compiler. An expression is a list of terms joined by 'and' and
+ * 'or' where 'and' binds tighter than 'or'. A missing operator means 'and'.
+ * The supported terms are:
+ *
+ *   vlan <id>
+ *   ether proto <type>
+ *   ether src|dst|host <mac>
+ *   ip proto <protocol>
+ *   tcp | udp
+ *   [src|dst] port <port>
+ *
+ * Each 'and' clause is compiled into a sequence of instructions that jump to
+ * the start of the next clause on a mismatch and end in an accept.
+ */
+#define FILTER_CLAUSE_FAIL -1
+
+typedef struct filter_compiler_t {
+  pcapng_filter_program_t program;
+  int jt[PCAPNG_FILTER_MAX_INSNS];  // Absolute jump targets
+  int jf[PCAPNG_FILTER_MAX_INSNS];
+  int clause_start;
+} filter_compiler_t;
+
+static int filter_emit(filter_compiler_t *fc, int op, uint32_t value, int jt, int jf)
+{
+  int i = fc->program.num_insns;
+
+  // Always leave room for the final reject
+  if (i >= PCAPNG_FILTER_MAX_INSNS - 1) {
+    fprintf(stderr, "ERROR: filter too long (maximum %d instructions)\n", PCAPNG_FILTER_MAX_INSNS);
+    return 1;
+  }
+  fc->program.insns[i].op = op;
+  fc->program.insns[i].value = value;
+  fc->jt[i] = jt;
+  fc->jf[i] = jf;
+  fc->program.num_insns++;
+  return 0;
+}
+
+static int filter_end_clause(filter_compiler_t *fc)
+{
+  int i;
+  if (filter_emit(fc, PCAPNG_FILTER_OP_RET_ACCEPT, 0, 0, 0))
+    return 1;
+
+  for (i = fc->clause_start; i < (int)fc->program.num_insns; i++) {
+    if (fc->jt[i] == FILTER_CLAUSE_FAIL)
+      fc->jt[i] = fc->program.num_insns;
+    if (fc->jf[i] == FILTER_CLAUSE_FAIL)
+      fc->jf[i] = fc->program.num_insns;
+  }
+  fc->clause_start = fc->program.num_insns;
+  return 0;
+}
+
+static int filter_parse_number(const char *token, uint32_t *value)
+{
+  char *end = NULL;
+  if (!token)
+    return 1;
+  *value = strtoul(token, &end, 0);
+  return (*end != '\0');
+}
+
+static int filter_parse_mac(const char *token, uint32_t *hi, uint32_t *lo)
+{
+  unsigned int b[6];
+  if (!token || sscanf(token, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+    return 1;
+  *hi = (b[0] << 8) | b[1];
+  *lo = (b[2] << 24) | (b[3] << 16) | (b[4] << 8) | b[5];
+  return 0;
+}
+
+static int filter_compile(char *expr, pcapng_filter_program_t *program)
+{
+  filter_compiler_t fc;
+  char *token = NULL;
+  int i;
+
+  memset(&fc, 0, sizeof(fc));
+
+  for (token = strtok(expr, " \t"); token; token = strtok(NULL, " \t")) {
+    int n = fc.program.num_insns;
+    int err = 0;
+    uint32_t value = 0;
+    uint32_t hi = 0;
+
+    if (strcmp(token, "and") == 0) {
+      continue;
+
+    } else if (strcmp(token, "or") == 0) {
+      err = filter_end_clause(&fc);
+
+    } else if (strcmp(token, "vlan") == 0) {
+      err = filter_parse_number(strtok(NULL, " \t"), &value) ||
+            filter_emit(&fc, PCAPNG_FILTER_OP_VLAN_ID, value, n + 1, FILTER_CLAUSE_FAIL);
+
+    } else if (strcmp(token, "ether") == 0) {
+      char *kind = strtok(NULL, " \t");
+      char *arg = strtok(NULL, " \t");
+      if (kind && strcmp(kind, "proto") == 0) {
+        err = filter_parse_number(arg, &value) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_ETHERTYPE, value, n + 1, FILTER_CLAUSE_FAIL);
+      } else if (kind && strcmp(kind, "src") == 0) {
+        err = filter_parse_mac(arg, &hi, &value) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_SRC_MAC_HI, hi, n + 1, FILTER_CLAUSE_FAIL) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_SRC_MAC_LO, value, n + 2, FILTER_CLAUSE_FAIL);
+      } else if (kind && strcmp(kind, "dst") == 0) {
+        err = filter_parse_mac(arg, &hi, &value) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_DST_MAC_HI, hi, n + 1, FILTER_CLAUSE_FAIL) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_DST_MAC_LO, value, n + 2, FILTER_CLAUSE_FAIL);
+      } else if (kind && strcmp(kind, "host") == 0) {
+        err = filter_parse_mac(arg, &hi, &value) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_SRC_MAC_HI, hi, n + 1, n + 2) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_SRC_MAC_LO, value, n + 4, n + 2) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_DST_MAC_HI, hi, n + 3, FILTER_CLAUSE_FAIL) ||
+              filter_emit(&fc, PCAPNG_FILTER_OP_DST_MAC_LO, value, n + 4, FILTER_CLAUSE_FAIL);
+      } else {
+        err = 1;
+      }
+
+    } else if (strcmp(token, "ip") == 0) {
+      char *kind = strtok(NULL, " \t");
+      err = !kind || strcmp(kind, "proto") != 0 ||
+            filter_parse_number(strtok(NULL, " \t"), &value) ||
+            filter_emit(&fc, PCAPNG_FILTER_OP_IP_PROTO, value, n + 1, FILTER_CLAUSE_FAIL);
+
+    } else if (strcmp(token, "tcp") == 0 || strcmp(token, "udp") == 0) {
+      value = (token[0] == 't') ? 6 : 17;
+      err = filter_emit(&fc, PCAPNG_FILTER_OP_IP_PROTO, value, n + 1, FILTER_CLAUSE_FAIL);
+
+    } else if (strcmp(token, "src") == 0 || strcmp(token, "dst") == 0) {
+      int op = (token[0] == 's') ? PCAPNG_FILTER_OP_SRC_PORT : PCAPNG_FILTER_OP_DST_PORT;
+      char *kind = strtok(NULL, " \t");
+      err = !kind || strcmp(kind, "port") != 0 ||
+            filter_parse_number(strtok(NULL, " \t"), &value) ||
+            filter_emit(&fc, op, value, n + 1, FILTER_CLAUSE_FAIL);
+
+    } else if (strcmp(token, "port") == 0) {
+      err = filter_parse_number(strtok(NULL, " \t"), &value) ||
+            filter_emit(&fc, PCAPNG_FILTER_OP_SRC_PORT, value, n + 2, n + 1) ||
+            filter_emit(&fc, PCAPNG_FILTER_OP_DST_PORT, value, n + 2, FILTER_CLAUSE_FAIL);
+
+    } else {
+      err = 1;
+    }
+
+    if (err) {
+      fprintf(stderr, "ERROR: unable to parse filter at '%s'\n", token);
+      return 1;
+    }
+  }
+
+  if (filter_end_clause(&fc))
+    return 1;
+
+  // The final instruction is always there, so the filter_emit() check is not needed
+  i = fc.program.num_insns++;
+  fc.program.insns[i].op = PCAPNG_FILTER_OP_RET_REJECT;
+
+  // Convert the jumps to be relative to the following instruction
+  for (i = 0; i < (int)fc.program.num_insns; i++) {
+    int op = fc.program.insns[i].op;
+    if (op == PCAPNG_FILTER_OP_RET_ACCEPT || op == PCAPNG_FILTER_OP_RET_REJECT)
+      continue;
+    fc.program.insns[i].jt = fc.jt[i] - (i + 1);
+    fc.program.insns[i].jf = fc.jf[i] - (i + 1);
+  }
+
+  *program = fc.program;
+  return 0;
+}
+
+void upload_filter(int sockfd, char *expr)
+{
+  uint32_t buffer[1 + PCAPNG_FILTER_PROGRAM_WORDS];
+  pcapng_filter_program_t *program = (pcapng_filter_program_t *) &buffer[1];
+  char *expr_copy = strdup(expr);
+  int num_bytes = 0;
+
+  if (filter_compile(expr_copy, program)) {
+    fprintf(stderr, "ERROR: Failed to compile filter '%s'\n", expr);
+    exit(1);
+  }
+  free(expr_copy);
+
+  buffer[0] = PCAPNG_TAP_SET_FILTER;
+  num_bytes = 8 + (program->num_insns * sizeof(pcapng_filter_insn_t));
+  xscope_ep_request_upload(sockfd, num_bytes, (unsigned char *)buffer);
+}
+
+/*
+ * Relate the device times to the host clock and then write the file headers
+ * (which include the time offset) and start capturing.
+ */
+#ifdef _WIN32
+DWORD WINAPI startup_thread(void *arg)
+#else
+void *startup_thread(void *arg)
+#endif
+{
+  (void)arg;
+  time_sync_devices();
+
+  file_start();
+#ifndef _WIN32
+  if (g_shm_name)
+    shm_start();
+#endif
+
+  writer_start(&g_ring);
+  memory_barrier();
+  g_capturing = 1;
+
+#ifdef _WIN32
+  return 0;
+#else
+  return NULL;
+#endif
 }
 
 void usage(char *argv[])
 {
-  printf("Usage: %s [-s server_ip] [-p port] [-l] [file]\n", argv[0]);
+  printf("Usage: %s [-s server_ip] [-p port] [-M ms] [-l] [-b] [-t] [-f filter] [-R mbytes] [-F kbytes] [-I ms] [-C mbytes] [-G seconds] [-W files] [-m name] [-S mbytes] [-x ms] [file]\n", argv[0]);
   printf("  -s server_ip :   The IP address of the xscope server (default %s)\n", DEFAULT_SERVER_IP);
   printf("  -p port      :   The port of the xscope server (default %s)\n", DEFAULT_PORT);
+  printf("                   -s and -p can be repeated to capture from up to %d taps into one file\n", MAX_DEVICES);
+  printf("  -M ms        :   With several taps, hold frames this long to put them in time order (default %d)\n", DEFAULT_REORDER_MS);
   printf("  -l           :   Emit libpcap format instead of pcapng\n");
+  printf("  -b           :   Print the device buffer occupancy once a second\n");
+  printf("  -t           :   Print the throughput of the file writer once a second\n");
+  printf("  -R mbytes    :   Size of the ring buffering data for the file writer (default %d)\n", DEFAULT_RING_MBYTES);
+  printf("  -F kbytes    :   Write to the file once this much data is buffered (default %d)\n", DEFAULT_FLUSH_KBYTES);
+  printf("  -I ms        :   Write to the file at least this often (default %d)\n", DEFAULT_FLUSH_MS);
+  printf("  -C mbytes    :   Start a new file once the file reaches this size\n");
+  printf("  -G seconds   :   Start a new file after this many seconds\n");
+  printf("  -W files     :   When rotating files with -C or -G only keep this many, deleting the oldest\n");
+  printf("  -m name      :   Also publish the capture to POSIX shared memory for live readers (see pcapng_shm.h)\n");
+  printf("  -S mbytes    :   Size of the shared memory ring (default %d)\n", DEFAULT_SHM_MBYTES);
+  printf("  -x ms        :   Write an index of the capture with buckets of this many ms to <file>%s\n", PCAPNG_INDEX_SUFFIX);
+  printf("  -f filter    :   Only capture frames matching the filter, e.g. 'vlan 2 and udp port 319'\n");
   printf("  file         :   File name packets are written to (default '%s')\n", DEFAULT_FILE);
   exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-  char *server_ip = DEFAULT_SERVER_IP;
-  char *port_str = DEFAULT_PORT;
-  char *filename = DEFAULT_FILE;
+  char *server_ips[MAX_DEVICES];
+  char *port_strs[MAX_DEVICES];
+  unsigned num_server_ips = 0;
+  unsigned num_port_strs = 0;
   int err = 0;
-  int sockfds[1] = {0};
+  int filename_given = 0;
+  int sockfds[MAX_DEVICES] = {0};
   int c = 0;
+  unsigned d;
+  unsigned ring_mbytes = DEFAULT_RING_MBYTES;
+  unsigned shm_mbytes = DEFAULT_SHM_MBYTES;
 
-  while ((c = getopt(argc, argv, "ls:p:")) != -1) {
+  while ((c = getopt(argc, argv, "lbts:p:M:f:R:F:I:C:G:W:m:S:x:")) != -1) {
     switch (c) {
       case 's':
-        server_ip = optarg;
+        if (num_server_ips == MAX_DEVICES) {
+          fprintf(stderr, "At most %d taps can be captured from\n", MAX_DEVICES);
+          err++;
+        } else {
+          server_ips[num_server_ips++] = optarg;
+        }
         break;
       case 'p':
-        port_str = optarg;
+        if (num_port_strs == MAX_DEVICES) {
+          fprintf(stderr, "At most %d taps can be captured from\n", MAX_DEVICES);
+          err++;
+        } else {
+          port_strs[num_port_strs++] = optarg;
+        }
+        break;
+      case 'M':
+        g_reorder_ms = atoi(optarg);
         break;
       case 'l':
         g_libpcap_mode = 1;
         break;
+      case 'b':
+        g_print_occupancy = 1;
+        break;
+      case 't':
+        g_print_throughput = 1;
+        break;
+      case 'f':
+        g_filter_expr = optarg;
+        break;
+      case 'R':
+        ring_mbytes = atoi(optarg);
+        // The ring size must be a power of 2
+        if (ring_mbytes == 0 || (ring_mbytes & (ring_mbytes - 1))) {
+          fprintf(stderr, "The ring size must be a power of 2 MB\n");
+          err++;
+        }
+        break;
+      case 'F':
+        g_flush_bytes = (size_t)atoi(optarg) * 1024;
+        break;
+      case 'I':
+        g_flush_ms = atoi(optarg);
+        break;
+      case 'C':
+        g_rotate_bytes = (size_t)atoi(optarg) << 20;
+        break;
+      case 'G':
+        g_rotate_seconds = atoi(optarg);
+        break;
+      case 'W':
+        g_max_files = atoi(optarg);
+        break;
+      case 'm':
+#ifdef _WIN32
+        fprintf(stderr, "-m is not supported on Windows\n");
+        err++;
+#else
+        g_shm_name = optarg;
+#endif
+        break;
+      case 'S':
+        shm_mbytes = atoi(optarg);
+        // The shared memory ring size must be a power of 2
+        if (shm_mbytes == 0 || (shm_mbytes & (shm_mbytes - 1))) {
+          fprintf(stderr, "The shared memory size must be a power of 2 MB\n");
+          err++;
+        }
+        break;
+      case 'x':
+        g_index_ms = atoi(optarg);
+        break;
       case ':': /* -f or -o without operand */
         fprintf(stderr, "Option -%c requires an operand\n", optopt);
         err++;
@@ -135,31 +1504,65 @@ int main(int argc, char *argv[])
     }
   }
   for ( ; optind < argc; optind++) {
-    if (filename != DEFAULT_FILE)
+    if (filename_given)
       err++;
-    filename = argv[optind];
+    g_filename = argv[optind];
+    filename_given = 1;
     break;
   }
 
+  if (g_index_ms && g_libpcap_mode) {
+    fprintf(stderr, "-x can only index pcapng files\n");
+    err++;
+  }
+
+  if (g_max_files && !rotating()) {
+    fprintf(stderr, "-W needs the files to be rotated with -C or -G\n");
+    err++;
+  }
+
   if (err)
     usage(argv);
 
-  sockfds[0] = initialise_socket(server_ip, port_str);
-  g_pcap_fptr = fopen(filename, "wb");
-
-  if (g_libpcap_mode) {
-    // Emit libpcap common header
-    emit_pcap_header(g_pcap_fptr);
+  // A tap is given by each -s or -p, missing ones are the same as the last given
+  g_num_devices = (num_server_ips > num_port_strs) ? num_server_ips : num_port_strs;
+  if (g_num_devices == 0)
+    g_num_devices = 1;
+  for (d = 0; d < g_num_devices; d++) {
+    device_t *device = &g_devices[d];
+    device->server_ip = (d < num_server_ips) ? server_ips[d] :
+        (num_server_ips ? server_ips[num_server_ips - 1] : DEFAULT_SERVER_IP);
+    device->port_str = (d < num_port_strs) ? port_strs[d] :
+        (num_port_strs ? port_strs[num_port_strs - 1] : DEFAULT_PORT);
+    device->sockfd = initialise_socket(device->server_ip, device->port_str);
+    sockfds[d] = device->sockfd;
+    if (g_num_devices > 1)
+      merge_init(device);
+    if (g_filter_expr)
+      upload_filter(device->sockfd, g_filter_expr);
+  }
 
-  } else {
-    // Emit common header and two interface descriptions as there are two on the tap
-    emit_pcapng_section_header_block(g_pcap_fptr);
-    emit_pcapng_interface_description_block(g_pcap_fptr);
-    emit_pcapng_interface_description_block(g_pcap_fptr);
+  file_open();
+  writer_ring_init(&g_ring, (size_t)ring_mbytes << 20);
+#ifndef _WIN32
+  if (g_shm_name && pcapng_shm_create(&g_shm, g_shm_name, (uint64_t)shm_mbytes << 20)) {
+    perror("ERROR: unable to create the shared memory");
+    exit(1);
   }
-  fflush(g_pcap_fptr);
+#endif
+
+  // The capture is started once the socket is being serviced
+#ifdef _WIN32
+  g_startup_thread = CreateThread(NULL, 0, startup_thread, NULL, 0, NULL);
+  if (g_startup_thread == NULL)
+    print_and_exit("ERROR: Failed to create startup thread\n");
+#else
+  err = pthread_create(&g_startup_thread, NULL, &startup_thread, NULL);
+  if (err != 0)
+    print_and_exit("ERROR: Failed to create startup thread\n");
+#endif
 
-  handle_sockets(sockfds, 1);
+  handle_sockets(sockfds, g_num_devices);
 
   return 0;
 }
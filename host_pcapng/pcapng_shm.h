@@ -0,0 +1,379 @@
+/*
+ * The shared memory ring that pcapng_listener -m publishes the live capture
+ * to, and the client library to read it. Any number of readers can map the
+ * ring and each reads the blocks in place with its own cursor, so a reader
+ * costs the listener nothing and a slow reader only loses data itself.
+ *
+ * The library is in this header so that a consumer only has to include it
+ * (and link with -lrt on older Linux). It is not available on Windows.
+ *
+ * The ring holds the pcapng blocks from the taps (Enhanced Packet Blocks and
+ * Interface Statistics Blocks) one after the other, each contiguous so it can
+ * be used in place. A block that doesn't fit before the end of the ring is
+ * written at the start and the rest of the ring is skipped. The Section Header
+ * and Interface Description Blocks are held separately so that a reader can
+ * start a pcapng stream at any time.
+ *
+ * The writer never waits for the readers. It advances reserve_pos before it
+ * overwrites any data and write_pos once a block is complete. A reader checks
+ * that reserve_pos has not moved more than the size of the ring past a block
+ * after it has used it (pcapng_shm_valid), otherwise the block may have been
+ * overwritten while it was being read.
+ *
+ *  pcapng_shm_reader_t reader;
+ *  const uint32_t *block;
+ *  uint32_t length;
+ *
+ *  pcapng_shm_open(&reader, "/tap");
+ *  while (1) {
+ *    int result = pcapng_shm_next(&reader, &block, &length);
+ *    if (result == PCAPNG_SHM_EMPTY)
+ *      usleep(1000);
+ *    else if (result == PCAPNG_SHM_RECORD) {
+ *      analyse(block, length);
+ *      if (!pcapng_shm_valid(&reader))
+ *        discard_analysis();
+ *    }
+ *  }
+ */
+#ifndef __PCAPNG_SHM_H__
+#define __PCAPNG_SHM_H__
+
+#ifndef _WIN32
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PCAPNG_SHM_MAGIC         0x4d485350   // "PSHM"
+#define PCAPNG_SHM_VERSION       1
+#define PCAPNG_SHM_MAX_READERS   16
+#define PCAPNG_SHM_HEADER_BYTES  4096         // Room for the SHB and IDBs
+#define PCAPNG_SHM_PAGE_BYTES    4096
+
+// Marks the rest of the ring as unused when a block is written at the start
+#define PCAPNG_SHM_BLOCK_PADDING 0
+
+// Results of pcapng_shm_next()
+#define PCAPNG_SHM_RECORD        1
+#define PCAPNG_SHM_EMPTY         0
+#define PCAPNG_SHM_OVERRUN       -1
+#define PCAPNG_SHM_CLOSED        -2
+
+/*
+ * The state of a reader, in the shared memory so the listener can report it.
+ */
+typedef struct pcapng_shm_reader_slot_t {
+  int32_t pid;                    // 0 when the slot is free
+  uint32_t reserved;
+  uint64_t cursor;                // Position of the next block to read
+  uint64_t overruns;              // Times the writer overtook the reader
+  uint64_t lost_bytes;            // Data overwritten before it was read
+} pcapng_shm_reader_slot_t;
+
+typedef struct pcapng_shm_control_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t data_bytes;            // Size of the ring, a power of 2
+  uint64_t reserve_pos;           // Data up to here may be being written
+  uint64_t write_pos;             // Data up to here is complete
+  uint64_t records;               // Blocks written
+  uint32_t header_bytes;          // 0 until the headers have been written
+  uint32_t closed;                // Set when the listener exits
+  uint8_t headers[PCAPNG_SHM_HEADER_BYTES];
+  pcapng_shm_reader_slot_t readers[PCAPNG_SHM_MAX_READERS];
+} pcapng_shm_control_t;
+
+// The ring starts on the page after the control block
+#define PCAPNG_SHM_DATA_OFFSET \
+  ((sizeof(pcapng_shm_control_t) + PCAPNG_SHM_PAGE_BYTES - 1) & ~(size_t)(PCAPNG_SHM_PAGE_BYTES - 1))
+
+typedef struct pcapng_shm_t {
+  pcapng_shm_control_t *control;
+  uint8_t *data;
+  uint64_t mask;
+  size_t map_bytes;
+} pcapng_shm_t;
+
+typedef struct pcapng_shm_reader_t {
+  pcapng_shm_t shm;
+  pcapng_shm_reader_slot_t *slot;
+  uint64_t cursor;
+  uint64_t block_pos;             // Position of the last block returned
+  uint64_t records;
+  uint64_t overruns;
+  uint64_t lost_bytes;
+} pcapng_shm_reader_t;
+
+static inline uint64_t pcapng_shm_load(const uint64_t *value)
+{
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static inline void pcapng_shm_store(uint64_t *value, uint64_t new_value)
+{
+  __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
+/*
+ * The writer side, used by pcapng_listener.
+ */
+
+/*
+ * Create the shared memory with a ring of data_bytes (a power of 2).
+ * Returns 0 on success.
+ */
+static inline int pcapng_shm_create(pcapng_shm_t *shm, const char *name, uint64_t data_bytes)
+{
+  int fd;
+
+  shm_unlink(name);
+  fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0)
+    return -1;
+
+  shm->map_bytes = PCAPNG_SHM_DATA_OFFSET + data_bytes;
+  if (ftruncate(fd, shm->map_bytes) != 0) {
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  shm->control = mmap(NULL, shm->map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm->control == MAP_FAILED) {
+    shm_unlink(name);
+    return -1;
+  }
+
+  shm->data = (uint8_t *)shm->control + PCAPNG_SHM_DATA_OFFSET;
+  shm->mask = data_bytes - 1;
+  shm->control->version = PCAPNG_SHM_VERSION;
+  shm->control->data_bytes = data_bytes;
+  __atomic_store_n(&shm->control->magic, PCAPNG_SHM_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ * Set the Section Header and Interface Description Blocks that start the
+ * stream. Returns 0 on success.
+ */
+static inline int pcapng_shm_set_headers(pcapng_shm_t *shm, const void *headers, uint32_t length)
+{
+  if (length > PCAPNG_SHM_HEADER_BYTES)
+    return -1;
+  memcpy(shm->control->headers, headers, length);
+  __atomic_store_n(&shm->control->header_bytes, length, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ * Publish a block given as its first words and the rest of it.
+ */
+static inline void pcapng_shm_publish(pcapng_shm_t *shm, const void *header, uint32_t header_len,
+    const void *rest, uint32_t rest_len)
+{
+  pcapng_shm_control_t *control = shm->control;
+  uint64_t pos = control->write_pos;
+  uint64_t length = header_len + rest_len;
+  uint64_t offset = pos & shm->mask;
+  uint64_t space = control->data_bytes - offset;
+  uint64_t padding = 0;
+
+  if (length > control->data_bytes / 2)
+    return;
+
+  if (space < length) {
+    padding = space;
+    offset = 0;
+  }
+
+  // Readers must see that the data is being overwritten before it is
+  __atomic_store_n(&control->reserve_pos, pos + padding + length, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (padding >= sizeof(uint32_t))
+    *(uint32_t *)(shm->data + (pos & shm->mask)) = PCAPNG_SHM_BLOCK_PADDING;
+  memcpy(shm->data + offset, header, header_len);
+  memcpy(shm->data + offset + header_len, rest, rest_len);
+
+  control->records++;
+  pcapng_shm_store(&control->write_pos, pos + padding + length);
+}
+
+static inline void pcapng_shm_destroy(pcapng_shm_t *shm, const char *name)
+{
+  __atomic_store_n(&shm->control->closed, 1, __ATOMIC_RELEASE);
+  shm_unlink(name);
+  munmap(shm->control, shm->map_bytes);
+}
+
+/*
+ * The reader side.
+ */
+
+/*
+ * Map the shared memory of a running listener and take a reader slot. The
+ * reader starts with the next block written. Returns 0 on success.
+ */
+static inline int pcapng_shm_open(pcapng_shm_reader_t *reader, const char *name)
+{
+  pcapng_shm_control_t *control;
+  struct stat st;
+  int fd, i;
+
+  memset(reader, 0, sizeof(*reader));
+  fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < PCAPNG_SHM_DATA_OFFSET) {
+    close(fd);
+    return -1;
+  }
+  control = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (control == MAP_FAILED)
+    return -1;
+
+  if (__atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) != PCAPNG_SHM_MAGIC ||
+      control->version != PCAPNG_SHM_VERSION ||
+      PCAPNG_SHM_DATA_OFFSET + control->data_bytes > (uint64_t)st.st_size) {
+    munmap(control, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  reader->shm.control = control;
+  reader->shm.data = (uint8_t *)control + PCAPNG_SHM_DATA_OFFSET;
+  reader->shm.mask = control->data_bytes - 1;
+  reader->shm.map_bytes = st.st_size;
+  reader->cursor = pcapng_shm_load(&control->write_pos);
+
+  // Take a free slot, or that of a reader that has gone away
+  for (i = 0; i < PCAPNG_SHM_MAX_READERS && !reader->slot; i++) {
+    pcapng_shm_reader_slot_t *slot = &control->readers[i];
+    int32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+    if ((pid == 0 || (kill(pid, 0) != 0 && errno == ESRCH)) &&
+        __sync_bool_compare_and_swap(&slot->pid, pid, (int32_t)getpid())) {
+      slot->overruns = 0;
+      slot->lost_bytes = 0;
+      pcapng_shm_store(&slot->cursor, reader->cursor);
+      reader->slot = slot;
+    }
+  }
+  return 0;
+}
+
+/*
+ * The Section Header and Interface Description Blocks to start a pcapng
+ * stream with, or NULL if the listener has not written them yet.
+ */
+static inline const void *pcapng_shm_headers(pcapng_shm_reader_t *reader, uint32_t *length)
+{
+  *length = __atomic_load_n(&reader->shm.control->header_bytes, __ATOMIC_ACQUIRE);
+  return *length ? reader->shm.control->headers : NULL;
+}
+
+static inline void pcapng_shm_overrun(pcapng_shm_reader_t *reader, uint64_t write_pos)
+{
+  reader->overruns++;
+  reader->lost_bytes += write_pos - reader->cursor;
+  reader->cursor = write_pos;
+  if (reader->slot) {
+    reader->slot->overruns = reader->overruns;
+    reader->slot->lost_bytes = reader->lost_bytes;
+  }
+}
+
+/*
+ * Get the next block. Returns PCAPNG_SHM_RECORD with the block in place in the
+ * ring, PCAPNG_SHM_EMPTY if there is no new block, PCAPNG_SHM_OVERRUN if the
+ * writer overtook the reader (which then skips to the newest data) or
+ * PCAPNG_SHM_CLOSED once the listener has exited.
+ */
+static inline int pcapng_shm_next(pcapng_shm_reader_t *reader, const uint32_t **block, uint32_t *length)
+{
+  pcapng_shm_control_t *control = reader->shm.control;
+  uint64_t data_bytes = control->data_bytes;
+
+  while (1) {
+    uint64_t write_pos = pcapng_shm_load(&control->write_pos);
+    uint64_t offset = reader->cursor & reader->shm.mask;
+    uint64_t space = data_bytes - offset;
+    const uint32_t *words = (const uint32_t *)(reader->shm.data + offset);
+    uint32_t block_type, block_length;
+
+    if (reader->cursor == write_pos) {
+      if (__atomic_load_n(&control->closed, __ATOMIC_ACQUIRE))
+        return PCAPNG_SHM_CLOSED;
+      return PCAPNG_SHM_EMPTY;
+    }
+    if (write_pos - reader->cursor > data_bytes) {
+      pcapng_shm_overrun(reader, write_pos);
+      return PCAPNG_SHM_OVERRUN;
+    }
+
+    block_type = (space >= 8) ? words[0] : PCAPNG_SHM_BLOCK_PADDING;
+    block_length = (space >= 8) ? words[1] : 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (pcapng_shm_load(&control->reserve_pos) - reader->cursor > data_bytes) {
+      pcapng_shm_overrun(reader, write_pos);
+      return PCAPNG_SHM_OVERRUN;
+    }
+
+    if (block_type == PCAPNG_SHM_BLOCK_PADDING) {
+      reader->cursor += space;
+      continue;
+    }
+    if (block_length < 12 || block_length > space || (block_length % 4)) {
+      pcapng_shm_overrun(reader, write_pos);
+      return PCAPNG_SHM_OVERRUN;
+    }
+
+    *block = words;
+    *length = block_length;
+    reader->block_pos = reader->cursor;
+    reader->cursor += block_length;
+    reader->records++;
+    if (reader->slot)
+      pcapng_shm_store(&reader->slot->cursor, reader->cursor);
+    return PCAPNG_SHM_RECORD;
+  }
+}
+
+/*
+ * Check that the last block returned by pcapng_shm_next() was not overwritten
+ * while it was being used. Returns 0 (and counts an overrun) if it was.
+ */
+static inline int pcapng_shm_valid(pcapng_shm_reader_t *reader)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (pcapng_shm_load(&reader->shm.control->reserve_pos) - reader->block_pos <= reader->shm.control->data_bytes)
+    return 1;
+  pcapng_shm_overrun(reader, pcapng_shm_load(&reader->shm.control->write_pos));
+  return 0;
+}
+
+/*
+ * The bytes written that the reader has still to read.
+ */
+static inline uint64_t pcapng_shm_lag(pcapng_shm_reader_t *reader)
+{
+  return pcapng_shm_load(&reader->shm.control->write_pos) - reader->cursor;
+}
+
+static inline void pcapng_shm_close(pcapng_shm_reader_t *reader)
+{
+  if (reader->slot)
+    __atomic_store_n(&reader->slot->pid, 0, __ATOMIC_RELEASE);
+  munmap(reader->shm.control, reader->shm.map_bytes);
+  reader->slot = NULL;
+}
+
+#endif // _WIN32
+
+#endif // __PCAPNG_SHM_H__
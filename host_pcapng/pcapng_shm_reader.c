@@ -0,0 +1,142 @@
+/*
+ * A live reader of the shared memory published by pcapng_listener -m (see
+ * pcapng_shm.h). It writes the stream to a file or pipe, e.g. to Wireshark:
+ *
+ *  ./pcapng_shm_reader /tap - | wireshark -k -i -
+ *
+ * Without an output the blocks are only counted. Any number of readers can
+ * run at once, each with its own position in the stream.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "pcapng.h"
+#include "pcapng_conf.h"
+#include "pcapng_shm.h"
+
+// The largest block published by the listener
+#define MAX_BLOCK_WORDS ((PCAPNG_EPB_OVERHEAD_BYTES + CAPTURE_BYTES + 3) / 4)
+
+#define POLL_US 1000
+
+static volatile int g_stop = 0;
+
+static void handle_signal(int sig)
+{
+  g_stop = 1;
+}
+
+static unsigned long long time_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void usage(char *argv[])
+{
+  printf("Usage: %s [-t] name [output]\n", argv[0]);
+  printf("  -t           :   Print the blocks read, the lag behind the listener and any overruns once a second\n");
+  printf("  name         :   The shared memory given to pcapng_listener -m\n");
+  printf("  output       :   The pcapng file or pipe to write, '-' for stdout, the blocks are only counted if not given\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  pcapng_shm_reader_t reader;
+  uint32_t copy[MAX_BLOCK_WORDS];
+  const uint32_t *block;
+  const void *headers;
+  uint32_t length;
+  uint64_t bytes = 0, last_bytes = 0, last_records = 0;
+  unsigned long long last_report;
+  int print_stats = 0;
+  FILE *out = NULL;
+  int c, result;
+
+  while ((c = getopt(argc, argv, "t")) != -1) {
+    switch (c) {
+      case 't':
+        print_stats = 1;
+        break;
+      default:
+        usage(argv);
+    }
+  }
+  if (optind == argc || argc - optind > 2)
+    usage(argv);
+
+  if (pcapng_shm_open(&reader, argv[optind])) {
+    perror("ERROR: unable to open the shared memory (is pcapng_listener -m running?)");
+    exit(1);
+  }
+  if (!reader.slot)
+    fprintf(stderr, "WARNING: all reader slots are in use, this reader is not reported by the listener\n");
+
+  if (optind + 1 < argc) {
+    out = strcmp(argv[optind + 1], "-") ? fopen(argv[optind + 1], "wb") : stdout;
+    if (!out) {
+      fprintf(stderr, "ERROR: unable to open '%s'\n", argv[optind + 1]);
+      exit(1);
+    }
+  }
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGPIPE, handle_signal);
+
+  // The listener writes the headers once the device times are known
+  while (!(headers = pcapng_shm_headers(&reader, &length)) && !g_stop)
+    usleep(POLL_US);
+  if (out && headers)
+    fwrite(headers, length, 1, out);
+
+  last_report = time_ms();
+  while (!g_stop) {
+    result = pcapng_shm_next(&reader, &block, &length);
+
+    if (result == PCAPNG_SHM_CLOSED)
+      break;
+
+    if (result == PCAPNG_SHM_EMPTY) {
+      if (out)
+        fflush(out);
+      usleep(POLL_US);
+
+    } else if (result == PCAPNG_SHM_RECORD && length <= sizeof(copy)) {
+      // The block is copied before it is written so that a block overwritten
+      // while it is being read is never written out
+      memcpy(copy, block, length);
+      if (pcapng_shm_valid(&reader)) {
+        if (out && fwrite(copy, length, 1, out) != 1)
+          break;
+        bytes += length;
+      }
+    }
+
+    if (print_stats && (result != PCAPNG_SHM_RECORD || (reader.records % 1024) == 0) &&
+        time_ms() - last_report >= 1000) {
+      fprintf(stderr, "Reader: %llu blocks/s %.2f MB/s | lag %.2f MB | %llu overruns, %.2f MB lost\n",
+          (unsigned long long)(reader.records - last_records), (bytes - last_bytes) / 1048576.0,
+          pcapng_shm_lag(&reader) / 1048576.0,
+          (unsigned long long)reader.overruns, reader.lost_bytes / 1048576.0);
+      last_records = reader.records;
+      last_bytes = bytes;
+      last_report = time_ms();
+    }
+  }
+
+  fprintf(stderr, "%llu blocks, %.1f MB read, %llu overruns (%.1f MB lost)\n",
+      (unsigned long long)reader.records, bytes / 1048576.0,
+      (unsigned long long)reader.overruns, reader.lost_bytes / 1048576.0);
+
+  if (out)
+    fclose(out);
+  pcapng_shm_close(&reader);
+  return 0;
+}
@@ -0,0 +1,12 @@
+/*
+ * Stand-in for the device debug printing which goes to stdout like the prints
+ * relayed by the xscope host library.
+ */
+#ifndef __DEBUG_PRINT_H__
+#define __DEBUG_PRINT_H__
+
+#include <stdio.h>
+
+#define debug_printf printf
+
+#endif // __DEBUG_PRINT_H__
@@ -0,0 +1,14 @@
+/*
+ * Stand-in for the hardware locks. The device code is only ever called from
+ * the replay thread so the locks do nothing.
+ */
+#ifndef __HWLOCK_H__
+#define __HWLOCK_H__
+
+typedef unsigned hwlock_t;
+
+static inline hwlock_t hwlock_alloc() { return 0; }
+static inline void hwlock_acquire(hwlock_t lock) { }
+static inline void hwlock_release(hwlock_t lock) { }
+
+#endif // __HWLOCK_H__
@@ -0,0 +1,41 @@
+/**
+ * \brief   The interface between the xscope replay and the model of the device
+ *          application that the frames are replayed through. Each host tool is
+ *          linked with a model of the application it normally talks to, which
+ *          sends its records to the tool with xscope_bytes_c() (see util.h).
+ */
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+
+/**
+ * \brief   Initialise the device model. Called before anything else.
+ */
+void replay_device_init();
+
+/**
+ * \brief   A frame captured by the tap.
+ * \param   buffer            Pointer to the Enhanced Packet Block.
+ * \param   length_in_bytes   Length of the block.
+ */
+void replay_device_frame(const unsigned char *buffer, unsigned length_in_bytes);
+
+/**
+ * \brief   Called at the end of each second of device time, and once at the
+ *          end of the replay for the last partial second.
+ */
+void replay_device_second();
+
+/**
+ * \brief   A command uploaded by the host tool. The data is word aligned.
+ */
+void replay_device_command(const unsigned char *data, unsigned length_in_bytes);
+
+/**
+ * \brief   The device time of the frame being replayed in 10ns timer ticks.
+ */
+uint64_t replay_time();
+
+#endif // __REPLAY_H__
@@ -0,0 +1,74 @@
+/*
+ * Model of app_avb_tester for the replay. The frames are analysed by the
+ * analysis code of the application, built for the host.
+ */
+#include <time.h>
+
+#include "xscope_host_shared.h"
+#include "analysis_utils.h"
+#include "avb_tester.h"
+#include "replay.h"
+
+static int expect_oversubscribed = 0;
+static int print_debug = 0;
+
+void replay_device_init()
+{
+  analyse_init();
+}
+
+void replay_device_frame(const unsigned char *buffer, unsigned length_in_bytes)
+{
+  // The control core models the shapers with every frame, then the frames are
+  // analysed in turn but with the state of the analyser core they would be
+  // given to
+  analyse_shaper(buffer);
+  unsigned worker = analyse_worker(buffer);
+#if ANALYSIS_MEASURE_COST
+  // Host time in 10ns ticks, as the device timer
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  analyse_buffer(buffer, worker);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  analyse_cost(((end.tv_sec - start.tv_sec) * 100000000) + ((end.tv_nsec - start.tv_nsec) / 10), worker);
+#else
+  analyse_buffer(buffer, worker);
+#endif
+}
+
+void replay_device_second()
+{
+  check_counts(expect_oversubscribed, print_debug);
+}
+
+void replay_device_command(const unsigned char *data, unsigned length_in_bytes)
+{
+  tester_command_t cmd;
+
+  if (length_in_bytes < 4)
+    return;
+
+  cmd = *(const uint32_t *)data;
+  switch (cmd) {
+    case AVB_TESTER_EXPECT_NORMAL:
+    case AVB_TESTER_EXPECT_OVERSUBSCRIBED:
+      expect_oversubscribed = (cmd == AVB_TESTER_EXPECT_OVERSUBSCRIBED);
+      printf("Expecting %s\n", expect_oversubscribed ? "oversubscribed" : "normal");
+      break;
+
+    case AVB_TESTER_PRINT_DEBUG_ENABLE:
+    case AVB_TESTER_PRINT_DEBUG_DISABLE:
+      print_debug = (cmd == AVB_TESTER_PRINT_DEBUG_ENABLE);
+      printf("%s debug printing\n", print_debug ? "Enabling" : "Disabling");
+      break;
+
+    case AVB_TESTER_SET_RELAY_OPEN:
+    case AVB_TESTER_SET_RELAY_CLOSE:
+      // There is no relay
+      break;
+
+    default:
+      printf("Unrecognised command '%d' received from host\n", cmd);
+      break;
+  }
+}
@@ -0,0 +1,82 @@
+/*
+ * Model of app_packet_analyser for the replay. The frames are analysed by the
+ * analysis code of the application, built for the host.
+ */
+#include <time.h>
+
+#include "xscope_host_shared.h"
+#include "analysis_utils.h"
+#include "latency.h"
+#include "talkers.h"
+#include "packet_analyser.h"
+#include "replay.h"
+
+void replay_device_init()
+{
+  analyse_init();
+}
+
+void replay_device_frame(const unsigned char *buffer, unsigned length_in_bytes)
+{
+  // The frames are analysed in turn but with the state of the analyser core
+  // they would be given to
+  unsigned worker = analyse_worker(buffer);
+
+  analyse_burst(buffer);
+#if ANALYSIS_MEASURE_COST
+  // Host time in 10ns ticks, as the device timer
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  analyse_buffer(buffer, worker);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  analyse_cost(((end.tv_sec - start.tv_sec) * 100000000) + ((end.tv_nsec - start.tv_nsec) / 10), worker);
+#else
+  analyse_buffer(buffer, worker);
+#endif
+}
+
+void replay_device_second()
+{
+  check_counts();
+}
+
+void replay_device_command(const unsigned char *data, unsigned length_in_bytes)
+{
+  unsigned int cmd;
+
+  if (length_in_bytes < 4)
+    return;
+
+  cmd = *(const uint32_t *)data;
+  switch (cmd) {
+    case PACKET_ANALYSER_SET_RELAY_OPEN:
+    case PACKET_ANALYSER_SET_RELAY_CLOSE:
+      // There is no relay
+      break;
+
+    case PACKET_ANALYSER_LATENCY_ENABLE:
+      latency_set_enabled(1);
+      break;
+
+    case PACKET_ANALYSER_LATENCY_DISABLE:
+      latency_set_enabled(0);
+      break;
+
+    case PACKET_ANALYSER_TALKERS_ENABLE:
+      talkers_set_enabled(1);
+      break;
+
+    case PACKET_ANALYSER_TALKERS_DISABLE:
+      talkers_set_enabled(0);
+      break;
+
+    case PACKET_ANALYSER_SET_BURST_WINDOW:
+      if (length_in_bytes == 8)
+        analyse_set_burst_window(((const uint32_t *)data)[1]);
+      break;
+
+    default:
+      printf("Unrecognised command '%d' received from host\n", cmd);
+      break;
+  }
+}
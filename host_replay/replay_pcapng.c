@@ -0,0 +1,52 @@
+/*
+ * Model of app_pcapng for the replay. The frames are sent to the host as they
+ * are captured and the time requests are answered with the replay time. The
+ * capture filter is not modelled, all frames are sent.
+ */
+#include "xscope_host_shared.h"
+#include "pcapng.h"
+#include "util.h"
+#include "pcapng_tap.h"
+#include "replay.h"
+
+void replay_device_init()
+{
+}
+
+void replay_device_frame(const unsigned char *buffer, unsigned length_in_bytes)
+{
+  xscope_bytes_c(PCAPNG_PROBE_PACKET_DATA, length_in_bytes, buffer);
+}
+
+void replay_device_second()
+{
+}
+
+void replay_device_command(const unsigned char *data, unsigned length_in_bytes)
+{
+  const uint32_t *words = (const uint32_t *)data;
+
+  if (length_in_bytes < 4)
+    return;
+
+  switch (words[0]) {
+    case PCAPNG_TAP_SET_FILTER:
+    case PCAPNG_TAP_CLEAR_FILTER:
+      printf("The capture filter is not applied by the replay\n");
+      break;
+
+    case PCAPNG_TAP_GET_TIME: {
+      uint64_t now = replay_time();
+      tap_time_t time;
+      time.sequence = (length_in_bytes >= 8) ? words[1] : 0;
+      time.timestamp_high = (uint32_t)(now >> 32);
+      time.timestamp_low = (uint32_t)now;
+      xscope_bytes_c(PCAPNG_PROBE_TIME, sizeof(time), (unsigned char *)&time);
+      break;
+    }
+
+    default:
+      printf("Unrecognised command '%d' received from host\n", words[0]);
+      break;
+  }
+}
@@ -0,0 +1,11 @@
+/*
+ * Stand-in for the device assertions.
+ */
+#ifndef __XASSERT_H__
+#define __XASSERT_H__
+
+#include <assert.h>
+
+#define xassert(e) assert(e)
+
+#endif // __XASSERT_H__
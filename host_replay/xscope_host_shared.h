@@ -0,0 +1,40 @@
+/*
+ * Stand-in for the header of the xscope host library. The host tools are
+ * compiled against this when they are linked with the replay (xscope_replay.c)
+ * instead of the library, so the API and defaults must match the library.
+ */
+#ifndef __XSCOPE_HOST_SHARED_H__
+#define __XSCOPE_HOST_SHARED_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define DEFAULT_SERVER_IP "localhost"
+#define DEFAULT_PORT      "10101"
+
+#ifdef XSCOPE_HOST_HAS_PROMPT
+extern const char *g_prompt;
+#endif
+
+/*
+ * Provided by the host tool
+ */
+void hook_registration_received(int sockfd, int xscope_probe, char *name);
+void hook_data_received(int sockfd, int xscope_probe, void *data, int data_len);
+void hook_exiting();
+
+/*
+ * Provided by the replay
+ */
+int initialise_socket(char *ip_addr_str, char *port_str);
+void handle_sockets(int *sockfds, int no_of_sockfds);
+int xscope_ep_request_upload(int sockfd, unsigned int length, const unsigned char *data);
+void print_and_exit(const char *format, ...);
+
+#endif // __XSCOPE_HOST_SHARED_H__
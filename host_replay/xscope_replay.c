@@ -0,0 +1,540 @@
+/*
+ * A stand-in for the xscope host library which replays a pcapng capture, or a
+ * synthetic stream of frames, through a model of the device application (see
+ * replay.h) and delivers the records it sends to the hooks of the host tool.
+ * This exercises the host tools without a board and measures how many frames
+ * per second they can ingest.
+ *
+ * Each socket the host tool opens is a separate device which sees the same
+ * frames. The clock of each device is offset from the last and each sees the
+ * frames a little later, as if the taps were further along the network.
+ *
+ * The host tools parse their own command lines so the replay is configured
+ * with environment variables:
+ *
+ *   XSCOPE_REPLAY_FILE        pcapng capture to replay (default synthetic frames)
+ *   XSCOPE_REPLAY_FRAMES      number of synthetic frames (default 1000000)
+ *   XSCOPE_REPLAY_FRAME_BYTES length of the synthetic frames (default 64)
+ *   XSCOPE_REPLAY_LOOPS       times the capture is replayed (default 1)
+ *   XSCOPE_REPLAY_RATE        frames per second, 0 for as fast as possible (default 0)
+ *   XSCOPE_REPLAY_START_MS    time given to the tool to start up (default 500)
+ *   XSCOPE_REPLAY_MAX_LAG_MS  lag behind the rate that counts as falling behind (default 100)
+ *   XSCOPE_REPLAY_BENCHMARK   if set, print the ingest rate every second
+ */
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "xscope_host_shared.h"
+#include "pcapng.h"
+#include "pcapng_conf.h"
+#include "util.h"
+#include "replay.h"
+
+#define TICKS_PER_SECOND     100000000ull
+
+// The sockfd handed to the host tool for the first device
+#define REPLAY_SOCKFD        1
+#define MAX_REPLAY_DEVICES   8
+
+// The clock of each device is this far ahead of the last and it sees the
+// frames this long after it (5us)
+#define DEVICE_CLOCK_OFFSET_TICKS 123456789ull
+#define DEVICE_HOP_TICKS     500
+
+// The largest upload accepted by the xscope server
+#define MAX_UPLOAD_BYTES     256
+#define MAX_PENDING_UPLOADS  16
+
+// The synthetic frames are seen on the second interface this long after the
+// first, as if they were forwarded by a device under test (1us)
+#define SYNTHETIC_LATENCY_TICKS 100
+
+// Preamble, SFD and inter-frame gap at 100Mb/s (one bit per 10ns tick)
+#define WIRE_OVERHEAD_BYTES  20
+#define TICKS_PER_WIRE_BYTE  8
+
+// The clock is only read every few frames when replaying as fast as possible
+#define FRAMES_PER_CLOCK_READ 64
+
+#define EPB_HEADER_BYTES     28
+
+// Uploads from the host tool waiting for the replay thread
+static pthread_mutex_t g_upload_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t g_uploads[MAX_PENDING_UPLOADS][MAX_UPLOAD_BYTES / 4];
+static unsigned g_upload_lengths[MAX_PENDING_UPLOADS];
+static int g_upload_sockfds[MAX_PENDING_UPLOADS];
+static unsigned g_upload_head = 0;
+static unsigned g_upload_tail = 0;
+
+// The EPBs loaded from the capture, one after the other
+static unsigned char *g_frames = NULL;
+static size_t g_frames_bytes = 0;
+static unsigned long g_num_frames = 0;
+
+// The device being modelled and the time of the frame it is handling. Until
+// the replay starts the device time follows the host clock.
+static unsigned g_num_devices = 0;
+static unsigned g_current_device = 0;
+static int g_started = 0;
+static uint64_t g_epoch_ns = 0;
+static uint64_t g_device_time = 0;
+
+static unsigned long env_value(const char *name, unsigned long default_value)
+{
+  const char *value = getenv(name);
+  return value ? strtoul(value, NULL, 0) : default_value;
+}
+
+static uint64_t time_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+static uint64_t host_device_time()
+{
+  return (time_ns() - g_epoch_ns) / (1000000000ull / TICKS_PER_SECOND);
+}
+
+uint64_t replay_time()
+{
+  uint64_t now = g_started ? g_device_time : host_device_time();
+  return now + (g_current_device * DEVICE_CLOCK_OFFSET_TICKS);
+}
+
+void xscope_bytes_c(unsigned char id, unsigned int length_in_bytes, const unsigned char *data)
+{
+  hook_data_received(REPLAY_SOCKFD + g_current_device, id, (void *)data, length_in_bytes);
+}
+
+int initialise_socket(char *ip_addr_str, char *port_str)
+{
+  if (g_num_devices == MAX_REPLAY_DEVICES) {
+    fprintf(stderr, "ERROR: at most %d devices can be replayed\n", MAX_REPLAY_DEVICES);
+    exit(1);
+  }
+  if (!g_epoch_ns)
+    g_epoch_ns = time_ns();
+  fprintf(stderr, "Replaying to the host tool instead of connecting to %s:%s\n", ip_addr_str, port_str);
+  return REPLAY_SOCKFD + g_num_devices++;
+}
+
+int xscope_ep_request_upload(int sockfd, unsigned int length, const unsigned char *data)
+{
+  int result = 0;
+
+  if (length > MAX_UPLOAD_BYTES)
+    return 1;
+
+  pthread_mutex_lock(&g_upload_lock);
+  if (g_upload_head - g_upload_tail == MAX_PENDING_UPLOADS) {
+    result = 1;
+  } else {
+    unsigned index = g_upload_head % MAX_PENDING_UPLOADS;
+    memcpy(g_uploads[index], data, length);
+    g_upload_lengths[index] = length;
+    g_upload_sockfds[index] = sockfd;
+    g_upload_head++;
+  }
+  pthread_mutex_unlock(&g_upload_lock);
+  return result;
+}
+
+/*
+ * Hand the uploads from the host tool to the device model on the replay
+ * thread. The lock is not held while the model runs as it may reply straight
+ * away to a thread waiting to upload.
+ */
+static void service_uploads()
+{
+  uint32_t upload[MAX_UPLOAD_BYTES / 4];
+  unsigned length;
+  int sockfd;
+
+  while (1) {
+    pthread_mutex_lock(&g_upload_lock);
+    if (g_upload_head == g_upload_tail) {
+      pthread_mutex_unlock(&g_upload_lock);
+      return;
+    }
+    length = g_upload_lengths[g_upload_tail % MAX_PENDING_UPLOADS];
+    sockfd = g_upload_sockfds[g_upload_tail % MAX_PENDING_UPLOADS];
+    memcpy(upload, g_uploads[g_upload_tail % MAX_PENDING_UPLOADS], length);
+    g_upload_tail++;
+    pthread_mutex_unlock(&g_upload_lock);
+
+    g_current_device = sockfd - REPLAY_SOCKFD;
+    replay_device_command((unsigned char *)upload, length);
+    g_current_device = 0;
+  }
+}
+
+void print_and_exit(const char *format, ...)
+{
+  va_list argptr;
+  va_start(argptr, format);
+  vfprintf(stderr, format, argptr);
+  va_end(argptr);
+  hook_exiting();
+  exit(1);
+}
+
+/*
+ * Wait until the given time, handling the uploads from the host tool.
+ */
+static void wait_until(uint64_t until_ns)
+{
+  while (1) {
+    uint64_t now = time_ns();
+    service_uploads();
+    if (now >= until_ns)
+      return;
+    if (until_ns - now > 100000)
+      usleep(100);
+  }
+}
+
+static unsigned char *add_frame(size_t length)
+{
+  static size_t capacity = 0;
+  unsigned char *frame;
+
+  if (g_frames_bytes + length > capacity) {
+    capacity = capacity ? capacity * 2 : (1 << 20);
+    g_frames = realloc(g_frames, capacity);
+    if (!g_frames) {
+      fprintf(stderr, "ERROR: out of memory loading the capture\n");
+      exit(1);
+    }
+  }
+  frame = g_frames + g_frames_bytes;
+  g_frames_bytes += length;
+  g_num_frames++;
+  return frame;
+}
+
+/*
+ * Convert a timestamp to 10ns ticks from the if_tsresol of its interface (a
+ * power of 10, or of 2 if the top bit is set).
+ */
+static uint64_t timestamp_to_ticks(uint64_t timestamp, uint8_t tsresol)
+{
+  unsigned exponent = tsresol & 0x7f;
+
+  if (tsresol & 0x80) {
+    if (exponent >= 32)
+      return (timestamp >> (exponent - 32)) * TICKS_PER_SECOND >> 32;
+    return ((timestamp >> exponent) * TICKS_PER_SECOND) +
+           (((timestamp & ((1ull << exponent) - 1)) * TICKS_PER_SECOND) >> exponent);
+  }
+  while (exponent < 8) {
+    timestamp *= 10;
+    exponent++;
+  }
+  while (exponent > 8) {
+    timestamp /= 10;
+    exponent--;
+  }
+  return timestamp;
+}
+
+/*
+ * Load the EPBs of a capture into memory so the file is not read during the
+ * replay. The frames are truncated to what the tap would capture and their
+ * timestamps converted to 10ns ticks from the first frame.
+ */
+static void load_capture(const char *filename)
+{
+  uint8_t tsresol[256];
+  unsigned num_interfaces = 0;
+  uint32_t *block = NULL;
+  size_t block_capacity = 0;
+  uint32_t header[2];
+  uint64_t first_time = 0;
+  FILE *fptr;
+
+  fptr = fopen(filename, "rb");
+  if (!fptr) {
+    fprintf(stderr, "ERROR: unable to open '%s'\n", filename);
+    exit(1);
+  }
+
+  while (fread(header, sizeof(header), 1, fptr) == 1) {
+    uint32_t length = header[1];
+
+    if (length < 12 || (length % 4)) {
+      fprintf(stderr, "ERROR: invalid block length %u in '%s'\n", length, filename);
+      exit(1);
+    }
+    if (length > block_capacity) {
+      block_capacity = length;
+      block = realloc(block, block_capacity);
+      if (!block) {
+        fprintf(stderr, "ERROR: out of memory loading the capture\n");
+        exit(1);
+      }
+    }
+    block[0] = header[0];
+    block[1] = header[1];
+    if (fread(&block[2], length - 8, 1, fptr) != 1)
+      break;
+
+    if (block[0] == PCAPNG_BLOCK_SECTION_HEADER) {
+      if (block[2] != 0x1A2B3C4D) {
+        fprintf(stderr, "ERROR: '%s' is not in the byte order of this host\n", filename);
+        exit(1);
+      }
+      num_interfaces = 0;
+
+    } else if (block[0] == PCAPNG_BLOCK_INTERFACE_DESCRIPTION && length >= 20) {
+      // The timestamps are in microseconds unless there is an if_tsresol option
+      const uint8_t *option = (const uint8_t *)&block[4];
+      const uint8_t *end = (const uint8_t *)block + length - 4;
+      uint8_t resolution = 6;
+
+      while (option + 4 <= end) {
+        uint16_t code = option[0] | (option[1] << 8);
+        uint16_t option_length = option[2] | (option[3] << 8);
+        if (code == PCAPNG_OPTION_END_OF_OPT || option + 4 + option_length > end)
+          break;
+        if (code == PCAPNG_OPTION_IF_TSRESOL && option_length >= 1)
+          resolution = option[4];
+        option += 4 + ((option_length + 3) & ~3);
+      }
+      if (num_interfaces < sizeof(tsresol))
+        tsresol[num_interfaces++] = resolution;
+
+    } else if (block[0] == PCAPNG_BLOCK_ENHANCED_PACKET && length >= EPB_HEADER_BYTES + 4) {
+      const enhanced_packet_block_t *epb = (const enhanced_packet_block_t *)block;
+      uint8_t resolution = (epb->interface_id < num_interfaces) ? tsresol[epb->interface_id] : 6;
+      uint64_t time = timestamp_to_ticks(((uint64_t)epb->timestamp_high << 32) | epb->timestamp_low, resolution);
+      unsigned captured_len = epb->captured_len;
+      enhanced_packet_block_t *frame;
+      unsigned frame_length;
+
+      if (captured_len > length - EPB_HEADER_BYTES - 4)
+        captured_len = length - EPB_HEADER_BYTES - 4;
+      if (captured_len > CAPTURE_BYTES)
+        captured_len = CAPTURE_BYTES;
+      if (!g_num_frames)
+        first_time = time;
+
+      frame_length = EPB_HEADER_BYTES + ((captured_len + 3) & ~3) + 4;
+      frame = (enhanced_packet_block_t *)add_frame(frame_length);
+      memset(frame, 0, frame_length);
+      frame->block_type = PCAPNG_BLOCK_ENHANCED_PACKET;
+      frame->block_total_len_pre = frame_length;
+      frame->interface_id = epb->interface_id % PCAPNG_NUM_INTERFACES;
+      frame->timestamp_high = (uint32_t)((time - first_time) >> 32);
+      frame->timestamp_low = (uint32_t)(time - first_time);
+      frame->captured_len = captured_len;
+      frame->packet_len = epb->packet_len;
+      memcpy(&frame->data, &epb->data, captured_len);
+      *(uint32_t *)((unsigned char *)frame + frame_length - 4) = frame_length;
+    }
+  }
+  fclose(fptr);
+  free(block);
+
+  if (!g_num_frames) {
+    fprintf(stderr, "ERROR: no packets found in '%s'\n", filename);
+    exit(1);
+  }
+}
+
+/*
+ * A synthetic frame. Each frame is seen on both interfaces, first on interface
+ * 0 and then on interface 1, and carries its sequence number in the payload.
+ * Without a rate the frames are back to back at 100Mb/s.
+ */
+static void make_synthetic_frame(enhanced_packet_block_t *frame, unsigned long index,
+    unsigned frame_bytes, uint64_t ticks_per_frame)
+{
+  static const uint8_t header[14] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01,   // Destination MAC
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x02,   // Source MAC
+    0x88, 0xb5,                           // Local experimental ethertype
+  };
+  unsigned captured_len = frame_bytes < CAPTURE_BYTES ? frame_bytes : CAPTURE_BYTES;
+  unsigned frame_length = EPB_HEADER_BYTES + ((captured_len + 3) & ~3) + 4;
+  unsigned long sequence = index / 2;
+  uint8_t *data = (uint8_t *)&frame->data;
+  uint64_t time = (sequence * ticks_per_frame) + ((index & 1) * SYNTHETIC_LATENCY_TICKS);
+
+  frame->block_type = PCAPNG_BLOCK_ENHANCED_PACKET;
+  frame->block_total_len_pre = frame_length;
+  frame->interface_id = index & 1;
+  frame->timestamp_high = (uint32_t)(time >> 32);
+  frame->timestamp_low = (uint32_t)time;
+  frame->captured_len = captured_len;
+  frame->packet_len = frame_bytes;
+  memcpy(data, header, captured_len < sizeof(header) ? captured_len : sizeof(header));
+  if (captured_len >= sizeof(header) + 4) {
+    data[14] = sequence >> 24;
+    data[15] = sequence >> 16;
+    data[16] = sequence >> 8;
+    data[17] = sequence;
+  }
+  *(uint32_t *)((unsigned char *)frame + frame_length - 4) = frame_length;
+}
+
+void handle_sockets(int *sockfds, int no_of_sockfds)
+{
+  const char *filename = getenv("XSCOPE_REPLAY_FILE");
+  unsigned long num_synthetic = env_value("XSCOPE_REPLAY_FRAMES", 1000000);
+  unsigned frame_bytes = env_value("XSCOPE_REPLAY_FRAME_BYTES", 64);
+  unsigned long loops = env_value("XSCOPE_REPLAY_LOOPS", 1);
+  unsigned long rate = env_value("XSCOPE_REPLAY_RATE", 0);
+  unsigned long start_ms = env_value("XSCOPE_REPLAY_START_MS", 500);
+  uint64_t max_lag_ns = (uint64_t)env_value("XSCOPE_REPLAY_MAX_LAG_MS", 100) * 1000000;
+  int benchmark = getenv("XSCOPE_REPLAY_BENCHMARK") != NULL;
+  uint32_t synthetic[(EPB_HEADER_BYTES + CAPTURE_BYTES + 8) / 4];
+  unsigned long total_frames;
+  unsigned long second_frames = 0;
+  unsigned long slowest_second = 0;
+  unsigned long sent;
+  uint64_t next_second;
+  uint64_t loop_offset;
+  uint64_t start, now, last_report, max_lag = 0;
+  unsigned char *frame = NULL;
+  unsigned d;
+
+  if (no_of_sockfds < 1)
+    no_of_sockfds = 1;
+
+  if (frame_bytes < 14 || frame_bytes > 1522) {
+    fprintf(stderr, "ERROR: XSCOPE_REPLAY_FRAME_BYTES must be between 14 and 1522\n");
+    exit(1);
+  }
+
+  if (filename) {
+    load_capture(filename);
+    total_frames = g_num_frames * loops;
+    fprintf(stderr, "Replaying %lu frames from '%s' %lu times", g_num_frames, filename, loops);
+  } else {
+    total_frames = num_synthetic;
+    fprintf(stderr, "Replaying %lu synthetic frames of %u bytes", total_frames, frame_bytes);
+  }
+  if (rate)
+    fprintf(stderr, " at %lu frames/s\n", rate);
+  else
+    fprintf(stderr, " as fast as possible\n");
+
+  replay_device_init();
+
+  // Give the host tool time to start up as it would have against a device
+  wait_until(time_ns() + (uint64_t)start_ms * 1000000);
+
+  // The frames follow on from the device time at the start
+  loop_offset = host_device_time();
+  next_second = loop_offset + TICKS_PER_SECOND;
+  g_device_time = loop_offset;
+  g_started = 1;
+
+  start = time_ns();
+  now = start;
+  last_report = start;
+
+  for (sent = 0; sent < total_frames; sent++) {
+    unsigned length;
+
+    if (filename) {
+      unsigned long index = sent % g_num_frames;
+      if (index == 0) {
+        // Each pass through the capture follows on from the last
+        if (sent) {
+          enhanced_packet_block_t *last = (enhanced_packet_block_t *)(frame);
+          loop_offset += (((uint64_t)last->timestamp_high << 32) | last->timestamp_low) + 1;
+        }
+        frame = g_frames;
+      } else {
+        frame += ((enhanced_packet_block_t *)frame)->block_total_len_pre;
+      }
+    } else {
+      uint64_t ticks_per_frame = rate ? (2 * TICKS_PER_SECOND) / rate :
+                                        (frame_bytes + WIRE_OVERHEAD_BYTES) * TICKS_PER_WIRE_BYTE;
+      make_synthetic_frame((enhanced_packet_block_t *)synthetic, sent, frame_bytes, ticks_per_frame);
+      frame = (unsigned char *)synthetic;
+    }
+
+    enhanced_packet_block_t *epb = (enhanced_packet_block_t *)frame;
+    length = epb->block_total_len_pre;
+    g_device_time = loop_offset + (((uint64_t)epb->timestamp_high << 32) | epb->timestamp_low);
+
+    // The device reports once a second of its time
+    while (g_device_time >= next_second) {
+      for (d = 0; d < (unsigned)no_of_sockfds; d++) {
+        g_current_device = d;
+        replay_device_second();
+      }
+      g_current_device = 0;
+      next_second += TICKS_PER_SECOND;
+    }
+
+    if (rate) {
+      uint64_t due = start + ((uint64_t)sent * 1000000000ull) / rate;
+      now = time_ns();
+      if (now < due)
+        wait_until(due);
+      else if (now - due > max_lag)
+        max_lag = now - due;
+    } else if ((sent % FRAMES_PER_CLOCK_READ) == 0) {
+      service_uploads();
+      now = time_ns();
+    }
+
+    // The timestamps are rebased to the time of each device in a copy of the frame
+    for (d = 0; d < (unsigned)no_of_sockfds; d++) {
+      uint32_t copy[(EPB_HEADER_BYTES + CAPTURE_BYTES + 8) / 4];
+      uint64_t time = g_device_time + (d * (DEVICE_CLOCK_OFFSET_TICKS + DEVICE_HOP_TICKS));
+      memcpy(copy, frame, length);
+      ((enhanced_packet_block_t *)copy)->timestamp_high = (uint32_t)(time >> 32);
+      ((enhanced_packet_block_t *)copy)->timestamp_low = (uint32_t)time;
+      g_current_device = d;
+      replay_device_frame((unsigned char *)copy, length);
+    }
+    g_current_device = 0;
+    second_frames++;
+
+    if (now - last_report >= 1000000000ull) {
+      double seconds = (now - last_report) / 1e9;
+      unsigned long frames_per_second = (unsigned long)(second_frames / seconds);
+      if (!slowest_second || frames_per_second < slowest_second)
+        slowest_second = frames_per_second;
+      if (benchmark)
+        fprintf(stderr, "Replay: %lu frames/s\n", frames_per_second);
+      second_frames = 0;
+      last_report = now;
+    }
+  }
+
+  // Report the last partial second
+  for (d = 0; d < (unsigned)no_of_sockfds; d++) {
+    g_current_device = d;
+    replay_device_second();
+  }
+  g_current_device = 0;
+  now = time_ns();
+
+  if (benchmark) {
+    double seconds = (now - start) / 1e9;
+    fprintf(stderr, "Replay: %lu frames in %.3f s, %.0f frames/s", total_frames, seconds,
+        seconds > 0 ? total_frames / seconds : 0.0);
+    if (slowest_second)
+      fprintf(stderr, ", slowest second %lu frames/s", slowest_second);
+    fprintf(stderr, "\n");
+  }
+  if (rate) {
+    if (max_lag > max_lag_ns)
+      fprintf(stderr, "Replay: FELL BEHIND %lu frames/s (up to %.1f ms late)\n", rate, max_lag / 1e6);
+    else if (benchmark)
+      fprintf(stderr, "Replay: kept up with %lu frames/s (up to %.1f ms late)\n", rate, max_lag / 1e6);
+  }
+
+  // Let the host tool handle any last commands before it exits
+  wait_until(time_ns() + 100000000);
+  hook_exiting();
+  exit(0);
+}
@@ -1,6 +1,7 @@
 /*
  * Buffer management for the PCAPNG library. There is one structure to
- * track free buffer pointers and one for used buffer pointers.
+ * track free buffer pointers and one for used buffer pointers, and the
+ * descriptor rings shared between the MII receivers and their consumer.
  */
 #include "buffers.h"
 
@@ -12,3 +13,219 @@ void buffers_free_initialise_c(buffers_free_t *free)
   free->stack[0] = (uintptr_t)g_buffer;
 }
 
+
+typedef struct buffers_ring_t {
+  volatile unsigned head_index;           // Only written by the producer
+  volatile unsigned tail_index;           // Only written by the consumer
+  volatile unsigned head_bytes;           // Bytes allocated since the start (producer)
+  volatile unsigned tail_bytes;           // Bytes released since the start (consumer)
+  unsigned head_offset;                   // Position of the head in the arena (producer)
+  uintptr_t pointers[BUFFERS_RING_DESCRIPTORS];
+  unsigned length_in_bytes[BUFFERS_RING_DESCRIPTORS];
+  unsigned footprint[BUFFERS_RING_DESCRIPTORS];   // Length plus any bytes skipped to wrap
+  unsigned char *base;
+  unsigned peak_bytes;
+  unsigned peak_frames;
+  volatile unsigned drop_count;           // Frames dropped since the start of capture
+  unsigned drop_timestamp_high;           // Time of the last dropped frame
+  unsigned drop_timestamp_low;
+  unsigned reported_drop_count;           // Only written by the consumer
+} buffers_ring_t;
+
+/*
+ * Only the indices, byte counts and drop count of a ring are volatile, so the
+ * compiler must also be stopped from moving the accesses of the descriptors
+ * (and of the drop timestamp) across them. The xCORE makes the memory accesses
+ * of a core in program order, so nothing more is needed.
+ */
+#define RING_BARRIER() asm volatile("" ::: "memory")
+
+static buffers_ring_t g_rings[PCAPNG_NUM_INTERFACES];
+
+// Statistics blocks handed to the consumer by buffers_ring_statistics()
+static interface_statistics_block_t g_statistics[PCAPNG_NUM_INTERFACES];
+
+/*
+ * The number of bytes at the end of the arena skipped by a block allocated at
+ * the given position, because a MAX_BUFFER_SIZE block would not fit.
+ */
+static unsigned wrap_skip(unsigned head_offset)
+{
+  unsigned remaining = BUFFERS_RING_BYTES - head_offset;
+  return (remaining < MAX_BUFFER_SIZE) ? remaining : 0;
+}
+
+void buffers_ring_initialise(unsigned ring)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  r->base = &g_buffer[ring * BUFFERS_RING_BYTES];
+}
+
+uintptr_t buffers_ring_claim(unsigned ring)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  unsigned head_offset = r->head_offset;
+  return (uintptr_t)&r->base[(head_offset + wrap_skip(head_offset)) % BUFFERS_RING_BYTES];
+}
+
+/*
+ * Whether the ring could accept the block and still leave room for the next
+ * claim.
+ */
+static int ring_has_space(buffers_ring_t *r, unsigned next_head_bytes, unsigned next_head_offset)
+{
+  if (r->head_index - r->tail_index == BUFFERS_RING_DESCRIPTORS)
+    return 0;
+  unsigned used = next_head_bytes - r->tail_bytes;
+  return (used + wrap_skip(next_head_offset) + MAX_BUFFER_SIZE) <= BUFFERS_RING_BYTES;
+}
+
+int buffers_ring_publish(unsigned ring, unsigned length_in_bytes)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  unsigned head_index = r->head_index;
+  unsigned head_bytes = r->head_bytes;
+  unsigned footprint = wrap_skip(r->head_offset) + length_in_bytes;
+  unsigned next_head_offset = (r->head_offset + footprint) % BUFFERS_RING_BYTES;
+  uintptr_t buffer = buffers_ring_claim(ring);
+
+#if PCAPNG_DROP_ON_OVERFLOW
+  if (!ring_has_space(r, head_bytes + footprint, next_head_offset)) {
+    enhanced_packet_block_t *epb = (enhanced_packet_block_t *)buffer;
+    r->drop_timestamp_high = epb->timestamp_high;
+    r->drop_timestamp_low = epb->timestamp_low;
+    RING_BARRIER();
+    r->drop_count++;
+    return 0;
+  }
+#else
+  while (!ring_has_space(r, head_bytes + footprint, next_head_offset))
+    ; // Wait for the consumer
+#endif
+
+  // The descriptor may only be written once the consumer is done with it
+  RING_BARRIER();
+
+  unsigned index = head_index % BUFFERS_RING_DESCRIPTORS;
+  r->pointers[index] = buffer;
+  r->length_in_bytes[index] = length_in_bytes;
+  r->footprint[index] = footprint;
+  r->head_offset = next_head_offset;
+
+  // The descriptor must be written before the consumer can see it
+  RING_BARRIER();
+  r->head_bytes = head_bytes + footprint;
+  r->head_index = head_index + 1;
+
+  unsigned bytes = r->head_bytes - r->tail_bytes;
+  unsigned frames = r->head_index - r->tail_index;
+  if (bytes > r->peak_bytes)
+    r->peak_bytes = bytes;
+  if (frames > r->peak_frames)
+    r->peak_frames = frames;
+  return 1;
+}
+
+unsigned buffers_ring_pending(unsigned ring)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  unsigned pending = r->head_index - r->tail_index;
+
+  // The descriptors counted can only be read after this
+  RING_BARRIER();
+  return pending;
+}
+
+uintptr_t buffers_ring_peek(unsigned ring, unsigned offset)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  unsigned tail_index = r->tail_index;
+  RING_BARRIER();
+  return r->pointers[(tail_index + offset) % BUFFERS_RING_DESCRIPTORS];
+}
+
+unsigned buffers_ring_peek_length(unsigned ring, unsigned offset)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  unsigned tail_index = r->tail_index;
+  RING_BARRIER();
+  return r->length_in_bytes[(tail_index + offset) % BUFFERS_RING_DESCRIPTORS];
+}
+
+void buffers_ring_release(unsigned ring, unsigned count)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  unsigned tail_index = r->tail_index;
+  unsigned tail_bytes = r->tail_bytes;
+
+  for (unsigned i = 0; i < count; i++)
+    tail_bytes += r->footprint[(tail_index + i) % BUFFERS_RING_DESCRIPTORS];
+
+  // The descriptors must be read before the producer can reuse them
+  RING_BARRIER();
+  r->tail_bytes = tail_bytes;
+  r->tail_index = tail_index + count;
+}
+
+void buffers_ring_get_occupancy(unsigned ring, buffers_ring_occupancy_t *occupancy)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  unsigned tail_bytes = r->tail_bytes;
+  unsigned tail_index = r->tail_index;
+
+  occupancy->capacity_bytes = BUFFERS_RING_BYTES;
+  occupancy->bytes = r->head_bytes - tail_bytes;
+  occupancy->frames = r->head_index - tail_index;
+  occupancy->peak_bytes = r->peak_bytes;
+  occupancy->peak_frames = r->peak_frames;
+}
+
+int buffers_rings_oldest_after(const unsigned offsets[PCAPNG_NUM_INTERFACES])
+{
+  int oldest = -1;
+  unsigned oldest_time = 0;
+
+  for (unsigned i = 0; i < PCAPNG_NUM_INTERFACES; i++) {
+    if (buffers_ring_pending(i) > offsets[i]) {
+      enhanced_packet_block_t *epb = (enhanced_packet_block_t *)buffers_ring_peek(i, offsets[i]);
+      if (oldest == -1 || (int)(epb->timestamp_low - oldest_time) < 0) {
+        oldest = i;
+        oldest_time = epb->timestamp_low;
+      }
+    }
+  }
+  return oldest;
+}
+
+int buffers_rings_oldest()
+{
+  unsigned offsets[PCAPNG_NUM_INTERFACES] = {0};
+  return buffers_rings_oldest_after(offsets);
+}
+
+uintptr_t buffers_ring_statistics(unsigned ring)
+{
+  buffers_ring_t *r = &g_rings[ring];
+  interface_statistics_block_t *isb = &g_statistics[ring];
+  unsigned drop_count = r->drop_count;
+  RING_BARRIER();
+
+  if (drop_count == r->reported_drop_count)
+    return 0;
+
+  isb->block_type = PCAPNG_BLOCK_INTERFACE_STATISTICS;
+  isb->block_total_len_pre = sizeof(interface_statistics_block_t);
+  isb->interface_id = ring;
+  isb->timestamp_high = r->drop_timestamp_high;
+  isb->timestamp_low = r->drop_timestamp_low;
+  isb->isb_ifdrop_code = PCAPNG_OPTION_ISB_IFDROP;
+  isb->isb_ifdrop_length = 8;
+  isb->isb_ifdrop_low = drop_count;
+  isb->isb_ifdrop_high = 0;
+  isb->end_of_opt_code = PCAPNG_OPTION_END_OF_OPT;
+  isb->end_of_opt_length = 0;
+  isb->block_total_len_post = sizeof(interface_statistics_block_t);
+
+  r->reported_drop_count = drop_count;
+  return (uintptr_t)isb;
+}
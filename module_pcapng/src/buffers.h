@@ -6,6 +6,15 @@
 #include "pcapng.h"
 #include "pcapng_conf.h"
 
+/*
+ * The overload policy when the buffers run out. When set the receiver
+ * overwrites the buffer it has just filled and the frame is counted as
+ * dropped. Otherwise the receiver waits until a buffer is available.
+ */
+#ifndef PCAPNG_DROP_ON_OVERFLOW
+#define PCAPNG_DROP_ON_OVERFLOW 1
+#endif
+
 /* Enough room to cope with a double VLAN-tagged packet */
 #define MAX_BUFFER_SIZE (CAPTURE_BYTES + PCAPNG_EPB_OVERHEAD_BYTES)
 
@@ -30,6 +39,111 @@ void buffers_used_initialise(REFERENCE_PARAM(buffers_used_t, used));
 void buffers_used_add(REFERENCE_PARAM(buffers_used_t, used), uintptr_t buffer, unsigned length_in_bytes);
 int buffers_used_full(REFERENCE_PARAM(buffers_used_t, used));
 
+/*
+ * Each MII receiver has a single-producer/single-consumer ring of buffer
+ * descriptors built on a circular byte arena carved out of the g_buffer pool
+ * (the pool is split evenly between the rings). The receiver writes into the
+ * space claimed at the head of its arena and publishes the block with its
+ * actual length, so blocks are packed back to back rather than each using
+ * MAX_BUFFER_SIZE bytes. When there are fewer than MAX_BUFFER_SIZE bytes left
+ * at the end of the arena the next block starts back at the beginning.
+ *
+ * Only the producer writes the head and only the consumer writes the tail, so
+ * neither a lock nor a control core is needed. There is always room for a
+ * MAX_BUFFER_SIZE block for the receiver to write into.
+ *
+ * The gain is only for captures longer than a minimum sized frame. With 128
+ * byte captures (app_pcapng) an 8000 byte arena holds 81 minimum sized frames
+ * where the slots held 49. With 64 byte captures every block is MAX_BUFFER_SIZE
+ * bytes and it holds as many as the slots did.
+ */
+#define BUFFERS_RING_BYTES ((BUFFER_COUNT / PCAPNG_NUM_INTERFACES) * MAX_BUFFER_SIZE)
+
+/* The smallest block is a minimum sized frame (or the capture length if less) */
+#define BUFFERS_MIN_BLOCK_SIZE \
+  ((CAPTURE_BYTES < 64 ? CAPTURE_BYTES : 64) + PCAPNG_EPB_OVERHEAD_BYTES)
+
+/*
+ * Enough descriptors for an arena full of the smallest blocks
+ */
+#ifndef BUFFERS_RING_DESCRIPTORS
+#define BUFFERS_RING_DESCRIPTORS (BUFFERS_RING_BYTES / BUFFERS_MIN_BLOCK_SIZE)
+#endif
+
+/*
+ * Occupancy of a ring. The peaks are the highest values seen since the start
+ * of capture.
+ */
+typedef struct buffers_ring_occupancy_t {
+  uint32_t capacity_bytes;
+  uint32_t bytes;             // Bytes of the arena in use, including any wasted at the end
+  uint32_t frames;
+  uint32_t peak_bytes;
+  uint32_t peak_frames;
+} buffers_ring_occupancy_t;
+
+/*
+ * Called by the producer before it claims its first buffer.
+ */
+void buffers_ring_initialise(unsigned ring);
+
+/*
+ * Get the buffer the producer should write the next frame into. There are at
+ * least MAX_BUFFER_SIZE bytes available.
+ */
+uintptr_t buffers_ring_claim(unsigned ring);
+
+/*
+ * Publish the block of length_in_bytes written to the claimed buffer. If there
+ * is then no room left to claim the next buffer the frame is dropped and
+ * counted (the next claim returns the same buffer). Returns 0 if the frame was
+ * dropped.
+ */
+int buffers_ring_publish(unsigned ring, unsigned length_in_bytes);
+
+/*
+ * The number of buffers waiting for the consumer.
+ */
+unsigned buffers_ring_pending(unsigned ring);
+
+/*
+ * Access the buffer at the given offset from the tail of the ring. The offset
+ * must be less than buffers_ring_pending().
+ */
+uintptr_t buffers_ring_peek(unsigned ring, unsigned offset);
+unsigned buffers_ring_peek_length(unsigned ring, unsigned offset);
+
+/*
+ * Return the given number of buffers from the tail of the ring to the producer.
+ */
+void buffers_ring_release(unsigned ring, unsigned count);
+
+/*
+ * Get the current and peak occupancy of the ring.
+ */
+void buffers_ring_get_occupancy(unsigned ring,
+    REFERENCE_PARAM(buffers_ring_occupancy_t, occupancy));
+
+/*
+ * Returns the ring whose oldest pending frame has the earliest timestamp, or
+ * -1 if all the rings are empty.
+ */
+int buffers_rings_oldest();
+
+/*
+ * As buffers_rings_oldest(), but skipping the given number of pending frames
+ * of each ring (those the consumer has peeked at but not yet released).
+ */
+int buffers_rings_oldest_after(const unsigned offsets[PCAPNG_NUM_INTERFACES]);
+
+/*
+ * If frames have been dropped on the ring since the last call, returns a
+ * pointer to an Interface Statistics Block reporting the drop count (of
+ * length sizeof(interface_statistics_block_t)). Otherwise returns 0. Must only
+ * be called by the consumer.
+ */
+uintptr_t buffers_ring_statistics(unsigned ring);
+
 #ifdef __XC__
 {uintptr_t, unsigned} buffers_used_take(REFERENCE_PARAM(buffers_used_t, used));
 #endif
@@ -0,0 +1,180 @@
+/*
+ * Capture filter evaluation. The fields are extracted lazily from the
+ * captured bytes of the frame so a frame is only parsed as far as the
+ * program needs.
+ */
+#include <string.h>
+#include "filter.h"
+
+#define ETHERTYPE_VLAN      0x8100
+#define ETHERTYPE_QINQ      0x88a8
+#define ETHERTYPE_IPV4      0x0800
+#define ETHERTYPE_IPV6      0x86dd
+#define IP_PROTO_TCP        6
+#define IP_PROTO_UDP        17
+
+// Marks a field which is not present in the frame
+#define FIELD_ABSENT        0xffffffff
+
+typedef struct frame_t {
+  const uint8_t *data;
+  unsigned len;
+  unsigned l3_offset;     // Offset of the header after the VLAN tags
+  unsigned ethertype;
+  unsigned vlan_id;
+  unsigned l4_offset;     // Offset of the TCP/UDP header, 0 if not known
+  unsigned ip_proto;
+} frame_t;
+
+static unsigned get16(const frame_t *f, unsigned offset)
+{
+  if (offset + 2 > f->len)
+    return FIELD_ABSENT;
+  return (f->data[offset] << 8) | f->data[offset + 1];
+}
+
+static unsigned get32(const frame_t *f, unsigned offset)
+{
+  if (offset + 4 > f->len)
+    return FIELD_ABSENT;
+  return ((unsigned)f->data[offset] << 24) | (f->data[offset + 1] << 16) |
+         (f->data[offset + 2] << 8) | f->data[offset + 3];
+}
+
+static void parse_l2(frame_t *f)
+{
+  unsigned offset = 12;
+  unsigned ethertype = get16(f, offset);
+
+  f->vlan_id = FIELD_ABSENT;
+  while (ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) {
+    if (f->vlan_id == FIELD_ABSENT) {
+      unsigned tci = get16(f, offset + 2);
+      f->vlan_id = (tci == FIELD_ABSENT) ? FIELD_ABSENT : (tci & 0xfff);
+    }
+    offset += 4;
+    ethertype = get16(f, offset);
+  }
+  f->ethertype = ethertype;
+  f->l3_offset = offset + 2;
+}
+
+static void parse_l3(frame_t *f)
+{
+  unsigned offset = f->l3_offset;
+
+  f->ip_proto = FIELD_ABSENT;
+  f->l4_offset = 0;
+  if (f->ethertype == ETHERTYPE_IPV4 && offset + 20 <= f->len) {
+    unsigned ihl = (f->data[offset] & 0xf) * 4;
+    f->ip_proto = f->data[offset + 9];
+    f->l4_offset = offset + ihl;
+  } else if (f->ethertype == ETHERTYPE_IPV6 && offset + 40 <= f->len) {
+    // Extension headers are not followed
+    f->ip_proto = f->data[offset + 6];
+    f->l4_offset = offset + 40;
+  }
+  if (f->ip_proto != IP_PROTO_TCP && f->ip_proto != IP_PROTO_UDP)
+    f->l4_offset = 0;
+}
+
+void pcapng_filter_init(pcapng_filter_t *filter)
+{
+  memset(filter, 0, sizeof(*filter));
+}
+
+int pcapng_filter_load(pcapng_filter_t *filter, const uint32_t words[], unsigned num_words)
+{
+  const pcapng_filter_program_t *program = (const pcapng_filter_program_t *)words;
+
+  if (num_words < 1 || program->num_insns > PCAPNG_FILTER_MAX_INSNS)
+    return 1;
+  if (num_words < 1 + program->num_insns * (sizeof(pcapng_filter_insn_t) / 4))
+    return 1;
+
+  for (unsigned i = 0; i < program->num_insns; i++) {
+    const pcapng_filter_insn_t *insn = &program->insns[i];
+    if (insn->op >= PCAPNG_FILTER_NUM_OPS)
+      return 1;
+    // Jumps must land inside the program (the final instruction must return)
+    if (insn->op != PCAPNG_FILTER_OP_RET_ACCEPT && insn->op != PCAPNG_FILTER_OP_RET_REJECT &&
+        (i + 1 + insn->jt >= program->num_insns || i + 1 + insn->jf >= program->num_insns))
+      return 1;
+  }
+
+  filter->program.num_insns = 0;
+  memcpy(filter->program.insns, program->insns, program->num_insns * sizeof(pcapng_filter_insn_t));
+  filter->program.num_insns = program->num_insns;
+  memset(filter->counts, 0, sizeof(filter->counts));
+  return 0;
+}
+
+static int run_program(const pcapng_filter_program_t *program, frame_t *f)
+{
+  int l2_parsed = 0;
+  int l3_parsed = 0;
+  unsigned pc = 0;
+
+  if (program->num_insns == 0)
+    return 1;
+
+  while (pc < program->num_insns) {
+    const pcapng_filter_insn_t *insn = &program->insns[pc];
+    unsigned field = FIELD_ABSENT;
+
+    if (insn->op >= PCAPNG_FILTER_OP_IP_PROTO && insn->op <= PCAPNG_FILTER_OP_DST_PORT && !l3_parsed) {
+      if (!l2_parsed)
+        parse_l2(f);
+      parse_l3(f);
+      l2_parsed = l3_parsed = 1;
+    } else if (insn->op <= PCAPNG_FILTER_OP_VLAN_ID && !l2_parsed) {
+      parse_l2(f);
+      l2_parsed = 1;
+    }
+
+    switch (insn->op) {
+      case PCAPNG_FILTER_OP_ETHERTYPE:  field = f->ethertype;  break;
+      case PCAPNG_FILTER_OP_VLAN_ID:    field = f->vlan_id;    break;
+      case PCAPNG_FILTER_OP_DST_MAC_HI: field = get16(f, 0);   break;
+      case PCAPNG_FILTER_OP_DST_MAC_LO: field = get32(f, 2);   break;
+      case PCAPNG_FILTER_OP_SRC_MAC_HI: field = get16(f, 6);   break;
+      case PCAPNG_FILTER_OP_SRC_MAC_LO: field = get32(f, 8);   break;
+      case PCAPNG_FILTER_OP_IP_PROTO:   field = f->ip_proto;   break;
+      case PCAPNG_FILTER_OP_SRC_PORT:
+        field = f->l4_offset ? get16(f, f->l4_offset) : FIELD_ABSENT;
+        break;
+      case PCAPNG_FILTER_OP_DST_PORT:
+        field = f->l4_offset ? get16(f, f->l4_offset + 2) : FIELD_ABSENT;
+        break;
+      case PCAPNG_FILTER_OP_RET_ACCEPT:
+        return 1;
+      default:
+        return 0;
+    }
+
+    if (field != FIELD_ABSENT && field == insn->value)
+      pc += 1 + insn->jt;
+    else
+      pc += 1 + insn->jf;
+  }
+  return 0;
+}
+
+int pcapng_filter_apply(pcapng_filter_t *filter, uintptr_t buffer)
+{
+  enhanced_packet_block_t *epb = (enhanced_packet_block_t *)buffer;
+  frame_t f;
+
+  f.data = (const uint8_t *)&epb->data;
+  f.len = epb->captured_len;
+
+  int accept = run_program(&filter->program, &f);
+
+  if (epb->interface_id < PCAPNG_NUM_INTERFACES) {
+    if (accept)
+      filter->counts[epb->interface_id].accepted++;
+    else
+      filter->counts[epb->interface_id].rejected++;
+  }
+  return accept;
+}
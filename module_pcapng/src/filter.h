@@ -0,0 +1,129 @@
+/**
+ * \brief   A small capture filter, a subset of BPF, that is evaluated on each
+ *          Enhanced Packet Block before it is queued for output. The program
+ *          format is shared with the host which compiles the filter
+ *          expressions and uploads them over xscope.
+ */
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stdint.h>
+#include "pcapng.h"
+
+#ifdef __XC__
+extern "C" {
+#endif
+
+/*
+ * A program has to fit into a single 256 byte xscope upload from the host
+ * along with the command word and the program length.
+ */
+#define PCAPNG_FILTER_MAX_INSNS 30
+
+/*
+ * Each instruction loads a field from the frame and compares it against the
+ * value. If the field is not present in the frame (e.g. a port in a non-IP
+ * frame) then it does not match. The two return instructions end the program.
+ */
+typedef enum {
+  PCAPNG_FILTER_OP_ETHERTYPE = 0,   // Ethertype after any VLAN tags
+  PCAPNG_FILTER_OP_VLAN_ID,         // VID of the outer VLAN tag
+  PCAPNG_FILTER_OP_DST_MAC_HI,      // Top 16 bits of the destination MAC
+  PCAPNG_FILTER_OP_DST_MAC_LO,      // Bottom 32 bits of the destination MAC
+  PCAPNG_FILTER_OP_SRC_MAC_HI,      // Top 16 bits of the source MAC
+  PCAPNG_FILTER_OP_SRC_MAC_LO,      // Bottom 32 bits of the source MAC
+  PCAPNG_FILTER_OP_IP_PROTO,        // IPv4 protocol or IPv6 next header
+  PCAPNG_FILTER_OP_SRC_PORT,        // TCP/UDP source port
+  PCAPNG_FILTER_OP_DST_PORT,        // TCP/UDP destination port
+  PCAPNG_FILTER_OP_RET_ACCEPT,
+  PCAPNG_FILTER_OP_RET_REJECT,
+  PCAPNG_FILTER_NUM_OPS
+} pcapng_filter_op_t;
+
+/**
+ * \var     typedef pcapng_filter_insn_t
+ * \brief   A single filter instruction. The jumps are relative to the next
+ *          instruction and can only go forwards so every program terminates.
+ */
+typedef struct pcapng_filter_insn_t {
+  uint8_t op;       // One of pcapng_filter_op_t
+  uint8_t jt;       // Instructions to skip when the field matches
+  uint8_t jf;       // Instructions to skip when the field does not match
+  uint8_t reserved;
+  uint32_t value;   // Value the field is compared against
+} pcapng_filter_insn_t;
+
+/**
+ * \var     typedef pcapng_filter_program_t
+ * \brief   A complete filter program. A program with no instructions accepts
+ *          every frame. Running off the end of a program rejects the frame.
+ */
+typedef struct pcapng_filter_program_t {
+  uint32_t num_insns;
+  pcapng_filter_insn_t insns[PCAPNG_FILTER_MAX_INSNS];
+} pcapng_filter_program_t;
+
+#define PCAPNG_FILTER_PROGRAM_WORDS (sizeof(pcapng_filter_program_t) / 4)
+
+/**
+ * \var     typedef pcapng_filter_counts_t
+ * \brief   Number of frames accepted and rejected on an interface. These are
+ *          sent to the host as a record of PCAPNG_NUM_INTERFACES entries.
+ */
+typedef struct pcapng_filter_counts_t {
+  uint32_t accepted;
+  uint32_t rejected;
+} pcapng_filter_counts_t;
+
+/**
+ * \var     typedef pcapng_filter_t
+ * \brief   The active program and its counters.
+ */
+typedef struct pcapng_filter_t {
+  pcapng_filter_program_t program;
+  pcapng_filter_counts_t counts[PCAPNG_NUM_INTERFACES];
+} pcapng_filter_t;
+
+#if defined(__XC__) || defined(__xcore__)
+#include <xccompat.h>
+
+/**
+ * \brief   Initialise the filter to accept all frames and clear the counters.
+ */
+void pcapng_filter_init(REFERENCE_PARAM(pcapng_filter_t, filter));
+
+/**
+ * \brief   Replace the active program. The program is validated first and the
+ *          existing program is kept if it is not valid.
+ *
+ * \param   words       The program as uploaded by the host.
+ * \param   num_words   Number of words in the program.
+ *
+ * \return  0 if the program was loaded, non-zero if it was rejected.
+ */
+int pcapng_filter_load(REFERENCE_PARAM(pcapng_filter_t, filter),
+    const uint32_t words[], unsigned num_words);
+
+/**
+ * \brief   Run the filter on a buffer containing an Enhanced Packet Block and
+ *          update the counters of the interface that it was captured on.
+ *
+ * \return  Non-zero if the frame is accepted.
+ */
+int pcapng_filter_apply(REFERENCE_PARAM(pcapng_filter_t, filter), uintptr_t buffer);
+#endif
+
+#ifdef __XC__
+}
+
+/**
+ * \brief   The interface used by the host listener to manage the filter.
+ */
+interface pcapng_filter_if {
+  int set_program(const uint32_t words[n], unsigned n);
+  pcapng_filter_counts_t get_counts(unsigned interface_id);
+};
+#endif
+
+#endif // __FILTER_H__
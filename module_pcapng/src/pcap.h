@@ -7,6 +7,9 @@ extern "C" {
 
 #define DATA_LINK_ETHERNET 1
 
+#define PCAP_MAGIC_MICROSECONDS 0xA1B2C3D4
+#define PCAP_MAGIC_NANOSECONDS  0xA1B23C4D
+
 typedef struct pcap_hdr_s {
   uint32_t magic_number;   /* magic number */
   uint16_t version_major;  /* major version number */
@@ -19,7 +22,7 @@ typedef struct pcap_hdr_s {
 
 typedef struct pcaprec_hdr_s {
   uint32_t ts_sec;         /* timestamp seconds */
-  uint32_t ts_usec;        /* timestamp microseconds */
+  uint32_t ts_usec;        /* timestamp microseconds (nanoseconds with PCAP_MAGIC_NANOSECONDS) */
   uint32_t incl_len;       /* number of octets of packet saved in file */
   uint32_t orig_len;       /* actual length of packet */
 } pcaprec_hdr_t;
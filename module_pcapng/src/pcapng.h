@@ -5,14 +5,26 @@
 extern "C" {
 #endif
 
+// The tap has one MII receiver for each direction on the wire
+#define PCAPNG_NUM_INTERFACES 2
+
 enum pcap_ng_block_type_t {
   PCAPNG_BLOCK_SECTION_HEADER        = 0x0A0D0D0A,
   PCAPNG_BLOCK_INTERFACE_DESCRIPTION = 1,
   PCAPNG_BLOCK_SIMPLE_PACKET         = 3,
   PCAPNG_BLOCK_NAME_RESOLUTION       = 4,
+  PCAPNG_BLOCK_INTERFACE_STATISTICS  = 5,
   PCAPNG_BLOCK_ENHANCED_PACKET       = 6,
 };
 
+enum pcap_ng_option_t {
+  PCAPNG_OPTION_END_OF_OPT           = 0,
+  PCAPNG_OPTION_IF_NAME              = 2,
+  PCAPNG_OPTION_ISB_IFDROP           = 5,
+  PCAPNG_OPTION_IF_TSRESOL           = 9,
+  PCAPNG_OPTION_IF_TSOFFSET          = 14,
+};
+
 typedef struct section_block_header_t {
     uint32_t block_type;
     uint32_t block_total_len_pre;
@@ -28,8 +40,20 @@ typedef struct option_if_tsresol_t {
     uint16_t type;
     uint16_t length;
     uint8_t value;
+    uint8_t padding[3];
 } option_if_tsresol_t;
 
+/*
+ * The seconds added to the timestamps to get the absolute time. The 64-bit
+ * value is split into words so the block only needs word alignment.
+ */
+typedef struct option_if_tsoffset_t {
+    uint16_t type;
+    uint16_t length;
+    uint32_t value_low;
+    uint32_t value_high;
+} option_if_tsoffset_t;
+
 typedef struct interface_description_block_t {
     uint32_t block_type;
     uint32_t block_total_len_pre;
@@ -37,6 +61,9 @@ typedef struct interface_description_block_t {
     uint16_t reserved;
     uint32_t snap_len;
     option_if_tsresol_t if_tsresol;
+    option_if_tsoffset_t if_tsoffset;
+    uint16_t end_of_opt_code;
+    uint16_t end_of_opt_length;
     uint32_t block_total_len_post;
 } interface_description_block_t;
 
@@ -48,12 +75,31 @@ typedef struct enhanced_packet_block_t {
     uint32_t timestamp_low;
     uint32_t captured_len;
     uint32_t packet_len;
-    uintptr_t data; // Actually pointer to data - but needs to be uint32_t because host implementations 
+    uint32_t data; // Start of the data - uint32_t rather than uintptr_t so the layout is the same on 64-bit hosts
     // These items are not actually at this location in memory, but for buffer size calculations they need to be here
 //     uintptr_t options; // No options
     uint32_t block_total_len_post;
 } enhanced_packet_block_t;
 
+/*
+ * An Interface Statistics Block which only carries the isb_ifdrop option. The
+ * 64-bit option value is split into words so the block only needs word alignment.
+ */
+typedef struct interface_statistics_block_t {
+    uint32_t block_type;
+    uint32_t block_total_len_pre;
+    uint32_t interface_id;
+    uint32_t timestamp_high;
+    uint32_t timestamp_low;
+    uint16_t isb_ifdrop_code;
+    uint16_t isb_ifdrop_length;
+    uint32_t isb_ifdrop_low;
+    uint32_t isb_ifdrop_high;
+    uint16_t end_of_opt_code;
+    uint16_t end_of_opt_length;
+    uint32_t block_total_len_post;
+} interface_statistics_block_t;
+
 // The overhead of the Enhanced Packet Block structure (everything but the data pointer)
 // NOTE: the double cast is to work around compiler bug 14925
 #define PCAPNG_EPB_OVERHEAD_BYTES (sizeof(enhanced_packet_block_t) - sizeof(((enhanced_packet_block_t *)((enhanced_packet_block_t *)0))->data))
@@ -4,21 +4,39 @@
 #include <xs1.h>
 
 /*
- * A function to keep track of the top bits of a 64-bit counter
+ * Take the start of frame timestamp from the port counter rather than from a
+ * timer read once the receiver has woken up, so that it doesn't depend on how
+ * quickly the core is scheduled.
  */
-void pcapng_timer_server(streaming chanend c_clients[num_clients], unsigned num_clients);
+#ifndef PCAPNG_PORT_TIMESTAMPS
+#define PCAPNG_PORT_TIMESTAMPS 1
+#endif
 
 /*
  * Structure to keep all the port information for the RX interface
  */
 typedef struct {
   unsigned id;
+  int timestamp_offset;             /**< Calibrated delay from the SFD on the wire to it being
+                                         sampled by the port, in 10ns timer ticks */
   clock clk_mii_rx;                 /**< MII RX Clock Block **/
   in port p_mii_rxclk;              /**< MII RX clock wire */
   in buffered port:32 p_mii_rxd;    /**< MII RX data wire */
   in port p_mii_rxdv;               /**< MII RX data valid wire */
 } pcapng_mii_rx_t;
 
-void pcapng_receiver(streaming chanend rx, pcapng_mii_rx_t &mii, streaming chanend c_time_server);
+/*
+ * Capture frames into the descriptor ring of the interface (mii.id). See buffers.h.
+ * The timestamps are extended to 64 bits using the epoch in timestamp.h, which
+ * must be kept up to date by another core on the same tile.
+ */
+void pcapng_receiver(pcapng_mii_rx_t &mii);
+
+/*
+ * A stand-in for pcapng_receiver which generates frames of frame_bytes bytes
+ * into the descriptor ring of the interface as fast as it can. Used to
+ * benchmark the buffer pipeline.
+ */
+void pcapng_frame_generator(unsigned id, unsigned frame_bytes);
 
 #endif // __RECEIVER_H__
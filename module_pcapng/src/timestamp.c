@@ -0,0 +1,49 @@
+/*
+ * A seqlock protecting the epoch. The sequence number is odd while the writer
+ * is part way through an update.
+ */
+#include "timestamp.h"
+
+static volatile unsigned g_sequence = 0;
+static volatile unsigned g_epoch_low = 0;
+static volatile unsigned g_epoch_high = 0;
+
+void pcapng_timestamp_update(unsigned now)
+{
+  unsigned epoch_low = g_epoch_low;
+  unsigned epoch_high = g_epoch_high;
+
+  if (now < epoch_low)
+    epoch_high++;
+
+  g_sequence++;
+  g_epoch_low = now;
+  g_epoch_high = epoch_high;
+  g_sequence++;
+}
+
+unsigned pcapng_timestamp_high(unsigned time)
+{
+  unsigned sequence;
+  unsigned epoch_low;
+  unsigned epoch_high;
+
+  do {
+    sequence = g_sequence;
+    epoch_low = g_epoch_low;
+    epoch_high = g_epoch_high;
+  } while ((sequence & 1) || sequence != g_sequence);
+
+  // Until the first update the time is in the first wrap of the timer, as the
+  // first update will find it
+  if (sequence == 0)
+    return 0;
+
+  // The time can be either side of the epoch
+  int delta = (int)(time - epoch_low);
+  if (delta >= 0 && time < epoch_low)
+    return epoch_high + 1;
+  if (delta < 0 && time > epoch_low)
+    return epoch_high - 1;
+  return epoch_high;
+}
@@ -0,0 +1,34 @@
+#ifndef __TIMESTAMP_H__
+#define __TIMESTAMP_H__
+
+#ifdef __XC__
+extern "C" {
+#endif
+
+/*
+ * Extension of the 32-bit reference timer to the 64-bit pcapng timestamps.
+ *
+ * A single writer keeps a shared epoch (the full 64-bit time of a recent timer
+ * value) up to date in a seqlock, and the receivers extend their timestamps
+ * from it without any channel communication. The extension is correct as long
+ * as the epoch is within 2^31 timer ticks (21 seconds) of the timestamp, so
+ * pcapng_timestamp_update() must be called when the writer starts and at least
+ * every few seconds after. The readers and the writer must be on the same tile.
+ */
+
+/*
+ * Advance the epoch to the current timer value. Must only be called by one
+ * core.
+ */
+void pcapng_timestamp_update(unsigned now);
+
+/*
+ * Return the top 32 bits of the 64-bit time of the given timer value.
+ */
+unsigned pcapng_timestamp_high(unsigned time);
+
+#ifdef __XC__
+}
+#endif
+
+#endif // __TIMESTAMP_H__